@@ -4,6 +4,7 @@
 #include "opencv2/objdetect.hpp"
 #include <opencv2/ml.hpp>
 #include "cropEyeRegion.h"
+#include "hogFeatures.h"
 
 using namespace cv::ml;
 using namespace cv;
@@ -69,7 +70,7 @@ void getFileNames(string dirName, vector<string> &imageFnames)
   }
 }
 
-void loadTrainTestLabel(string &pathName, vector<Mat> &trainImages, vector<Mat> &testImages, vector<int> &trainLabels, vector<int> &testLabels, int classVal, float testFraction = 0.2)
+void loadTrainTestLabel(string &pathName, vector<string> &trainImages, vector<string> &testImages, vector<int> &trainLabels, vector<int> &testLabels, int classVal, float testFraction = 0.2)
 {
   vector<string> imageFiles;
 
@@ -80,15 +81,14 @@ void loadTrainTestLabel(string &pathName, vector<Mat> &trainImages, vector<Mat>
 
   for (int counter = 0; counter < totalImages ; counter++)
   {
-    Mat image = imread(imageFiles[counter]);
     if(counter < nTest)
     {
-        testImages.push_back(image);
+        testImages.push_back(imageFiles[counter]);
         testLabels.push_back(classVal);
     }
     else
     {
-        trainImages.push_back(image);
+        trainImages.push_back(imageFiles[counter]);
         trainLabels.push_back(classVal);
     }
   }
@@ -108,25 +108,6 @@ HOGDescriptor hog(
                 64,//nlevels=64
                 1);//signedGradient
 
-void CreateHOG(vector<vector<float> > &HOG, vector<Mat> &Images)
-{
-  for(int y = 0; y < Images.size(); y++)
-  {
-    vector<float> descriptors;
-    hog.compute(Images[y],descriptors);
-    HOG.push_back(descriptors);
-  }
-}
-
-void ConvertVectortoMatrix(vector<vector<float> > &HOG, Mat &samples)
-{
-  int descriptor_size = HOG[0].size();
-
-  for(int i = 0; i < HOG.size(); i++)
-    for(int j = 0; j < descriptor_size; j++)
-      samples.at<float>(i,j) = HOG[i][j];
-}
-
 void getSVMParams(Ptr<SVM> svm)
 {
   cout << "Kernel type     : " << svm->getKernelType() << endl;
@@ -173,8 +154,8 @@ void SVMevaluate(Mat &testResponse, float &count, float &accuracy, vector<int> &
 
 int main(int argc, char **argv)
 {
-  vector<Mat> trainImages;
-  vector<Mat> testImages;
+  vector<string> trainImages;
+  vector<string> testImages;
   vector<int> trainLabels;
   vector<int> testLabels;
 
@@ -187,21 +168,17 @@ int main(int argc, char **argv)
   loadTrainTestLabel(path2, trainImages, testImages, trainLabels, testLabels, 1);
 
   ////////// Feature computation for the data  ///////////
-  std::vector<std::vector<float> > trainHOG;
-  std::vector<std::vector<float> > testHOG;
-  CreateHOG(trainHOG, trainImages);
-  CreateHOG(testHOG, testImages);
-
-  int descriptor_size = trainHOG[0].size();
+  // Images are read and their HOG features computed in parallel, straight
+  // into the matrices recognized by SVM model
+  // HOG features computed by earlier runs with the same HOG parameters are
+  // loaded from a cache instead of being computed again
+  HOGFeatureCache hogCache(hogCachePath("eyeGlassesHOG", hog), hog);
+  Mat trainMat = computeHOGMatrix(hog, trainImages, trainLabels, &hogCache);
+  Mat testMat = computeHOGMatrix(hog, testImages, testLabels, &hogCache);
+
+  int descriptor_size = trainMat.cols;
   cout << "Descriptor Size : " << descriptor_size << endl;
 
-  // Convert hog data into features recognized by SVM model
-  Mat trainMat(trainHOG.size(), descriptor_size, CV_32FC1);
-  Mat testMat(testHOG.size(), descriptor_size, CV_32FC1);
-
-  ConvertVectortoMatrix(trainHOG, trainMat);
-  ConvertVectortoMatrix(testHOG, testMat);
-
   float C = 2.5, gamma = 0.02;
 
   Mat testResponse;
@@ -236,13 +213,8 @@ int main(int argc, char **argv)
   vector<Mat> testImageArray;
   testImageArray.push_back(cropped);
 
-  // Compute HOG descriptors
-  std::vector<std::vector<float> > testHOGArray;
-  CreateHOG(testHOGArray, testImageArray);
-
-  // Convert the descriptors to Mat
-  Mat testSample(testHOGArray.size(), descriptor_size, CV_32FC1);
-  ConvertVectortoMatrix(testHOGArray, testSample);
+  // Compute HOG descriptors into a Mat
+  Mat testSample = computeHOGMatrix(hog, testImageArray);
 
   // We will load the model again and test the model
   // This is just to explain how to load an SVM model
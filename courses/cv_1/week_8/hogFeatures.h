@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include "opencv2/objdetect.hpp"
+
+using namespace std;
+using namespace cv;
+
+// HOG descriptor of image written into row, a 1 x descriptorSize CV_32F row
+// of the feature matrix. descriptor is a buffer reused between images.
+// Images larger than the HOG window give one descriptor per window position,
+// only the first one, at the top left corner, is kept.
+void computeHOGRow(const HOGDescriptor &hog, const Mat &image, Mat row, vector<float> &descriptor)
+{
+  hog.compute(image, descriptor);
+  if ((int)descriptor.size() < row.cols) {
+    CV_Error(Error::StsBadSize, cv::format("HOG descriptor of a %dx%d image has %d values, expected %d: images "
+                                           "must be at least as large as the HOG window", image.cols, image.rows,
+                                           (int)descriptor.size(), row.cols));
+  }
+  memcpy(row.ptr<float>(), descriptor.data(), row.cols * sizeof(float));
+}
+
+// Compute HOG features for given images, one row per image in a CV_32F
+// matrix ready for the SVM. Images are processed in parallel.
+Mat computeHOGMatrix(const HOGDescriptor &hog, const vector<Mat> &images)
+{
+  Mat features((int)images.size(), (int)hog.getDescriptorSize(), CV_32F);
+  parallel_for_(Range(0, (int)images.size()), [&](const Range &range) {
+    vector<float> descriptor;
+    for (int i = range.start; i < range.end; i++) {
+      computeHOGRow(hog, images[i], features.row(i), descriptor);
+    }
+  });
+  return features;
+}
+
+// 64-bit FNV-1a hash of size bytes
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Hash of the complete HOG parameter set, as saved by HOGDescriptor::write
+uint64_t hashHOGParameters(const HOGDescriptor &hog)
+{
+  FileStorage fs(".yml", FileStorage::WRITE | FileStorage::MEMORY);
+  hog.write(fs, "hog");
+  string parameters = fs.releaseAndGetString();
+  return hashBytes(parameters.data(), parameters.size());
+}
+
+// Path of the cache file for the features of hog, named after its parameters
+// so that every parameter set has its own file
+string hogCachePath(const string &prefix, const HOGDescriptor &hog)
+{
+  return prefix + cv::format("_%016llx.hogcache", (unsigned long long)hashHOGParameters(hog));
+}
+
+// On-disk cache of HOG descriptors, keyed by the hash of the image file
+// contents, for one HOG parameter set. The file is a header followed by two
+// flat arrays, every section 8-byte aligned so the file can be mapped as is:
+//   HOGCacheHeader
+//   uint64_t keys[count]                    ascending
+//   float features[count][descriptorSize]  in the order of keys
+// A file written for other parameters, or with another layout, is ignored
+// and replaced on the next save().
+struct HOGCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t descriptorSize;
+  uint64_t parameters;
+  uint64_t count;
+};
+
+class HOGFeatureCache
+{
+public:
+  HOGFeatureCache(const string &path, const HOGDescriptor &hog)
+    : path(path), parameters(hashHOGParameters(hog)), descriptorSize((int)hog.getDescriptorSize())
+  {
+    ifstream file(path.c_str(), ios::binary);
+    HOGCacheHeader header;
+    if (!file.read((char *)&header, sizeof(header)))
+      return;
+    if (memcmp(header.magic, magic(), sizeof(header.magic)) != 0 || header.version != 1 ||
+        header.parameters != parameters || header.descriptorSize != (uint32_t)descriptorSize) {
+      cout << "Ignoring HOG cache " << path << ", written for other parameters" << endl;
+      return;
+    }
+    // a count the file cannot hold is not trusted for allocating
+    file.seekg(0, ios::end);
+    uint64_t payloadSize = (uint64_t)file.tellg() - sizeof(header);
+    if (header.count > payloadSize / (sizeof(uint64_t) + descriptorSize * sizeof(float))) {
+      cout << "Ignoring truncated HOG cache " << path << endl;
+      return;
+    }
+    file.seekg(sizeof(header), ios::beg);
+    keys.resize((size_t)header.count);
+    features.resize((size_t)header.count * descriptorSize);
+    if (!file.read((char *)keys.data(), keys.size() * sizeof(uint64_t)) ||
+        !file.read((char *)features.data(), features.size() * sizeof(float)) ||
+        !is_sorted(keys.begin(), keys.end())) {
+      cout << "Ignoring corrupt HOG cache " << path << endl;
+      keys.clear();
+      features.clear();
+    }
+  }
+
+  // Cached descriptor of the image with the given content hash, or NULL
+  const float *find(uint64_t key) const
+  {
+    vector<uint64_t>::const_iterator it = lower_bound(keys.begin(), keys.end(), key);
+    if (it == keys.end() || *it != key)
+      return NULL;
+    return &features[(it - keys.begin()) * descriptorSize];
+  }
+
+  // Add a descriptor, kept in memory until save(). Not thread safe.
+  void add(uint64_t key, const float *descriptor)
+  {
+    addedKeys.push_back(key);
+    addedFeatures.insert(addedFeatures.end(), descriptor, descriptor + descriptorSize);
+  }
+
+  // Merge the added descriptors into the cache and rewrite the file
+  void save()
+  {
+    if (addedKeys.empty())
+      return;
+    vector<pair<uint64_t, const float *> > entries;
+    for (size_t i = 0; i < keys.size(); i++)
+      entries.push_back(make_pair(keys[i], &features[i * descriptorSize]));
+    for (size_t i = 0; i < addedKeys.size(); i++)
+      entries.push_back(make_pair(addedKeys[i], &addedFeatures[i * descriptorSize]));
+    sort(entries.begin(), entries.end(),
+         [](const pair<uint64_t, const float *> &a, const pair<uint64_t, const float *> &b) { return a.first < b.first; });
+    // the same image may have been added twice
+    entries.erase(unique(entries.begin(), entries.end(),
+                         [](const pair<uint64_t, const float *> &a, const pair<uint64_t, const float *> &b) {
+                           return a.first == b.first;
+                         }), entries.end());
+
+    vector<uint64_t> mergedKeys(entries.size());
+    vector<float> mergedFeatures(entries.size() * descriptorSize);
+    for (size_t i = 0; i < entries.size(); i++) {
+      mergedKeys[i] = entries[i].first;
+      memcpy(&mergedFeatures[i * descriptorSize], entries[i].second, descriptorSize * sizeof(float));
+    }
+
+    // write next to the cache and rename, so an interrupted save keeps the old file
+    HOGCacheHeader header;
+    memcpy(header.magic, magic(), sizeof(header.magic));
+    header.version = 1;
+    header.descriptorSize = descriptorSize;
+    header.parameters = parameters;
+    header.count = mergedKeys.size();
+    string tempPath = path + ".tmp";
+    {
+      ofstream file(tempPath.c_str(), ios::binary);
+      file.write((const char *)&header, sizeof(header));
+      file.write((const char *)mergedKeys.data(), mergedKeys.size() * sizeof(uint64_t));
+      file.write((const char *)mergedFeatures.data(), mergedFeatures.size() * sizeof(float));
+      if (!file) {
+        cerr << "Unable to write HOG cache " << tempPath << endl;
+        return;
+      }
+    }
+    // rename does not replace an existing file on Windows, only then is
+    // the old cache removed first
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0 &&
+        (std::remove(path.c_str()) != 0 || std::rename(tempPath.c_str(), path.c_str()) != 0)) {
+      cerr << "Unable to write HOG cache " << path << endl;
+      return;
+    }
+
+    keys.swap(mergedKeys);
+    features.swap(mergedFeatures);
+    addedKeys.clear();
+    addedFeatures.clear();
+  }
+
+private:
+  static const char *magic() { return "HOGCACHE"; }
+
+  string path;
+  uint64_t parameters;
+  int descriptorSize;
+  vector<uint64_t> keys;
+  vector<float> features;
+  vector<uint64_t> addedKeys;
+  vector<float> addedFeatures;
+};
+
+// Contents of a file, empty if it cannot be read
+vector<uchar> readFileBytes(const string &path)
+{
+  ifstream file(path.c_str(), ios::binary | ios::ate);
+  if (!file)
+    return vector<uchar>();
+  vector<uchar> bytes((size_t)file.tellg());
+  file.seekg(0);
+  if (!file.read((char *)bytes.data(), bytes.size()))
+    return vector<uchar>();
+  return bytes;
+}
+
+// Read the images and compute their HOG features in parallel, without
+// keeping the images: every thread decodes an image and writes its
+// descriptor straight into its row of the matrix. Unreadable images are
+// reported and left out, along with their entry in labels.
+// With a cache, the descriptors of images already in it are copied from
+// the cache instead of being computed, and the new ones are saved to it.
+Mat computeHOGMatrix(const HOGDescriptor &hog, const vector<string> &imagePaths, vector<int> &labels,
+                     HOGFeatureCache *cache = NULL)
+{
+  CV_Assert(imagePaths.size() == labels.size());
+  Mat features((int)imagePaths.size(), (int)hog.getDescriptorSize(), CV_32F);
+  vector<uchar> readable(imagePaths.size(), 0);
+  vector<uchar> computed(imagePaths.size(), 0);
+  vector<uint64_t> keys(imagePaths.size());
+  parallel_for_(Range(0, (int)imagePaths.size()), [&](const Range &range) {
+    vector<float> descriptor;
+    for (int i = range.start; i < range.end; i++) {
+      vector<uchar> bytes = readFileBytes(imagePaths[i]);
+      if (bytes.empty())
+        continue;
+      if (cache) {
+        keys[i] = hashBytes(bytes.data(), bytes.size());
+        const float *cached = cache->find(keys[i]);
+        if (cached) {
+          memcpy(features.ptr<float>(i), cached, features.cols * sizeof(float));
+          readable[i] = 1;
+          continue;
+        }
+      }
+      Mat image = imdecode(bytes, IMREAD_COLOR);
+      if (image.empty())
+        continue;
+      computeHOGRow(hog, image, features.row(i), descriptor);
+      readable[i] = 1;
+      computed[i] = 1;
+    }
+  });
+
+  // Close the gaps left by unreadable images
+  int count = 0, computedCount = 0;
+  for (int i = 0; i < (int)imagePaths.size(); i++) {
+    if (!readable[i]) {
+      cerr << "Unable to read " << imagePaths[i] << ", skipped" << endl;
+      continue;
+    }
+    if (cache && computed[i]) {
+      cache->add(keys[i], features.ptr<float>(i));
+      computedCount++;
+    }
+    if (count != i) {
+      features.row(i).copyTo(features.row(count));
+      labels[count] = labels[i];
+    }
+    count++;
+  }
+  features.resize(count);
+  labels.resize(count);
+
+  if (cache) {
+    cout << "HOG features: " << count - computedCount << " from cache, " << computedCount << " computed" << endl;
+    cache->save();
+  }
+  return features;
+}
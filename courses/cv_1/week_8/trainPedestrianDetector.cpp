@@ -19,6 +19,7 @@
 #include <opencv2/imgproc.hpp>
 #include "opencv2/objdetect.hpp"
 #include <opencv2/ml.hpp>
+#include "hogFeatures.h"
 
 #ifdef _WIN32
   #include "dirent.h"
@@ -74,14 +75,13 @@ void getFileNames(string dirName, vector<string> &imageFnames)
   }
 }
 
-// read images in a folder
-// return vector of images and labels
-void getDataset(string &pathName, int classVal, vector<Mat> &images, vector<int> &labels) {
+// list images in a folder
+// return vector of image paths and labels
+void getDataset(string &pathName, int classVal, vector<string> &imagePaths, vector<int> &labels) {
   vector<string> imageFiles;
   getFileNames(pathName, imageFiles);
   for (int i = 0; i < imageFiles.size(); i++) {
-    Mat im = imread(imageFiles[i]);
-    images.push_back(im);
+    imagePaths.push_back(imageFiles[i]);
     labels.push_back(classVal);
   }
 }
@@ -101,27 +101,6 @@ HOGDescriptor hog(
                 64,    //nlevels=64
                 0);    //signedGradient
 
-// compute HOG features for given images
-void computeHOG(vector<vector<float> > &hogFeatures, vector<Mat> &images)
-{
-  for(int y = 0; y < images.size(); y++)
-  {
-    vector<float> descriptor;
-    hog.compute(images[y], descriptor);
-    hogFeatures.push_back(descriptor);
-  }
-}
-
-// Convert HOG descriptors to format recognized by SVM
-void prepareData(vector<vector<float> > &hogFeatures, Mat &data)
-{
-  int descriptorSize = hogFeatures[0].size();
-
-  for(int i = 0; i < hogFeatures.size(); i++)
-    for(int j = 0; j < descriptorSize; j++)
-      data.at<float>(i,j) = hogFeatures[i][j];
-}
-
 // Initialize SVM with parameters
 Ptr<SVM> svmInit(float C, float gamma)
 {
@@ -172,12 +151,16 @@ int main()
   string trainDir = rootDir + "train_64x128_H96/";
   string testDir = rootDir + "test_64x128_H96/";
 
+  // HOG features computed by earlier runs with the same HOG parameters are
+  // loaded from this cache instead of being computed again
+  HOGFeatureCache hogCache(hogCachePath("pedestrianHOG", hog), hog);
+
   // ================================ Train Model =============================================
   if (trainModel == 1) {
     string trainPosDir = trainDir + "posPatches/";
     string trainNegDir = trainDir + "negPatches/";
 
-    vector<Mat> trainPosImages, trainNegImages;
+    vector<string> trainPosImages, trainNegImages;
     vector<int> trainPosLabels, trainNegLabels;
 
     // Label 1 for positive images and -1 for negative images
@@ -189,7 +172,7 @@ int main()
     cout << "negative - " << trainNegImages.size() << " , " << trainNegLabels.size() << endl;
 
     // Append Positive/Negative Images/Labels for Training
-    vector<Mat> trainImages;
+    vector<string> trainImages;
     vector<int> trainLabels;
     trainImages = trainPosImages;
     trainImages.insert(trainImages.end(), trainNegImages.begin(), trainNegImages.end());
@@ -197,15 +180,10 @@ int main()
     trainLabels = trainPosLabels;
     trainLabels.insert(trainLabels.end(), trainNegLabels.begin(), trainNegLabels.end());
 
-    // Compute HOG features for images
-    vector<vector<float> > hogTrain;
-    computeHOG(hogTrain, trainImages);
-
-    // Convert hog features into data format recognized by SVM
-    int descriptorSize = hogTrain[0].size();
-    cout << "Descriptor Size : " << descriptorSize << endl;
-    Mat trainData(hogTrain.size(), descriptorSize, CV_32FC1);
-    prepareData(hogTrain, trainData);
+    // Read images and compute their HOG features, in parallel, into the
+    // data format recognized by SVM
+    Mat trainData = computeHOGMatrix(hog, trainImages, trainLabels, &hogCache);
+    cout << "Descriptor Size : " << trainData.cols << endl;
 
     // Initialize SVM object
     float C = 0.01, gamma = 0;
@@ -224,7 +202,7 @@ int main()
     string testPosDir = testDir + "posPatches/";
     string testNegDir = testDir + "negPatches/";
 
-    vector<Mat> testPosImages, testNegImages;
+    vector<string> testPosImages, testNegImages;
     vector<int> testPosLabels, testNegLabels;
 
     // Label 1 for positive images and -1 for negative images
@@ -237,14 +215,8 @@ int main()
 
     // =========== Test on Positive Images ===============
     // Compute HOG features for images
-    vector<vector<float> > hogPosTest;
-    computeHOG(hogPosTest, testPosImages);
-
-    // Convert hog features into data format recognized by SVM
-    int descriptorSize = hogPosTest[0].size();
-    cout << "Descriptor Size : " << descriptorSize << endl;
-    Mat testPosData(hogPosTest.size(), descriptorSize, CV_32FC1);
-    prepareData(hogPosTest, testPosData);
+    Mat testPosData = computeHOGMatrix(hog, testPosImages, testPosLabels, &hogCache);
+    cout << "Descriptor Size : " << testPosData.cols << endl;
     cout << testPosData.rows << " " << testPosData.cols << endl;
 
     // Run classification on test images
@@ -261,13 +233,8 @@ int main()
 
     // =========== Test on Negative Images ===============
     // Compute HOG features for images
-    vector<vector<float> > hogNegTest;
-    computeHOG(hogNegTest, testNegImages);
-
-    // Convert hog features into data format recognized by SVM
-    cout << "Descriptor Size : " << descriptorSize << endl;
-    Mat testNegData(hogNegTest.size(), descriptorSize, CV_32FC1);
-    prepareData(hogNegTest, testNegData);
+    Mat testNegData = computeHOGMatrix(hog, testNegImages, testNegLabels, &hogCache);
+    cout << "Descriptor Size : " << testNegData.cols << endl;
 
     // Run classification on test images
     Mat testNegPredict;
@@ -0,0 +1,106 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This code is made available to the students of
+ the online course titled "Computer Vision for Faces"
+ by Satya Mallick for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+ */
+
+#ifndef BIGVISION_framePool_HPP_
+#define BIGVISION_framePool_HPP_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// Holds the per-frame buffers of a video loop so that they are allocated
+// once and then recycled. Buffers are looked up by name once, before the
+// loop, and the returned references stay valid for the life of the pool.
+//
+// OpenCV functions (cap >> m, cv::resize, cv::cvtColor, ...) only allocate
+// their output when its size or type changes, so writing into a pool buffer
+// is free after the first frame. Previous and current frames are exchanged
+// with cv::swap, which swaps Mat headers and never copies pixels.
+//
+// allocations() counts every time a buffer ended up with new memory. Call it
+// once per frame; after warm up steadyStateAllocations() should stay at 0.
+// Only buffers held by the pool are counted, temporary Mats and vectors
+// created elsewhere in the loop are not seen.
+class FramePool
+{
+  public:
+    FramePool() : numAllocations(0), numAllocationsAtSteadyState(0) {}
+
+    // Buffer that persists across frames. It is left to the function
+    // writing into it to give it a size and type.
+    cv::Mat& get(const std::string& name)
+    {
+      return buffers[name];
+    }
+
+    // Buffer with a fixed size and type. Memory is only (re)allocated when
+    // size or type differ from the previous call.
+    cv::Mat& get(const std::string& name, cv::Size size, int type)
+    {
+      cv::Mat& buffer = buffers[name];
+      buffer.create(size, type);
+      return buffer;
+    }
+
+    // Same as get(name, size, type) but the content is cleared in place.
+    // Replaces Mat::zeros(), which returns a freshly allocated matrix.
+    cv::Mat& zeros(const std::string& name, cv::Size size, int type)
+    {
+      cv::Mat& buffer = get(name, size, type);
+      buffer.setTo(cv::Scalar::all(0));
+      return buffer;
+    }
+
+    // Number of buffer allocations seen so far. A buffer whose data pointer
+    // was not owned by the pool at the previous call has been (re)allocated.
+    // Buffers swapped with each other keep their memory and are not counted.
+    size_t allocations()
+    {
+      std::vector<const uchar*> seen;
+      for (std::map<std::string, cv::Mat>::iterator it = buffers.begin(); it != buffers.end(); ++it)
+      {
+        const uchar* data = it->second.datastart;
+        if (data == NULL)
+          continue;
+        if (std::find(known.begin(), known.end(), data) == known.end())
+          numAllocations++;
+        seen.push_back(data);
+      }
+      known.swap(seen);
+      return numAllocations;
+    }
+
+    // Call once the first frames have sized every buffer.
+    void markSteadyState()
+    {
+      numAllocationsAtSteadyState = allocations();
+    }
+
+    // Allocations since markSteadyState(). Anything other than 0 means
+    // a buffer in the loop is not being reused.
+    size_t steadyStateAllocations()
+    {
+      return allocations() - numAllocationsAtSteadyState;
+    }
+
+  private:
+    std::map<std::string, cv::Mat> buffers;
+    std::vector<const uchar*> known;
+    size_t numAllocations;
+    size_t numAllocationsAtSteadyState;
+};
+
+#endif // BIGVISION_framePool_HPP_
@@ -25,8 +25,17 @@ Software License.
 
 #include <dlib/image_processing.h>
 #include <dlib/data_io.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 
 using namespace dlib;
 using namespace std;
@@ -100,6 +109,296 @@ std::vector<std::vector<double> > get_interocular_distances (
   return temp;
 }
 
+// Trainer options that are tuned. The others are the same for every run.
+struct trainer_config
+{
+  unsigned long cascade_depth = 10;
+  unsigned long num_trees_per_cascade_level = 500;
+  unsigned long tree_depth = 4;
+  double nu = 0.1;
+  unsigned long oversampling_amount = 20;
+  unsigned long feature_pool_size = 400;
+};
+
+shape_predictor_trainer make_trainer (
+  const trainer_config& config,
+  unsigned long num_threads
+)
+{
+  shape_predictor_trainer trainer;
+
+  // some parts of training process can be parallelized.
+  // Trainer will use this count of threads when possible
+  trainer.set_num_threads(num_threads);
+
+  trainer.set_cascade_depth(config.cascade_depth);
+  trainer.set_num_trees_per_cascade_level(config.num_trees_per_cascade_level);
+  trainer.set_tree_depth(config.tree_depth);
+  trainer.set_nu(config.nu);
+  trainer.set_oversampling_amount(config.oversampling_amount);
+  trainer.set_feature_pool_size(config.feature_pool_size);
+  trainer.set_feature_pool_region_padding(0);
+  trainer.set_lambda(0.1);
+  trainer.set_num_test_splits(20);
+  return trainer;
+}
+
+// Read the grid of a sweep. Every line names an option followed by the
+// values to try, e.g.
+//   cascade_depth 10 15
+//   tree_depth 3 4 5
+//   nu 0.05 0.1
+//   oversampling_amount 20 40
+// Lines starting with # are comments. Options that are not listed keep
+// their default value. Every combination of the values is trained.
+std::vector<trainer_config> read_sweep_grid (
+  const std::string& filename
+)
+{
+  std::ifstream file(filename.c_str());
+  if (!file)
+    throw error("unable to open sweep grid " + filename);
+
+  std::vector<trainer_config> configs(1);
+  std::string line;
+  while (getline(file, line))
+  {
+    std::istringstream fields(line);
+    std::string name;
+    if (!(fields >> name) || name[0] == '#')
+      continue;
+
+    std::vector<double> values;
+    double value;
+    while (fields >> value)
+      values.push_back(value);
+    if (values.empty())
+      throw error("no values given for " + name + " in " + filename);
+
+    // every config so far is combined with every value of this option
+    std::vector<trainer_config> combined;
+    for (unsigned long i = 0; i < configs.size(); ++i)
+    {
+      for (unsigned long j = 0; j < values.size(); ++j)
+      {
+        trainer_config config = configs[i];
+        if (name == "cascade_depth")
+          config.cascade_depth = values[j];
+        else if (name == "num_trees_per_cascade_level")
+          config.num_trees_per_cascade_level = values[j];
+        else if (name == "tree_depth")
+          config.tree_depth = values[j];
+        else if (name == "nu")
+          config.nu = values[j];
+        else if (name == "oversampling_amount")
+          config.oversampling_amount = values[j];
+        else if (name == "feature_pool_size")
+          config.feature_pool_size = values[j];
+        else
+          throw error("unknown option " + name + " in " + filename);
+        combined.push_back(config);
+      }
+    }
+    configs.swap(combined);
+  }
+  return configs;
+}
+
+// passes over the test faces when measuring latency, after one warm up pass
+#define LATENCY_REPEATS 3
+
+struct latency_stats
+{
+  double mean_us;
+  double p99_us;
+};
+
+// Time the predictor on every face of the test set, one face at a time on
+// a single thread, the way a landmark detector runs on a device.
+latency_stats measure_latency (
+  const shape_predictor& sp,
+  const dlib::array<array2d<unsigned char> >& images,
+  const std::vector<std::vector<full_object_detection> >& faces
+)
+{
+  std::vector<double> times;
+  for (int pass = 0; pass <= LATENCY_REPEATS; ++pass)
+  {
+    for (unsigned long i = 0; i < images.size(); ++i)
+    {
+      for (unsigned long j = 0; j < faces[i].size(); ++j)
+      {
+        auto start = std::chrono::steady_clock::now();
+        full_object_detection shape = sp(images[i], faces[i][j].get_rect());
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        // the first pass only warms up the caches
+        if (pass > 0)
+          times.push_back(us);
+      }
+    }
+  }
+
+  latency_stats stats = {0, 0};
+  if (times.empty())
+    return stats;
+  for (unsigned long i = 0; i < times.size(); ++i)
+    stats.mean_us += times[i];
+  stats.mean_us /= times.size();
+  std::sort(times.begin(), times.end());
+  stats.p99_us = times[std::min<unsigned long>(0.99 * times.size(), times.size() - 1)];
+  return stats;
+}
+
+long file_size (
+  const std::string& filename
+)
+{
+  std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+  return file ? (long)file.tellg() : -1;
+}
+
+struct sweep_result
+{
+  trainer_config config;
+  double training_error;
+  double testing_error;
+  double seconds;
+  latency_stats latency;
+  long model_bytes;
+};
+
+// Train every config of the grid on the same decoded images. The images
+// and landmarks are loaded once and only read by the trainers, so runs
+// share them. Runs go in parallel, each using threads_per_run of the
+// thread_budget threads, and save their model next to model_path.
+//
+// Once all runs are done the models are timed one after the other, so
+// latencies are not skewed by training going on in other threads. The
+// chosen model is saved to model_path: the fastest one with a testing
+// error of at most max_testing_error if given (> 0), otherwise the one with
+// the lowest testing error. A table of all runs is written to results_path.
+void run_sweep (
+  const std::vector<trainer_config>& configs,
+  const dlib::array<array2d<unsigned char> >& images_train,
+  const std::vector<std::vector<full_object_detection> >& faces_train,
+  const dlib::array<array2d<unsigned char> >& images_test,
+  const std::vector<std::vector<full_object_detection> >& faces_test,
+  int numPoints,
+  unsigned long thread_budget,
+  unsigned long threads_per_run,
+  double max_testing_error,
+  const std::string& model_path,
+  const std::string& results_path
+)
+{
+  const std::vector<std::vector<double> > distances_train = get_interocular_distances(faces_train, numPoints);
+  const std::vector<std::vector<double> > distances_test = get_interocular_distances(faces_test, numPoints);
+
+  threads_per_run = std::max(1UL, std::min(threads_per_run, thread_budget));
+  unsigned long num_workers = std::max(1UL, std::min<unsigned long>(thread_budget / threads_per_run, configs.size()));
+  cout << "sweep of " << configs.size() << " configs, " << num_workers << " at a time with "
+       << threads_per_run << " threads each" << endl;
+
+  std::vector<std::string> candidate_paths(configs.size());
+  for (unsigned long i = 0; i < configs.size(); ++i)
+    candidate_paths[i] = model_path.substr(0, model_path.rfind(".dat")) + "_sweep" + to_string(i) + ".dat";
+
+  std::vector<sweep_result> results(configs.size());
+  std::atomic<unsigned long> next_config(0);
+  std::mutex print_mutex;
+  std::vector<std::thread> workers;
+  for (unsigned long w = 0; w < num_workers; ++w)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      unsigned long i;
+      while ((i = next_config++) < configs.size())
+      {
+        auto start = std::chrono::steady_clock::now();
+        shape_predictor_trainer trainer = make_trainer(configs[i], threads_per_run);
+        shape_predictor sp = trainer.train(images_train, faces_train);
+
+        sweep_result& result = results[i];
+        result.config = configs[i];
+        result.training_error = test_shape_predictor(sp, images_train, faces_train, distances_train);
+        result.testing_error = test_shape_predictor(sp, images_test, faces_test, distances_test);
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        serialize(candidate_paths[i]) << sp;
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        cout << "config " << i + 1 << "/" << configs.size() << " done in " << result.seconds
+             << " s, testing error " << result.testing_error << endl;
+      }
+    }));
+  }
+  for (unsigned long w = 0; w < workers.size(); ++w)
+    workers[w].join();
+
+  unsigned long most_accurate = 0;
+  long fastest_within_budget = -1;
+  for (unsigned long i = 0; i < results.size(); ++i)
+  {
+    shape_predictor sp;
+    deserialize(candidate_paths[i]) >> sp;
+    results[i].latency = measure_latency(sp, images_test, faces_test);
+    results[i].model_bytes = file_size(candidate_paths[i]);
+
+    if (results[i].testing_error < results[most_accurate].testing_error)
+      most_accurate = i;
+    if (results[i].testing_error <= max_testing_error &&
+        (fastest_within_budget < 0 || results[i].latency.mean_us < results[fastest_within_budget].latency.mean_us))
+      fastest_within_budget = i;
+  }
+
+  std::ofstream csv(results_path.c_str());
+  csv << "cascade_depth,num_trees_per_cascade_level,tree_depth,nu,oversampling_amount,feature_pool_size,"
+      << "training_error,testing_error,seconds,latency_mean_us,latency_p99_us,model_bytes\n";
+  cout << setw(8) << "cascade" << setw(8) << "trees" << setw(8) << "depth" << setw(8) << "nu"
+       << setw(8) << "overs" << setw(8) << "pool" << setw(12) << "train err" << setw(12) << "test err"
+       << setw(10) << "time s" << setw(10) << "mean us" << setw(10) << "p99 us" << setw(10) << "size KB" << endl;
+  for (unsigned long i = 0; i < results.size(); ++i)
+  {
+    const sweep_result& r = results[i];
+    const trainer_config& c = r.config;
+    csv << c.cascade_depth << "," << c.num_trees_per_cascade_level << "," << c.tree_depth << "," << c.nu << ","
+        << c.oversampling_amount << "," << c.feature_pool_size << ","
+        << r.training_error << "," << r.testing_error << "," << r.seconds << ","
+        << r.latency.mean_us << "," << r.latency.p99_us << "," << r.model_bytes << "\n";
+    cout << setw(8) << c.cascade_depth << setw(8) << c.num_trees_per_cascade_level << setw(8) << c.tree_depth
+         << setw(8) << c.nu << setw(8) << c.oversampling_amount << setw(8) << c.feature_pool_size
+         << setw(12) << r.training_error << setw(12) << r.testing_error << setw(10) << r.seconds
+         << setw(10) << r.latency.mean_us << setw(10) << r.latency.p99_us << setw(10) << r.model_bytes / 1024 << endl;
+  }
+  cout << "results written to " << results_path << endl;
+
+  unsigned long chosen = most_accurate;
+  if (max_testing_error > 0)
+  {
+    if (fastest_within_budget >= 0)
+    {
+      chosen = fastest_within_budget;
+      cout << "fastest config with testing error <= " << max_testing_error << ": " << chosen + 1 << endl;
+    }
+    else
+    {
+      cout << "no config has a testing error <= " << max_testing_error
+           << ", using the most accurate one: " << chosen + 1 << endl;
+    }
+  }
+  else
+  {
+    cout << "most accurate config: " << chosen + 1 << endl;
+  }
+
+  // keep the chosen model under the usual name, drop the other candidates
+  shape_predictor sp;
+  deserialize(candidate_paths[chosen]) >> sp;
+  serialize(model_path) << sp;
+  for (unsigned long i = 0; i < candidate_paths.size(); ++i)
+    remove(candidate_paths[i].c_str());
+  cout << "model saved to " << model_path << endl;
+}
+
 int main(int argc, char** argv)
 {
   try
@@ -108,11 +407,14 @@ int main(int argc, char** argv)
     // facial_landmark_data. So the first thing we do is load dataset.
     // This means you need to supply the path to this faces folder
     // as a command line argument so we will know where it is.
-    if (argc != 3)
+    if (argc < 3)
     {
       cout << "Give the path to the facial_landmark_data " << endl;
       cout << "directory as the argument to this program.  " << endl;
       cout << " ./build/trainFLD ../data/facial_landmark_data 70" << endl;
+      cout << "To train every config of a grid file and compare them:" << endl;
+      cout << " ./build/trainFLD ../data/facial_landmark_data 70 sweep.txt [threadBudget] [threadsPerRun] [maxTestingError]" << endl;
+      cout << "maxTestingError picks the fastest model within that error instead of the most accurate one." << endl;
       cout << endl;
       return 0;
     }
@@ -121,27 +423,6 @@ int main(int argc, char** argv)
     const std::string modelName = "shape_predictor_" + to_string(numPoints) + "_face_landmarks.dat";
     const std::string modelPath = fldDatadir + "/" + modelName;
 
-    // Create shape_predictor_trainer object for training the model.
-    shape_predictor_trainer trainer;
-
-    // some parts of training process can be parallelized.
-    // Trainer will use this count of threads when possible
-    trainer.set_num_threads(2);
-
-    trainer.set_cascade_depth(10);
-    trainer.set_num_trees_per_cascade_level(500);
-    trainer.set_tree_depth(4);
-    trainer.set_nu(0.1);
-    trainer.set_oversampling_amount(20);
-    trainer.set_feature_pool_size(400);
-    trainer.set_feature_pool_region_padding(0);
-    trainer.set_lambda(0.1);
-    trainer.set_num_test_splits(20);
-
-    // Tell the trainer to print status messages to the console so we can
-    // see training options and how long the training will take.
-    trainer.be_verbose();
-
     // Now we will create the variables that will hold our dataset.
     // images_train will hold training images and faces_train holds
     // the locations and poses of each face in the training images.
@@ -154,6 +435,26 @@ int main(int argc, char** argv)
     load_image_dataset(images_train, faces_train, fldDatadir + "/training_with_face_landmarks.xml");
     load_image_dataset(images_test, faces_test, fldDatadir + "/testing_with_face_landmarks.xml");
 
+    if (argc > 3)
+    {
+      std::vector<trainer_config> configs = read_sweep_grid(argv[3]);
+      unsigned long thread_budget = argc > 4 ? atoi(argv[4]) : std::thread::hardware_concurrency();
+      unsigned long threads_per_run = argc > 5 ? atoi(argv[5]) : 2;
+      double max_testing_error = argc > 6 ? atof(argv[6]) : 0;
+      run_sweep(configs, images_train, faces_train, images_test, faces_test, numPoints,
+                std::max(1UL, thread_budget), threads_per_run, max_testing_error,
+                modelPath, fldDatadir + "/sweep_results.csv");
+      return 0;
+    }
+
+    // Create shape_predictor_trainer object for training the model
+    // with the default options, using 2 threads.
+    shape_predictor_trainer trainer = make_trainer(trainer_config(), 2);
+
+    // Tell the trainer to print status messages to the console so we can
+    // see training options and how long the training will take.
+    trainer.be_verbose();
+
     // Now finally generate the shape model
     shape_predictor sp = trainer.train(images_train, faces_train);
 
@@ -174,6 +475,12 @@ int main(int argc, char** argv)
 
     // Finally, we save the model to disk so we can use it later.
     serialize(modelPath) << sp;
+
+    // Cost of the model on a device: time to find the landmarks of one
+    // face and size of the file to ship.
+    latency_stats latency = measure_latency(sp, images_test, faces_test);
+    cout << "latency per face:    " << latency.mean_us << " us (p99 " << latency.p99_us << " us)" << endl;
+    cout << "model size:          " << file_size(modelPath) / 1024 << " KB" << endl;
   }
   catch (exception& e)
   {
@@ -19,6 +19,7 @@
 #include <dlib/image_processing.h>
 #include <dlib/gui_widgets.h>
 #include "renderFace.hpp"
+#include "framePool.hpp"
 #include <math.h>
 
 using namespace dlib;
@@ -73,7 +74,12 @@ int main()
     double fps = 30.0;
 
     // Space for current frame, previous frame, and the grayscale versions.
-    cv::Mat im, imPrev, imGray, imGrayPrev;
+    // They are kept in a pool so that every frame reuses the same memory.
+    FramePool framePool;
+    cv::Mat& im = framePool.get("im");
+    cv::Mat& imPrev = framePool.get("imPrev");
+    cv::Mat& imGray = framePool.get("imGray");
+    cv::Mat& imGrayPrev = framePool.get("imGrayPrev");
 
     // Vector of images for storing image pyramids for optical flow
     std::vector<cv::Mat> imGrayPyr, imGrayPrevPyr;
@@ -91,7 +97,7 @@ int main()
     cv::Size size = imPrev.size();
 
     // imSmall will be used for storing a resized image.
-    cv::Mat imSmall;
+    cv::Mat& imSmall = framePool.get("imSmall");
 
 
     // Load Dlib's face detection
@@ -235,6 +241,8 @@ int main()
         }
       }
 
+      cv::putText(im, cv::format("fps %.2f",fps), cv::Point(50, size.height - 50), cv::FONT_HERSHEY_COMPLEX, 1.5, cv::Scalar(0, 0, 255), 3);
+
       // Display on screen
       cv::imshow(winName, im);
 
@@ -252,11 +260,24 @@ int main()
         return EXIT_SUCCESS;
       }
 
-      // Get ready for next frame.
-      imPrev = im.clone();
-      imGrayPrev = imGray.clone();
-      imGrayPrevPyr = imGrayPyr;
-      imGrayPyr = std::vector<cv::Mat>();
+      // Get ready for next frame. The current frame becomes the previous
+      // one by swapping buffers, and the old previous frame is overwritten
+      // by the next capture. No pixels are copied.
+      cv::swap(imPrev, im);
+      cv::swap(imGrayPrev, imGray);
+      std::swap(imGrayPrevPyr, imGrayPyr);
+
+      // Every buffer has its size after the first frame.
+      // From then on the loop should not allocate frame memory.
+      if (isFirstFrame)
+      {
+        framePool.markSteadyState();
+      }
+      else if (framePool.steadyStateAllocations() > 0)
+      {
+        cout << "Frame buffers were reallocated" << endl;
+        framePool.markSteadyState();
+      }
 
       isFirstFrame = false;
 
@@ -268,7 +289,6 @@ int main()
         fps = NUM_FRAMES_FOR_FPS/t;
         count = 0;
       }
-      cv::putText(im, cv::format("fps %.2f",fps), cv::Point(50, size.height - 50), cv::FONT_HERSHEY_COMPLEX, 1.5, cv::Scalar(0, 0, 255), 3);
     }
     cap.release();
     cv::destroyAllWindows();
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include "faceBlendCommon.hpp"
 #include "colorCorrection.hpp"
+#include "framePool.hpp"
 
 
 using namespace cv;
@@ -79,11 +80,16 @@ int main( int argc, char** argv)
 
   //process input from webcam or video file
   cv::VideoCapture cap("../data/videos/sample-video.mp4");
-  cv::Mat img2;
+
+  // Per-frame buffers are kept in a pool so that every frame reuses
+  // the memory allocated for the first one.
+  FramePool framePool;
+  cv::Mat& frame = framePool.get("frame");
+  cv::Mat& img2 = framePool.get("img2");
 
   // Read a frame initially to assign memory for the frame and calculate new height
-  cap >> img2;
-  height = img2.rows;
+  cap >> frame;
+  height = frame.rows;
   IMAGE_RESIZE = (float)height/RESIZE_HEIGHT;
 
   // Declare the variable for landmark points
@@ -103,21 +109,37 @@ int main( int argc, char** argv)
   std::vector<Point2f> hull2Prev ;
   std::vector<Point2f> hull2Next ;
 
-  Mat img2Gray, img2GrayPrev;
-
-  Mat result, output, img1Warped;
+  // Point lists of the loop, cleared every frame but keeping their capacity
+  std::vector<Point2f> hull2 ;
+  std::vector<Point> hull3;
+  std::vector<Point2f> triangle1(3), triangle2(3);
+  std::vector<uchar> status;
+  std::vector<float> err;
+
+  Mat& img2Gray = framePool.get("img2Gray");
+  Mat& img2GrayPrev = framePool.get("img2GrayPrev");
+
+  Mat& img1Warped = framePool.get("img1Warped");
+  Mat& img1Warped8U = framePool.get("img1Warped8U");
+  Mat& mask2 = framePool.get("mask2");
+  Mat& temp1 = framePool.get("temp1");
+  Mat& temp2 = framePool.get("temp2");
+  Mat& result = framePool.get("result");
+  Mat output;
+  bool buffersAllocated = false;
 
   namedWindow("After Blending");
 
   // Main Loop
-  while(cap.read(img2))
+  while(cap.read(frame))
   {
     if ( count == 0 )
       t = (double)cv::getTickCount();
 
     double time_detector = (double)cv::getTickCount();
 
-    cv::resize(img2, img2, cv::Size(), 1.0/IMAGE_RESIZE, 1.0/IMAGE_RESIZE);
+    // Resizing in place would allocate a new image on every frame
+    cv::resize(frame, img2, cv::Size(), 1.0/IMAGE_RESIZE, 1.0/IMAGE_RESIZE);
 
     // find landmarks after skipping SKIP_Frames number of frames
     if (count % SKIP_FRAMES == 0)
@@ -134,11 +156,10 @@ int main( int argc, char** argv)
     }
 
     //convert Mat to float data type
-    img1Warped = img2.clone();
-    img1Warped.convertTo(img1Warped, CV_32F);
+    img2.convertTo(img1Warped, CV_32F);
 
     // Find convex hull
-    std::vector<Point2f> hull2 ;
+    hull2.clear();
 
     for(int i = 0; i < hullIndex.size(); i++)
     {
@@ -164,10 +185,7 @@ int main( int argc, char** argv)
     cvtColor(img2, img2Gray, COLOR_BGR2GRAY);
 
     if(img2GrayPrev.empty())
-      img2GrayPrev = img2Gray.clone();
-
-    std::vector<uchar> status;
-    std::vector<float> err;
+      img2Gray.copyTo(img2GrayPrev);
 
     // Calculate Optical Flow based estimate of the point in this frame
     calcOpticalFlowPyrLK(img2GrayPrev, img2Gray, hull2Prev, hull2Next, status, err, winSize,
@@ -184,39 +202,38 @@ int main( int argc, char** argv)
 
     // Update varibales for next pass
     hull2Prev = hull2;
-    img2GrayPrev = img2Gray.clone();
+    // Swap buffers instead of cloning, img2Gray is overwritten next frame
+    cv::swap(img2GrayPrev, img2Gray);
 
     /////////// Finished Stabilization code   //////////////////////////////////
 
     // Apply affine transformation to Delaunay triangles
     for(size_t i = 0; i < dt.size(); i++)
     {
-      std::vector<Point2f> t1, t2;
-
       // Get points for img1, img2 corresponding to the triangles
       for(size_t j = 0; j < 3; j++)
       {
-        t1.push_back(hull1[dt[i][j]]);
-        t2.push_back(hull2[dt[i][j]]);
+        triangle1[j] = hull1[dt[i][j]];
+        triangle2[j] = hull2[dt[i][j]];
       }
-      warpTriangle(img1, img1Warped, t1, t2);
+      warpTriangle(img1, img1Warped, triangle1, triangle2);
     }
 
     cout << "Stabilize and Warp time" << ((double)cv::getTickCount() - t1)/cv::getTickFrequency() << endl;
 
 /////////////////////////   Blending   /////////////////////////////////////////////////////////////
 
-    img1Warped.convertTo(img1Warped, CV_8UC3);
+    img1Warped.convertTo(img1Warped8U, CV_8UC3);
 
     // Color Correction of the warped image so that the source color matches that of the destination
-    output = correctColours(img2, img1Warped, points2);
+    output = correctColours(img2, img1Warped8U, points2);
 
     // imshow("Before Blending", output);
 
     // Create a Mask around the face
     Rect re = boundingRect(hull2);
     Point center = (re.tl() + re.br()) / 2;
-    std::vector<Point> hull3;
+    hull3.clear();
 
     for(int i = 0; i < hull2.size()-12; i++)
     {
@@ -224,21 +241,21 @@ int main( int argc, char** argv)
       Point pt1( 0.95*(hull2[i].x - center.x) + center.x, 0.95*(hull2[i].y - center.y) + center.y);
       hull3.push_back(pt1);
     }
-    Mat mask1 = Mat::zeros(img2.rows, img2.cols, img2.type());
+    Mat& mask1 = framePool.zeros("mask1", img2.size(), img2.type());
 
     fillConvexPoly(mask1,&hull3[0], hull3.size(), Scalar(255,255,255));
 
     // Blur the mask before blending
     cv::GaussianBlur(mask1,mask1, Size (21, 21),10);
 
-    Mat mask2 = Scalar(255,255,255) - mask1;
+    cv::subtract(Scalar(255,255,255), mask1, mask2);
     // imshow("mask1",mask1);
     // imshow("mask2",mask2);
 
     // Perform alpha blending of the two images
-    Mat temp1 = output.mul(mask1, 1.0/255);
-    Mat temp2 = img2.mul(mask2,1.0/255);
-    result =  temp1 + temp2;
+    cv::multiply(output, mask1, temp1, 1.0/255);
+    cv::multiply(img2, mask2, temp2, 1.0/255);
+    cv::add(temp1, temp2, result);
     // imshow("temp1",temp1);
     // imshow("temp2",temp2);
 
@@ -246,6 +263,21 @@ int main( int argc, char** argv)
     cout << "Total time" << ((double)cv::getTickCount() - time_detector)/cv::getTickFrequency() << endl;
     imshow("After Blending", result);
 
+    // Every pooled buffer has its size after the first processed frame.
+    // From then on they should not be reallocated. Only buffers of the
+    // pool are counted: correctColours and warpTriangle still allocate
+    // their temporaries on every frame.
+    if (!buffersAllocated)
+    {
+      framePool.markSteadyState();
+      buffersAllocated = true;
+    }
+    else if (framePool.steadyStateAllocations() > 0)
+    {
+      cout << "Pooled frame buffers were reallocated" << endl;
+      framePool.markSteadyState();
+    }
+
     int k = cv::waitKey(1);
     // Quit if  ESC is pressed
     if (k == 27)
@@ -0,0 +1,200 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "faceGallery.hpp"
+#include "faceIndex.hpp"
+#include "descriptorStore.hpp"
+#include "quantizedFaceIndex.hpp"
+
+using namespace cv;
+using namespace std;
+
+// spread of identity centers and of the faces of one identity around it
+// chosen so that faces of different identities are ~1.0 apart and
+// faces of the same identity ~0.4 apart, like dlib descriptors
+#define CENTER_SIGMA 0.0625
+#define FACE_SIGMA 0.025
+#define FACES_PER_IDENTITY 10
+// match threshold of testDlibFaceRec*, used to compare match decisions
+#define THRESHOLD 0.5
+
+// synthetic gallery made of clusters of faces around identity centers
+static void makeGallery(int numDescriptors, FaceGallery& gallery, RNG& rng) {
+  int dim = gallery.dimension();
+  std::vector<float> center(dim), descriptor(dim);
+  gallery.reserve(numDescriptors);
+  for (int i = 0; i < numDescriptors; i++) {
+    if (i % FACES_PER_IDENTITY == 0) {
+      for (int d = 0; d < dim; d++) {
+        center[d] = rng.gaussian(CENTER_SIGMA);
+      }
+    }
+    for (int d = 0; d < dim; d++) {
+      descriptor[d] = center[d] + rng.gaussian(FACE_SIGMA);
+    }
+    gallery.add(&descriptor[0], i / FACES_PER_IDENTITY);
+  }
+}
+
+// queries are new faces of enrolled identities
+static void makeQueries(const FaceGallery& gallery, int numQueries, Mat& queries, RNG& rng) {
+  queries.create(numQueries, gallery.dimension(), CV_32F);
+  for (int q = 0; q < numQueries; q++) {
+    const float* enrolled = gallery.getDescriptors().ptr<float>(rng.uniform(0, gallery.size()));
+    float* query = queries.ptr<float>(q);
+    for (int d = 0; d < gallery.dimension(); d++) {
+      query[d] = enrolled[d] + rng.gaussian(FACE_SIGMA);
+    }
+  }
+}
+
+static double percentile(std::vector<double> values, double p) {
+  std::sort(values.begin(), values.end());
+  return values[std::min((size_t)(p * values.size()), values.size() - 1)];
+}
+
+// label a test program would report for the best match, -1 for unknown
+static int decision(const std::vector<FaceMatch>& matches) {
+  return (matches.empty() || matches[0].distance > THRESHOLD) ? -1 : matches[0].label;
+}
+
+// Search the queries one at a time like a video loop does and report
+// recall against the exact neighbours, how often the match decision at
+// THRESHOLD is the same as with exact search, memory and latency.
+static void runBenchmark(const string& label, const FaceIndex& index, const Mat& queries, int k,
+                         const std::vector<std::vector<FaceMatch> >& groundTruth, double exactMean,
+                         size_t bytesPerDescriptor) {
+  std::vector<double> latencies(queries.rows);
+  int hits = 0, hitsTop1 = 0, agreements = 0;
+  std::vector<std::vector<FaceMatch> > matches;
+  for (int q = 0; q < queries.rows; q++) {
+    double t = (double)getTickCount();
+    index.search(queries.row(q), k, matches);
+    latencies[q] = ((double)getTickCount() - t) / getTickFrequency() * 1000.0;
+
+    const std::vector<FaceMatch>& truth = groundTruth[q];
+    for (size_t i = 0; i < matches[0].size(); i++) {
+      for (size_t j = 0; j < truth.size(); j++) {
+        if (matches[0][i].index == truth[j].index) {
+          hits++;
+          break;
+        }
+      }
+    }
+    if (!matches[0].empty() && !truth.empty() && matches[0][0].index == truth[0].index) {
+      hitsTop1++;
+    }
+    if (decision(matches[0]) == decision(truth)) {
+      agreements++;
+    }
+  }
+
+  double mean = 0;
+  for (size_t i = 0; i < latencies.size(); i++) {
+    mean += latencies[i];
+  }
+  mean /= latencies.size();
+
+  cout << setw(14) << label
+       << setw(12) << fixed << setprecision(4) << (double)hits / (queries.rows * k)
+       << setw(12) << (double)hitsTop1 / queries.rows
+       << setw(12) << (double)agreements / queries.rows
+       << setw(12) << (bytesPerDescriptor > 0 ? to_string(bytesPerDescriptor) : string("-"))
+       << setw(12) << setprecision(3) << mean
+       << setw(12) << percentile(latencies, 0.5)
+       << setw(12) << percentile(latencies, 0.99)
+       << setw(10) << setprecision(1) << exactMean / mean << "x" << endl;
+}
+
+int main(int argc, char** argv) {
+  cout << "USAGE" << endl
+       << "./benchmarkFaceIndex [numDescriptors | descriptors.bin | descriptors.csv] [numQueries] [k]" << endl;
+
+  string source = argc > 1 ? argv[1] : "100000";
+  int numQueries = argc > 2 ? atoi(argv[2]) : 1000;
+  int k = argc > 3 ? atoi(argv[3]) : 10;
+
+  RNG rng(12345);
+  FaceGallery gallery;
+  DescriptorStore store;
+  double t = (double)getTickCount();
+  if (source.find(".bin") != string::npos) {
+    store.open(source);
+    gallery = store.gallery();
+  } else if (source.find(".csv") != string::npos) {
+    readDescriptorsCsv(source, gallery);
+  } else {
+    makeGallery(atoi(source.c_str()), gallery, rng);
+  }
+  cout << "gallery of " << gallery.size() << " descriptors ready in "
+       << ((double)getTickCount() - t) / getTickFrequency() << " s" << endl;
+
+  Mat queries;
+  makeQueries(gallery, numQueries, queries, rng);
+
+  // exact neighbours of every query are the reference for recall
+  std::vector<std::vector<FaceMatch> > groundTruth;
+  gallery.search(queries, k, groundTruth);
+
+  ExactFaceIndex exact;
+  exact.build(gallery);
+
+  t = (double)getTickCount();
+  HnswFaceIndex hnsw;
+  hnsw.build(gallery);
+  cout << "hnsw index built in " << ((double)getTickCount() - t) / getTickFrequency() << " s" << endl;
+
+  // latency of the exact search is needed for the speedup column
+  double exactMean = 0;
+  for (int q = 0; q < queries.rows; q++) {
+    std::vector<std::vector<FaceMatch> > matches;
+    double tq = (double)getTickCount();
+    exact.search(queries.row(q), k, matches);
+    exactMean += ((double)getTickCount() - tq) / getTickFrequency() * 1000.0;
+  }
+  exactMean /= queries.rows;
+
+  cout << setw(14) << "index" << setw(12) << "recall@" + to_string(k) << setw(12) << "recall@1"
+       << setw(12) << "agree@" + to_string(THRESHOLD).substr(0, 3) << setw(12) << "bytes/face"
+       << setw(12) << "mean ms" << setw(12) << "p50 ms" << setw(12) << "p99 ms" << setw(11) << "speedup" << endl;
+  size_t floatBytes = gallery.dimension() * sizeof(float) + sizeof(float) + sizeof(int);
+  runBenchmark(exact.name(), exact, queries, k, groundTruth, exactMean, floatBytes);
+
+  // exact search over quantized copies of the gallery
+  int quantizationTypes[] = {QUANTIZE_INT8_PER_VECTOR, QUANTIZE_INT8_PER_DIMENSION, QUANTIZE_FLOAT16};
+  for (int i = 0; i < 3; i++) {
+    QuantizedFaceIndex quantized(quantizationTypes[i]);
+    quantized.build(gallery);
+    runBenchmark(quantized.name(), quantized, queries, k, groundTruth, exactMean, quantized.bytesPerDescriptor());
+  }
+
+  int efValues[] = {16, 32, 64, 128, 256};
+  for (int i = 0; i < 5; i++) {
+    hnsw.setEfSearch(std::max(efValues[i], k));
+    runBenchmark(hnsw.name() + " ef=" + to_string(hnsw.getEfSearch()), hnsw, queries, k, groundTruth, exactMean, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/face.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <math.h>
+#include "faceBlendCommon.hpp"
+
+// dirent.h is pre-included with *nix like systems
+// but not for Windows. So we are trying to include
+// this header files based on Operating System
+#ifdef _WIN32
+#include "dirent.h"
+#elif __APPLE__
+#include "TargetConditionals.h"
+#if TARGET_OS_MAC
+  #include <dirent.h>
+#else
+  #error "Not Mac. Find an alternative to dirent"
+#endif
+#elif __linux__
+#include <dirent.h>
+#elif __unix__ // all unices not caught above
+#include <dirent.h>
+#else
+#error "Unknown compiler"
+#endif
+
+using namespace cv;
+using namespace cv::face;
+using namespace std;
+
+// Face Size, same as trainOpenCVFaceRec
+#define faceWidth 64
+#define faceHeight 64
+
+#define PI 3.14159265
+
+// every TEST_EVERY-th image of a person is held out for testing,
+// the others are used for training
+#define TEST_EVERY 5
+
+// Benchmark of the OpenCV FaceRecognizer backends trained by
+// trainOpenCVFaceRec on a labelled dataset, one folder per person.
+// Faces are detected, aligned and cropped once, like trainOpenCVFaceRec
+// does, and then every backend is trained on the same faces and measured:
+//   training time, size of the saved model and time to load it,
+//   latency of single predictions (p50/p95/p99) while the test faces are
+//   predicted in parallel on all threads, prediction throughput and accuracy.
+// Results are printed as a table and written as CSV or JSON.
+
+struct BackendResult {
+  string backend;
+  int numTrain;
+  int numTest;
+  int numThreads;
+  double trainSeconds;
+  long modelBytes;
+  double loadSeconds;
+  double p50;                // ms
+  double p95;                // ms
+  double p99;                // ms
+  double predictionsPerSecond;
+  double accuracy;
+};
+
+// Reads the sub-directories and files in a directory
+static void listdir(const string& dirName, vector<string>& folderNames, vector<string>& fileNames) {
+  DIR *dir;
+  struct dirent *ent;
+
+  if ((dir = opendir(dirName.c_str())) != NULL) {
+    while ((ent = readdir(dir)) != NULL) {
+      // ignore . and ..
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+        continue;
+      }
+      string name = ent->d_name;
+      if (ent->d_type == DT_DIR) {
+        folderNames.push_back(dirName + "/" + name);
+      } else if (ent->d_type == DT_REG || ent->d_type == DT_LNK) {
+        fileNames.push_back(name);
+      }
+    }
+    std::sort(folderNames.begin(), folderNames.end());
+    std::sort(fileNames.begin(), fileNames.end());
+    closedir(dir);
+  }
+}
+
+static bool hasExtension(const string& fname, const string& ext) {
+  return fname.size() >= ext.size() && fname.compare(fname.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+static void alignFace(Mat &imFace, Mat &alignedImFace, std::vector<Point2f> landmarks) {
+  // Left and right eye corners
+  float dx = landmarks[42].x - landmarks[39].x;
+  float dy = landmarks[42].y - landmarks[39].y;
+  double angle = atan2(dy, dx) * 180 / PI;
+
+  Point2f eyesCenter((landmarks[39].x + landmarks[42].x) / 2.0, (landmarks[39].y + landmarks[42].y) / 2.0);
+
+  // Rotate the face image to make the eyes horizontal
+  Mat rotMatrix = getRotationMatrix2D(eyesCenter, angle, 1);
+  warpAffine(imFace, alignedImFace, rotMatrix, imFace.size());
+}
+
+static Mat getCroppedFaceRegion(Mat image, std::vector<Point2f> landmarks) {
+  int x1Limit = landmarks[0].x - (landmarks[36].x - landmarks[0].x);
+  int x2Limit = landmarks[16].x + (landmarks[16].x - landmarks[45].x);
+  int y1Limit = landmarks[27].y - 3*(landmarks[30].y - landmarks[27].y);
+  int y2Limit = landmarks[8].y + (landmarks[30].y - landmarks[29].y);
+
+  int x1 = max(x1Limit, 0);
+  int x2 = min(x2Limit, image.cols);
+  int y1 = max(y1Limit, 0);
+  int y2 = min(y2Limit, image.rows);
+  return image(cv::Rect(x1, y1, x2 - x1, y2 - y1));
+}
+
+// Detect, align and crop the face of every image, in parallel. Images
+// without a face are left empty.
+static void prepareFaces(const vector<string>& imagePaths, vector<Mat>& faces) {
+  dlib::shape_predictor landmarkDetector;
+  dlib::deserialize("../data/models/shape_predictor_68_face_landmarks.dat") >> landmarkDetector;
+
+  faces.assign(imagePaths.size(), Mat());
+  parallel_for_(Range(0, (int)imagePaths.size()), [&](const Range& range) {
+    // the face detector keeps scratch buffers, every thread needs its own
+    dlib::frontal_face_detector faceDetector = dlib::get_frontal_face_detector();
+    for (int i = range.start; i < range.end; i++) {
+      Mat im = imread(imagePaths[i]);
+      if (im.empty()) {
+        continue;
+      }
+      std::vector<Point2f> landmarks = getLandmarks(faceDetector, landmarkDetector, im);
+      if (landmarks.size() < 68) {
+        continue;
+      }
+      cvtColor(im, im, COLOR_BGR2GRAY);
+      Mat imFace = getCroppedFaceRegion(im, landmarks);
+
+      Mat alignedImFace;
+      alignFace(imFace, alignedImFace, landmarks);
+      cv::resize(alignedImFace, alignedImFace, Size(faceHeight, faceWidth));
+      alignedImFace.convertTo(faces[i], CV_32F, 1.0/255);
+    }
+  });
+}
+
+static double percentile(std::vector<double> values, double p) {
+  std::sort(values.begin(), values.end());
+  return values[std::min((size_t)(p * values.size()), values.size() - 1)];
+}
+
+static long fileSize(const string& filename) {
+  std::ifstream file(filename.c_str(), ifstream::binary | ifstream::ate);
+  return file ? (long)file.tellg() : -1;
+}
+
+static Ptr<FaceRecognizer> createRecognizer(const string& backend) {
+  if (backend == "eigen") {
+    return EigenFaceRecognizer::create();
+  } else if (backend == "fisher") {
+    return FisherFaceRecognizer::create();
+  }
+  return LBPHFaceRecognizer::create();
+}
+
+static BackendResult runBenchmark(const string& backend, const vector<Mat>& trainFaces, const vector<int>& trainLabels,
+                                  const vector<Mat>& testFaces, const vector<int>& testLabels) {
+  BackendResult result;
+  result.backend = backend;
+  result.numTrain = (int)trainFaces.size();
+  result.numTest = (int)testFaces.size();
+  result.numThreads = getNumThreads();
+
+  Ptr<FaceRecognizer> trained = createRecognizer(backend);
+  double t = (double)getTickCount();
+  trained->train(trainFaces, trainLabels);
+  result.trainSeconds = ((double)getTickCount() - t) / getTickFrequency();
+
+  // model is saved and loaded back, the way testOpenCVFaceRec gets it
+  string modelFile = "benchmark_model_" + backend + ".yml";
+  trained->write(modelFile);
+  result.modelBytes = fileSize(modelFile);
+  Ptr<FaceRecognizer> faceRecognizer = createRecognizer(backend);
+  t = (double)getTickCount();
+  faceRecognizer->read(modelFile);
+  result.loadSeconds = ((double)getTickCount() - t) / getTickFrequency();
+  remove(modelFile.c_str());
+
+  // predict() is const, so the test faces are shared out between threads
+  vector<double> latencies(testFaces.size());
+  vector<int> predictedLabels(testFaces.size());
+  t = (double)getTickCount();
+  parallel_for_(Range(0, (int)testFaces.size()), [&](const Range& range) {
+    for (int i = range.start; i < range.end; i++) {
+      double tp = (double)getTickCount();
+      int predictedLabel = -1;
+      double score = 0.0;
+      faceRecognizer->predict(testFaces[i], predictedLabel, score);
+      latencies[i] = ((double)getTickCount() - tp) / getTickFrequency() * 1000.0;
+      predictedLabels[i] = predictedLabel;
+    }
+  });
+  double predictSeconds = ((double)getTickCount() - t) / getTickFrequency();
+
+  int correct = 0;
+  for (size_t i = 0; i < testFaces.size(); i++) {
+    if (predictedLabels[i] == testLabels[i]) {
+      correct++;
+    }
+  }
+  result.p50 = percentile(latencies, 0.5);
+  result.p95 = percentile(latencies, 0.95);
+  result.p99 = percentile(latencies, 0.99);
+  result.predictionsPerSecond = testFaces.size() / predictSeconds;
+  result.accuracy = (double)correct / testFaces.size();
+  return result;
+}
+
+static void writeCsv(const string& filename, const vector<BackendResult>& results) {
+  ofstream of(filename.c_str());
+  of << "backend,train_faces,test_faces,threads,train_s,model_bytes,load_s,p50_ms,p95_ms,p99_ms,"
+     << "predictions_per_s,accuracy\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const BackendResult& r = results[i];
+    of << r.backend << "," << r.numTrain << "," << r.numTest << "," << r.numThreads << ","
+       << r.trainSeconds << "," << r.modelBytes << "," << r.loadSeconds << ","
+       << r.p50 << "," << r.p95 << "," << r.p99 << ","
+       << r.predictionsPerSecond << "," << r.accuracy << "\n";
+  }
+}
+
+static void writeJson(const string& filename, const vector<BackendResult>& results) {
+  ofstream of(filename.c_str());
+  of << "[\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const BackendResult& r = results[i];
+    of << "  {\"backend\": \"" << r.backend << "\", \"train_faces\": " << r.numTrain
+       << ", \"test_faces\": " << r.numTest << ", \"threads\": " << r.numThreads
+       << ", \"train_s\": " << r.trainSeconds << ", \"model_bytes\": " << r.modelBytes
+       << ", \"load_s\": " << r.loadSeconds << ", \"p50_ms\": " << r.p50
+       << ", \"p95_ms\": " << r.p95 << ", \"p99_ms\": " << r.p99
+       << ", \"predictions_per_s\": " << r.predictionsPerSecond << ", \"accuracy\": " << r.accuracy << "}"
+       << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  of << "]\n";
+}
+
+int main(int argc, char** argv) {
+  cout << "USAGE" << endl
+       << "./benchmarkOpenCVFaceRec [datasetFolder] [results.csv | results.json] [numThreads]" << endl;
+
+  string faceDatasetFolder = argc > 1 ? argv[1] : "../data/images/FaceRec/trainFaces";
+  string resultsFile = argc > 2 ? argv[2] : "benchmark_opencv_facerec.csv";
+  if (argc > 3) {
+    setNumThreads(std::max(1, atoi(argv[3])));
+  }
+
+  // one folder per person, the folder index is the label
+  vector<string> faceFolderNames, fileNames;
+  listdir(faceDatasetFolder, faceFolderNames, fileNames);
+  vector<string> imagePaths;
+  vector<int> imageLabels;
+  for (int i = 0; i < (int)faceFolderNames.size(); i++) {
+    vector<string> folderNames;
+    fileNames.clear();
+    listdir(faceFolderNames[i], folderNames, fileNames);
+    for (size_t j = 0; j < fileNames.size(); j++) {
+      if (hasExtension(fileNames[j], "jpg") || hasExtension(fileNames[j], "pgm")) {
+        imagePaths.push_back(faceFolderNames[i] + "/" + fileNames[j]);
+        imageLabels.push_back(i);
+      }
+    }
+  }
+  cout << imagePaths.size() << " images of " << faceFolderNames.size() << " people" << endl;
+
+  double t = (double)getTickCount();
+  vector<Mat> faces;
+  prepareFaces(imagePaths, faces);
+  cout << "faces prepared in " << ((double)getTickCount() - t) / getTickFrequency() << " s" << endl;
+
+  vector<Mat> trainFaces, testFaces;
+  vector<int> trainLabels, testLabels;
+  vector<int> imagesOfLabel(faceFolderNames.size(), 0);
+  for (size_t i = 0; i < faces.size(); i++) {
+    if (faces[i].empty()) {
+      cout << imagePaths[i] << ": no face found, skipped" << endl;
+      continue;
+    }
+    int label = imageLabels[i];
+    if (++imagesOfLabel[label] % TEST_EVERY == 0) {
+      testFaces.push_back(faces[i]);
+      testLabels.push_back(label);
+    } else {
+      trainFaces.push_back(faces[i]);
+      trainLabels.push_back(label);
+    }
+  }
+  if (trainFaces.empty() || testFaces.empty()) {
+    CV_Error(Error::StsBadArg, "not enough faces in " + faceDatasetFolder + " to train and test");
+  }
+
+  const char* backends[] = {"eigen", "fisher", "lbph"};
+  vector<BackendResult> results;
+  cout << setw(8) << "backend" << setw(10) << "train s" << setw(12) << "model KB" << setw(10) << "load s"
+       << setw(10) << "p50 ms" << setw(10) << "p95 ms" << setw(10) << "p99 ms" << setw(12) << "pred/s"
+       << setw(10) << "accuracy" << endl;
+  for (int i = 0; i < 3; i++) {
+    BackendResult r = runBenchmark(backends[i], trainFaces, trainLabels, testFaces, testLabels);
+    results.push_back(r);
+    cout << setw(8) << r.backend << setw(10) << fixed << setprecision(3) << r.trainSeconds
+         << setw(12) << setprecision(1) << r.modelBytes / 1024.0 << setw(10) << setprecision(3) << r.loadSeconds
+         << setw(10) << r.p50 << setw(10) << r.p95 << setw(10) << r.p99
+         << setw(12) << setprecision(1) << r.predictionsPerSecond
+         << setw(10) << setprecision(4) << r.accuracy << endl;
+  }
+  cout << trainFaces.size() << " training and " << testFaces.size() << " test faces, "
+       << getNumThreads() << " threads" << endl;
+
+  if (hasExtension(resultsFile, ".json")) {
+    writeJson(resultsFile, results);
+  } else {
+    writeCsv(resultsFile, results);
+  }
+  cout << "results written to " << resultsFile << endl;
+  return 0;
+}
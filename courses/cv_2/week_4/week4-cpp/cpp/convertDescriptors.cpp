@@ -0,0 +1,64 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "faceGallery.hpp"
+#include "descriptorStore.hpp"
+
+using namespace cv;
+using namespace std;
+
+// Converts descriptors.csv and label_name.txt written by earlier versions
+// of the enroll programs to the binary descriptor store read by the test programs.
+int main(int argc, char** argv) {
+  cout << "USAGE" << endl
+       << "./convertDescriptors <descriptors.csv> <label_name.txt> <descriptors.bin> [modelId] [dimension]" << endl;
+
+  string descriptorsCsv = argc > 1 ? argv[1] : "descriptors.csv";
+  string labelNameFile = argc > 2 ? argv[2] : "label_name.txt";
+  string descriptorsBin = argc > 3 ? argv[3] : "descriptors.bin";
+  // use openface.nn4.small2.v1 for descriptors_openface.csv
+  string modelId = argc > 4 ? argv[4] : "dlib_face_recognition_resnet_model_v1";
+  int dimension = argc > 5 ? atoi(argv[5]) : 128;
+
+  double t = (double)getTickCount();
+  FaceGallery gallery(dimension);
+  readDescriptorsCsv(descriptorsCsv, gallery);
+
+  std::vector<string> names;
+  std::vector<int> labels;
+  readLabelNameCsv(labelNameFile, names, labels);
+  cout << "read " << gallery.size() << " descriptors and " << names.size() << " names in "
+       << ((double)getTickCount() - t) / getTickFrequency() << " s" << endl;
+
+  writeDescriptorStore(descriptorsBin, modelId, gallery, names, labels);
+
+  // check that the store reads back
+  t = (double)getTickCount();
+  DescriptorStore store;
+  store.open(descriptorsBin, modelId);
+  cout << "wrote " << descriptorsBin << ": " << store.count() << " descriptors of dimension "
+       << store.dimension() << ", model " << store.modelId() << ", opened in "
+       << ((double)getTickCount() - t) / getTickFrequency() << " s" << endl;
+  return 0;
+}
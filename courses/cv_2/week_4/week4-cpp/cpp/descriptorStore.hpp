@@ -0,0 +1,466 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_descriptorStore_HPP_
+#define BIGVISION_descriptorStore_HPP_
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+  #define NOMINMAX
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <opencv2/core.hpp>
+
+#include "faceGallery.hpp"
+#include "quantizedFaceIndex.hpp"
+
+// Binary descriptor store, replacing the descriptors.csv text format.
+//
+// File layout, every section starting on a 64 byte boundary:
+//   DescriptorStoreHeader
+//   descriptors  count x dimension values of type dtype, row-major
+//   norms        count float32 squared norms of the descriptors
+//   labels       count int32 face labels
+//   scales       int8 stores only: dimension float32 per dimension scales
+//                followed by count float32 per descriptor scales
+//   names        numNames entries of (int32 label, uint32 length, length chars)
+//
+// Opening a store maps the file into memory, so startup does not depend on
+// the gallery size and the descriptors are used in place without copying.
+// int8 and float16 stores are 4 and 2 times smaller and are searched in place
+// by a QuantizedFaceIndex, see quantizedFaceIndex.hpp.
+
+#define DESCRIPTOR_STORE_MAGIC "FACEDESC"
+#define DESCRIPTOR_STORE_VERSION 3
+#define DESCRIPTOR_STORE_ALIGNMENT 64
+
+// element type of the stored descriptors
+enum DescriptorType {
+  DESCRIPTOR_FLOAT32 = 0,
+  DESCRIPTOR_INT8 = 1,     // QUANTIZE_INT8_PER_DIMENSION codes
+  DESCRIPTOR_FLOAT16 = 2   // IEEE half floats
+};
+
+struct DescriptorStoreHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  uint32_t dimension;
+  uint32_t count;
+  // model the descriptors were computed with, zero padded
+  char modelId[64];
+  uint64_t descriptorsOffset;
+  uint64_t normsOffset;
+  uint64_t labelsOffset;
+  uint64_t scalesOffset;
+  uint64_t namesOffset;
+  uint32_t numNames;
+  uint32_t reserved;
+  uint64_t fileSize;
+  // FaceGallery::checksum() of the float descriptors the store was written from
+  uint64_t descriptorsChecksum;
+};
+
+inline uint64_t alignStoreOffset(uint64_t offset) {
+  return (offset + DESCRIPTOR_STORE_ALIGNMENT - 1) / DESCRIPTOR_STORE_ALIGNMENT * DESCRIPTOR_STORE_ALIGNMENT;
+}
+
+inline void writeStorePadding(std::ofstream& ofs, uint64_t offset) {
+  static const char zeros[DESCRIPTOR_STORE_ALIGNMENT] = {0};
+  uint64_t position = (uint64_t)ofs.tellp();
+  ofs.write(zeros, offset - position);
+}
+
+// size in bytes of one stored descriptor value, 0 for an unknown type
+inline uint64_t descriptorTypeSize(uint32_t dtype) {
+  switch (dtype) {
+    case DESCRIPTOR_FLOAT32:
+      return sizeof(float);
+    case DESCRIPTOR_INT8:
+      return sizeof(int8_t);
+    case DESCRIPTOR_FLOAT16:
+      return sizeof(uint16_t);
+    default:
+      return 0;
+  }
+}
+
+// true if count elements of elementSize bytes starting at offset end within
+// limit bytes, without overflowing on untrusted header values
+inline bool storeSectionFits(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t limit) {
+  if (offset > limit) {
+    return false;
+  }
+  return elementSize == 0 || count <= (limit - offset) / elementSize;
+}
+
+// number of float32 scales stored with descriptors of the given type
+inline uint64_t descriptorScaleCount(uint32_t dtype, uint64_t dimension, uint64_t count) {
+  return dtype == DESCRIPTOR_INT8 ? dimension + count : 0;
+}
+
+// Write the gallery and the (label, name) table to a descriptor store.
+// names[i] is the name of the person with integer label labels[i].
+// dtype is a DescriptorType, int8 and float16 descriptors are quantized here.
+inline void writeDescriptorStore(const std::string& filename, const std::string& modelId, const FaceGallery& gallery,
+                                 const std::vector<std::string>& names, const std::vector<int>& labels,
+                                 int dtype = DESCRIPTOR_FLOAT32) {
+  if (descriptorTypeSize(dtype) == 0) {
+    CV_Error(cv::Error::StsBadArg, "Unknown descriptor type");
+  }
+  std::ofstream ofs(filename.c_str(), std::ios::binary);
+  if (!ofs) {
+    CV_Error(cv::Error::StsError, "Could not write descriptor store " + filename);
+  }
+
+  DescriptorStoreHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DESCRIPTOR_STORE_MAGIC, sizeof(header.magic));
+  header.version = DESCRIPTOR_STORE_VERSION;
+  header.dtype = dtype;
+  header.dimension = gallery.dimension();
+  header.count = gallery.size();
+  strncpy(header.modelId, modelId.c_str(), sizeof(header.modelId) - 1);
+  header.numNames = (uint32_t)names.size();
+  header.descriptorsChecksum = gallery.checksum();
+
+  uint64_t rowSize = (uint64_t)header.dimension * descriptorTypeSize(dtype);
+  uint64_t numScales = descriptorScaleCount(dtype, header.dimension, header.count);
+  header.descriptorsOffset = alignStoreOffset(sizeof(header));
+  header.normsOffset = alignStoreOffset(header.descriptorsOffset + rowSize * header.count);
+  header.labelsOffset = alignStoreOffset(header.normsOffset + sizeof(float) * header.count);
+  header.scalesOffset = alignStoreOffset(header.labelsOffset + sizeof(int32_t) * header.count);
+  header.namesOffset = alignStoreOffset(header.scalesOffset + sizeof(float) * numScales);
+  header.fileSize = header.namesOffset;
+  for (size_t i = 0; i < names.size(); i++) {
+    header.fileSize += 2 * sizeof(uint32_t) + names[i].size();
+  }
+
+  ofs.write((const char*)&header, sizeof(header));
+
+  writeStorePadding(ofs, header.descriptorsOffset);
+  QuantizedFaceIndex quantized(dtype == DESCRIPTOR_FLOAT16 ? QUANTIZE_FLOAT16 : QUANTIZE_INT8_PER_DIMENSION);
+  if (dtype == DESCRIPTOR_FLOAT32) {
+    const cv::Mat& descriptors = gallery.getDescriptors();
+    for (int i = 0; i < descriptors.rows; i++) {
+      ofs.write((const char*)descriptors.ptr<float>(i), rowSize);
+    }
+  } else {
+    quantized.build(gallery);
+    const void* codes = dtype == DESCRIPTOR_FLOAT16 ? (const void*)quantized.getHalfCodes()
+                                                    : (const void*)quantized.getCodes();
+    ofs.write((const char*)codes, rowSize * header.count);
+  }
+
+  writeStorePadding(ofs, header.normsOffset);
+  ofs.write((const char*)gallery.getNorms().ptr<float>(), sizeof(float) * header.count);
+
+  writeStorePadding(ofs, header.labelsOffset);
+  ofs.write((const char*)gallery.getLabels().ptr<int>(), sizeof(int32_t) * header.count);
+
+  writeStorePadding(ofs, header.scalesOffset);
+  if (numScales > 0) {
+    ofs.write((const char*)quantized.getDimensionScales(), sizeof(float) * header.dimension);
+    ofs.write((const char*)quantized.getVectorScales(), sizeof(float) * header.count);
+  }
+
+  writeStorePadding(ofs, header.namesOffset);
+  for (size_t i = 0; i < names.size(); i++) {
+    int32_t label = labels[i];
+    uint32_t length = (uint32_t)names[i].size();
+    ofs.write((const char*)&label, sizeof(label));
+    ofs.write((const char*)&length, sizeof(length));
+    ofs.write(names[i].data(), length);
+  }
+
+  if (!ofs) {
+    CV_Error(cv::Error::StsError, "Could not write descriptor store " + filename);
+  }
+}
+
+// Read-only, memory mapped descriptor store.
+class DescriptorStore {
+public:
+  DescriptorStore() : data(NULL), size(0) {
+#ifdef _WIN32
+    fileHandle = INVALID_HANDLE_VALUE;
+    mappingHandle = NULL;
+#endif
+  }
+
+  ~DescriptorStore() {
+    close();
+  }
+
+  // Map the store into memory and check its header.
+  // expectedModelId, if not empty, has to match the model recorded in the store.
+  void open(const std::string& filename, const std::string& expectedModelId = "") {
+    close();
+    if (!mapFile(filename)) {
+      CV_Error(cv::Error::StsBadArg, "Could not open descriptor store " + filename);
+    }
+    if (size < sizeof(DescriptorStoreHeader) || memcmp(header().magic, DESCRIPTOR_STORE_MAGIC, 8) != 0) {
+      close();
+      CV_Error(cv::Error::StsBadArg, filename + " is not a descriptor store");
+    }
+    const DescriptorStoreHeader& h = header();
+    uint64_t elementSize = descriptorTypeSize(h.dtype);
+    if (h.version != DESCRIPTOR_STORE_VERSION || elementSize == 0 || h.fileSize > size) {
+      close();
+      CV_Error(cv::Error::StsBadArg, filename + " has an unsupported version or is truncated");
+    }
+    // every section has to lie within the file and start aligned,
+    // the mapped data is read as floats and ints in place
+    bool aligned = h.descriptorsOffset % DESCRIPTOR_STORE_ALIGNMENT == 0 &&
+                   h.normsOffset % DESCRIPTOR_STORE_ALIGNMENT == 0 &&
+                   h.labelsOffset % DESCRIPTOR_STORE_ALIGNMENT == 0 &&
+                   h.scalesOffset % DESCRIPTOR_STORE_ALIGNMENT == 0;
+    if (!aligned || h.dimension == 0 || h.count > (uint32_t)INT_MAX || h.dimension > (uint32_t)INT_MAX ||
+        !storeSectionFits(h.descriptorsOffset, h.count, h.dimension * elementSize, h.fileSize) ||
+        !storeSectionFits(h.normsOffset, h.count, sizeof(float), h.fileSize) ||
+        !storeSectionFits(h.labelsOffset, h.count, sizeof(int32_t), h.fileSize) ||
+        !storeSectionFits(h.scalesOffset, descriptorScaleCount(h.dtype, h.dimension, h.count), sizeof(float),
+                          h.fileSize) ||
+        h.namesOffset > h.fileSize) {
+      close();
+      CV_Error(cv::Error::StsBadArg, filename + " is corrupt, a section lies outside the file");
+    }
+    if (!expectedModelId.empty() && expectedModelId != modelId()) {
+      std::string storeModelId = modelId();
+      close();
+      CV_Error(cv::Error::StsBadArg, filename + " holds descriptors of model " + storeModelId +
+               ", expected " + expectedModelId);
+    }
+  }
+
+  void close() {
+    if (data == NULL) {
+      return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+    fileHandle = INVALID_HANDLE_VALUE;
+    mappingHandle = NULL;
+#else
+    munmap(data, size);
+#endif
+    data = NULL;
+    size = 0;
+  }
+
+  const DescriptorStoreHeader& header() const {
+    return *(const DescriptorStoreHeader*)data;
+  }
+
+  int dimension() const {
+    return header().dimension;
+  }
+
+  int count() const {
+    return header().count;
+  }
+
+  // DescriptorType of the stored descriptors
+  int dtype() const {
+    return header().dtype;
+  }
+
+  // checksum of the float32 descriptors the store was written from. Equal to
+  // gallery().checksum() for float32 stores only, int8 and float16 stores
+  // decode to approximations of those descriptors
+  uint64_t checksum() const {
+    return header().descriptorsChecksum;
+  }
+
+  std::string modelId() const {
+    const DescriptorStoreHeader& h = header();
+    return std::string(h.modelId, strnlen(h.modelId, sizeof(h.modelId)));
+  }
+
+  // Gallery of the stored descriptors. float32 descriptors, norms and labels
+  // are used in place and the store has to stay open while the gallery is
+  // used. int8 and float16 descriptors are decoded into a float copy.
+  FaceGallery gallery() const {
+    const DescriptorStoreHeader& h = header();
+    if (h.dtype == DESCRIPTOR_FLOAT32) {
+      return FaceGallery(h.count, h.dimension,
+                         (const float*)(data + h.descriptorsOffset),
+                         (const float*)(data + h.normsOffset),
+                         (const int*)(data + h.labelsOffset));
+    }
+    cv::Ptr<QuantizedFaceIndex> quantized = quantizedIndex();
+    FaceGallery decoded(h.dimension);
+    decoded.reserve(h.count);
+    std::vector<float> descriptor(h.dimension);
+    for (int i = 0; i < (int)h.count; i++) {
+      quantized->decode(i, &descriptor[0]);
+      decoded.add(&descriptor[0], quantized->getLabels()[i]);
+    }
+    return decoded;
+  }
+
+  // Exact search over the mapped int8 or float16 descriptors in place,
+  // without a float copy. The store has to stay open while the index is used.
+  cv::Ptr<QuantizedFaceIndex> quantizedIndex() const {
+    const DescriptorStoreHeader& h = header();
+    if (h.dtype == DESCRIPTOR_FLOAT32) {
+      CV_Error(cv::Error::StsBadArg, "Descriptor store holds float32 descriptors, use gallery()");
+    }
+    const float* scales = (const float*)(data + h.scalesOffset);
+    return cv::makePtr<QuantizedFaceIndex>(h.dtype == DESCRIPTOR_FLOAT16 ? QUANTIZE_FLOAT16 : QUANTIZE_INT8_PER_DIMENSION,
+                                           (int)h.count, (int)h.dimension,
+                                           (const void*)(data + h.descriptorsOffset),
+                                           scales, scales + h.dimension,
+                                           (const float*)(data + h.normsOffset),
+                                           (const int*)(data + h.labelsOffset));
+  }
+
+  // read names, labels and labels-name-mapping from the names table
+  void readNames(std::vector<std::string>& names, std::vector<int>& labels, std::map<int, std::string>& labelNameMap) const {
+    const DescriptorStoreHeader& h = header();
+    const char* p = data + h.namesOffset;
+    const char* end = data + h.fileSize;
+    for (uint32_t i = 0; i < h.numNames && p + 2 * sizeof(uint32_t) <= end; i++) {
+      int32_t label;
+      uint32_t length;
+      memcpy(&label, p, sizeof(label));
+      memcpy(&length, p + sizeof(label), sizeof(length));
+      p += sizeof(label) + sizeof(length);
+      if (length > (uint64_t)(end - p)) {
+        break;
+      }
+      std::string name(p, length);
+      p += length;
+      names.push_back(name);
+      labels.push_back(label);
+      labelNameMap[label] = name;
+    }
+  }
+
+private:
+  char* data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE fileHandle;
+  HANDLE mappingHandle;
+#endif
+
+  // DescriptorStore owns its mapping, so it cannot be copied
+  DescriptorStore(const DescriptorStore&);
+  DescriptorStore& operator=(const DescriptorStore&);
+
+  bool mapFile(const std::string& filename) {
+#ifdef _WIN32
+    fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(fileHandle, &fileSize);
+    mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mappingHandle == NULL) {
+      CloseHandle(fileHandle);
+      fileHandle = INVALID_HANDLE_VALUE;
+      return false;
+    }
+    data = (char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    size = (size_t)fileSize.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      return false;
+    }
+    data = (char*)mapped;
+    size = st.st_size;
+#endif
+    return data != NULL;
+  }
+};
+
+// Read descriptors from the legacy descriptors.csv text format into the gallery.
+// Each line has the face label followed by the descriptor values.
+inline void readDescriptorsCsv(const std::string& filename, FaceGallery& gallery, char separator = ';') {
+  std::ifstream file(filename.c_str(), std::ifstream::in);
+  if (!file) {
+    CV_Error(cv::Error::StsBadArg, "No valid input file was given, please check the given filename.");
+  }
+  std::string line, faceLabel, valueStr;
+  std::vector<float> faceDescriptorVec;
+  while (getline(file, line)) {
+    std::stringstream liness(line);
+    getline(liness, faceLabel, separator);
+    faceDescriptorVec.clear();
+    while (getline(liness, valueStr, separator)) {
+      if (!valueStr.empty()) {
+        faceDescriptorVec.push_back((float)atof(valueStr.c_str()));
+      }
+    }
+    if (!faceLabel.empty() && (int)faceDescriptorVec.size() == gallery.dimension()) {
+      gallery.add(&faceDescriptorVec[0], atoi(faceLabel.c_str()));
+    }
+  }
+}
+
+// Read the legacy label_name.txt file of "name;label" lines.
+inline void readLabelNameCsv(const std::string& filename, std::vector<std::string>& names, std::vector<int>& labels,
+                      char separator = ';') {
+  std::ifstream file(filename.c_str(), std::ifstream::in);
+  if (!file) {
+    CV_Error(cv::Error::StsBadArg, "No valid input file was given, please check the given filename.");
+  }
+  std::string line, name, labelStr;
+  while (getline(file, line)) {
+    std::stringstream liness(line);
+    getline(liness, name, separator);
+    getline(liness, labelStr);
+    if (!name.empty() && !labelStr.empty()) {
+      names.push_back(name);
+      labels.push_back(atoi(labelStr.c_str()));
+    }
+  }
+}
+
+#endif // BIGVISION_descriptorStore_HPP_
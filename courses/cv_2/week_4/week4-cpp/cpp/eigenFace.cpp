@@ -8,6 +8,7 @@
 #include <dirent.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/stat.h>
 
 using namespace cv;
 using namespace std;
@@ -15,6 +16,17 @@ using namespace std;
 #define MAX_SLIDER_VALUE 255
 #define NUM_EIGEN_FACES 10
 
+// Randomized PCA settings. Extra random directions sampled beyond
+// NUM_EIGEN_FACES and power iterations make the leading components accurate
+// even when the eigenvalues decay slowly. Images are read and processed
+// PCA_CHUNK_IMAGES at a time, so memory does not grow with the dataset.
+#define PCA_OVERSAMPLING 10
+#define PCA_POWER_ITERATIONS 1
+#define PCA_CHUNK_IMAGES 64
+
+// mean face and eigenfaces are saved here and reused by the next run
+#define PCA_MODEL_FILE "eigenFaceModel.yml"
+
 
 // Weights for the different eigenvectors
 int sliderValues[NUM_EIGEN_FACES];
@@ -23,23 +35,18 @@ int sliderValues[NUM_EIGEN_FACES];
 Mat averageFace;
 vector<Mat> eigenFaces;
 
-// Read jpg files from the directory
-void readImages(string dirName, vector<Mat> &images)
+// List jpg files in the directory
+void listImages(string dirName, vector<string> &paths)
 {
-
-  cout << "Reading images from " << dirName;
-
   // Add slash to directory name if missing
   if (!dirName.empty() && dirName.back() != '/')
     dirName += '/';
 
   DIR *dir;
   struct dirent *ent;
-  int count = 0;
 
   //image extensions
   string imgExt = "jpg";
-  vector<string> files;
 
   if ((dir = opendir (dirName.c_str())) != NULL)
   {
@@ -54,28 +61,37 @@ void readImages(string dirName, vector<Mat> &images)
 
       if (fname.find(imgExt, (fname.length() - imgExt.length())) != std::string::npos)
       {
-        string path = dirName + fname;
-        Mat img = imread(path);
-        if(!img.data)
-        {
-          cout << "image " << path << " not read properly" << endl;
-        }
-        else
-        {
-          // Convert images to floating point type
-          img.convertTo(img, CV_32FC3, 1/255.0);
-          images.push_back(img);
-
-          // A vertically flipped image is also a valid face image.
-          // So lets use them as well.
-          Mat imgFlip;
-          flip(img, imgFlip, 1);
-          images.push_back(imgFlip);
-        }
+        paths.push_back(dirName + fname);
       }
     }
     closedir (dir);
   }
+  sort(paths.begin(), paths.end());
+}
+
+// Read jpg files from the directory
+void readImages(const vector<string> &paths, vector<Mat> &images)
+{
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    Mat img = imread(paths[i]);
+    if(!img.data)
+    {
+      cout << "image " << paths[i] << " not read properly" << endl;
+    }
+    else
+    {
+      // Convert images to floating point type
+      img.convertTo(img, CV_32FC3, 1/255.0);
+      images.push_back(img);
+
+      // A vertically flipped image is also a valid face image.
+      // So lets use them as well.
+      Mat imgFlip;
+      flip(img, imgFlip, 1);
+      images.push_back(imgFlip);
+    }
+  }
 
   // Exit program if no images are found
   if(images.empty())exit(EXIT_FAILURE);
@@ -118,6 +134,253 @@ static  Mat createDataMatrix(const vector<Mat> &images)
   return data;
 }
 
+// Read images [start, end) of paths as rows of data, each image followed
+// by its flipped copy. Images are decoded in parallel. Images that cannot
+// be read are dropped and their paths removed, so the next pass over the
+// same paths reads the same rows. Returns the number of images read.
+static int readImageRows(vector<string> &paths, int start, int end, Size sz, Mat &data)
+{
+  int numImages = end - start;
+  data.create(2 * numImages, sz.area() * 3, CV_32F);
+  vector<uchar> valid(numImages, 0);
+  parallel_for_(Range(0, numImages), [&](const Range &range)
+  {
+    for (int i = range.start; i < range.end; i++)
+    {
+      Mat img = imread(paths[start + i]);
+      if (!img.data)
+        continue;
+      if (img.size() != sz)
+        resize(img, img, sz);
+
+      // write the image and its flipped copy straight into their rows
+      Mat row = data.row(2 * i).reshape(3, sz.height);
+      img.convertTo(row, CV_32FC3, 1/255.0);
+      Mat rowFlip = data.row(2 * i + 1).reshape(3, sz.height);
+      flip(row, rowFlip, 1);
+      valid[i] = 1;
+    }
+  });
+
+  // move rows of the images that were read to the top
+  int numValid = 0;
+  for (int i = 0; i < numImages; i++)
+  {
+    if (!valid[i])
+    {
+      cout << "image " << paths[start + i] << " not read properly" << endl;
+      continue;
+    }
+    if (numValid != i)
+    {
+      data.rowRange(2 * i, 2 * i + 2).copyTo(data.rowRange(2 * numValid, 2 * numValid + 2));
+      paths[start + numValid] = paths[start + i];
+    }
+    numValid++;
+  }
+  paths.erase(paths.begin() + start + numValid, paths.begin() + end);
+  data = data.rowRange(0, 2 * numValid);
+  return numValid;
+}
+
+// result = a * b, blocks of rows of the result are computed in parallel
+static void multiplyBlocks(const Mat &a, const Mat &b, Mat &result)
+{
+  result.create(a.rows, b.cols, CV_32F);
+  parallel_for_(Range(0, a.rows), [&](const Range &range)
+  {
+    Mat out = result.rowRange(range.start, range.end);
+    gemm(a.rowRange(range.start, range.end), b, 1, noArray(), 0, out);
+  });
+}
+
+// result += a^T * b, blocks of rows of the result are computed in parallel
+static void accumulateTransposedBlocks(const Mat &a, const Mat &b, Mat &result)
+{
+  parallel_for_(Range(0, a.cols), [&](const Range &range)
+  {
+    Mat product;
+    gemm(a.colRange(range.start, range.end), b, 1, noArray(), 0, product, GEMM_1_T);
+    Mat out = result.rowRange(range.start, range.end);
+    out += product;
+  }, getNumThreads() * 4);
+}
+
+// Orthonormalize the columns of m in place (modified Gram-Schmidt)
+static void orthonormalizeColumns(Mat &m)
+{
+  Mat t = m.t();
+  for (int i = 0; i < t.rows; i++)
+  {
+    Mat vi = t.row(i);
+    for (int j = 0; j < i; j++)
+    {
+      Mat vj = t.row(j);
+      vi -= vj * vi.dot(vj);
+    }
+    double length = norm(vi);
+    if (length > 0)
+      vi /= length;
+  }
+  m = t.t();
+}
+
+// Randomized PCA of the images in paths and their flipped copies.
+//
+// Never builds the data matrix A. Images are streamed in chunks of
+// PCA_CHUNK_IMAGES and every pass only multiplies a chunk with a
+// (pixels x rank) or (rows x rank) matrix, rank = numComponents +
+// PCA_OVERSAMPLING:
+//   1. mean and Y = (A - mean) * Omega for a random Gaussian Omega
+//   2. PCA_POWER_ITERATIONS times Z = (A - mean)^T Q, Q = (A - mean) Z
+//   3. Bt = (A - mean)^T Q
+// where Q and Z are orthonormalized after every pass. The principal
+// components are then found from the small rank x rank matrix Bt^T Bt.
+static void randomizedPCA(vector<string> &paths, Size sz, int numComponents, PCA &pca)
+{
+  int dim = sz.area() * 3;
+  int rank = numComponents + PCA_OVERSAMPLING;
+  Mat chunk, chunkProduct;
+
+  // pass 1: sum of the rows and A * Omega, centered once the mean is known
+  RNG rng(0x5eed);
+  Mat omega(dim, rank, CV_32F);
+  rng.fill(omega, RNG::NORMAL, 0, 1);
+  Mat sum = Mat::zeros(1, dim, CV_64F);
+  Mat q;
+  for (int start = 0; start < (int)paths.size();)
+  {
+    int end = min(start + PCA_CHUNK_IMAGES, (int)paths.size());
+    // paths of unreadable images are removed, the next chunk starts after the ones read
+    start += readImageRows(paths, start, end, sz, chunk);
+
+    Mat chunkSum;
+    reduce(chunk, chunkSum, 0, REDUCE_SUM, CV_64F);
+    sum += chunkSum;
+    multiplyBlocks(chunk, omega, chunkProduct);
+    q.push_back(chunkProduct);
+  }
+  if (paths.empty())
+    exit(EXIT_FAILURE);
+  cout << "... " << paths.size() << " files read" << endl;
+
+  int numRows = 2 * (int)paths.size();
+  Mat mean;
+  sum.convertTo(mean, CV_32F, 1.0 / numRows);
+  Mat meanProduct = mean * omega;
+  for (int i = 0; i < numRows; i++)
+    q.row(i) -= meanProduct;
+  orthonormalizeColumns(q);
+
+  // passes 2 and 3, every pass reads all images once more
+  Mat z;
+  for (int iteration = 0; iteration <= PCA_POWER_ITERATIONS; iteration++)
+  {
+    z = Mat::zeros(dim, rank, CV_32F);
+    bool lastPass = iteration == PCA_POWER_ITERATIONS;
+    for (int start = 0; start < (int)paths.size(); start += PCA_CHUNK_IMAGES)
+    {
+      int end = min(start + PCA_CHUNK_IMAGES, (int)paths.size());
+      readImageRows(paths, start, end, sz, chunk);
+      for (int i = 0; i < chunk.rows; i++)
+        chunk.row(i) -= mean;
+      accumulateTransposedBlocks(chunk, q.rowRange(2 * start, 2 * start + chunk.rows), z);
+    }
+    if (lastPass)
+      break;
+
+    orthonormalizeColumns(z);
+    for (int start = 0; start < (int)paths.size(); start += PCA_CHUNK_IMAGES)
+    {
+      int end = min(start + PCA_CHUNK_IMAGES, (int)paths.size());
+      readImageRows(paths, start, end, sz, chunk);
+      for (int i = 0; i < chunk.rows; i++)
+        chunk.row(i) -= mean;
+      Mat out = q.rowRange(2 * start, 2 * start + chunk.rows);
+      multiplyBlocks(chunk, z, chunkProduct);
+      chunkProduct.copyTo(out);
+    }
+    orthonormalizeColumns(q);
+  }
+
+  // z = (A - mean)^T Q = V S U^T, so z^T z = U S^2 U^T and V = z U S^-1
+  Mat small = z.t() * z;
+  Mat values, vectors;
+  eigen(small, values, vectors);
+  Mat components = vectors.rowRange(0, numComponents) * z.t();
+  for (int i = 0; i < numComponents; i++)
+  {
+    Mat component = components.row(i);
+    double length = norm(component);
+    if (length > 0)
+      component /= length;
+  }
+
+  pca.mean = mean;
+  pca.eigenvectors = components;
+  // eigenvalues of the covariance matrix, as computed by cv::PCA
+  pca.eigenvalues = values.rowRange(0, numComponents) / numRows;
+}
+
+// Identify a set of images by the path, size and modification time of
+// each file (64 bit FNV-1a), so adding, removing, renaming or replacing
+// an image changes it. Returned as hex text, FileStorage has no 64 bit integers.
+static string hashImageSet(const vector<string> &paths)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    struct stat st;
+    int64_t fileStat[2] = {-1, -1};
+    if (stat(paths[i].c_str(), &st) == 0)
+    {
+      fileStat[0] = (int64_t)st.st_size;
+      fileStat[1] = (int64_t)st.st_mtime;
+    }
+    // the terminating zero separates consecutive paths
+    const unsigned char *bytes = (const unsigned char *)paths[i].c_str();
+    for (size_t j = 0; j <= paths[i].size(); j++)
+    {
+      hash ^= bytes[j];
+      hash *= 1099511628211ULL;
+    }
+    bytes = (const unsigned char *)fileStat;
+    for (size_t j = 0; j < sizeof(fileStat); j++)
+    {
+      hash ^= bytes[j];
+      hash *= 1099511628211ULL;
+    }
+  }
+  return format("%016llx", (unsigned long long)hash);
+}
+
+// Save the mean face and eigenfaces along with the mode and data they were computed with
+static void savePCA(const string &filename, const PCA &pca, const string &mode, Size sz, const string &imageSet)
+{
+  FileStorage fs(filename, FileStorage::WRITE);
+  fs << "mode" << mode << "imageWidth" << sz.width << "imageHeight" << sz.height << "imageSet" << imageSet;
+  pca.write(fs);
+}
+
+// Load a model saved by savePCA if it was computed in this mode on
+// the image set hashed to imageSet, of images of size sz
+static bool loadPCA(const string &filename, PCA &pca, const string &mode, Size sz, const string &imageSet)
+{
+  FileStorage fs(filename, FileStorage::READ);
+  if (!fs.isOpened())
+    return false;
+  string savedMode, savedImageSet;
+  int savedWidth = -1, savedHeight = -1;
+  fs["mode"] >> savedMode;
+  fs["imageWidth"] >> savedWidth;
+  fs["imageHeight"] >> savedHeight;
+  fs["imageSet"] >> savedImageSet;
+  if (savedMode != mode || savedWidth != sz.width || savedHeight != sz.height || savedImageSet != imageSet)
+    return false;
+  pca.read(fs.root());
+  return pca.eigenvectors.rows >= NUM_EIGEN_FACES && pca.eigenvectors.cols == sz.area() * 3;
+}
+
 // Calculate final image by adding weighted
 // EigenFaces to the average face.
 void createNewFace(int ,void *)
@@ -159,23 +422,58 @@ void resetSliderValues(int event, int x, int y, int flags, void* userdata)
 
 int main(int argc, char **argv)
 {
+  // PCA mode. "randomized" streams the images through a randomized PCA
+  // with bounded memory, "full" builds the whole data matrix in memory.
+  string mode = argc > 1 ? argv[1] : "randomized";
+
   // Directory containing images
   string dirName = "../data/images/eigenface/";
+  vector<string> paths;
+  cout << "Reading images from " << dirName;
+  listImages(dirName, paths);
+  if (paths.empty())
+    exit(EXIT_FAILURE);
 
-  // Read images in the directory
-  vector<Mat> images;
-  readImages(dirName, images);
+  // Size of images is taken from the first one
+  Mat first = imread(paths[0]);
+  if (!first.data)
+    exit(EXIT_FAILURE);
+  Size sz = first.size();
 
-  // Size of images. All images should be the same size.
-  Size sz = images[0].size();
+  // a model computed on other images is not reused
+  string imageSet = hashImageSet(paths);
 
-  // Create data matrix for PCA.
-  Mat data = createDataMatrix(images);
+  PCA pca;
+  if (loadPCA(PCA_MODEL_FILE, pca, mode, sz, imageSet))
+  {
+    cout << "... loaded mean and eigenfaces of " << paths.size() << " files from " << PCA_MODEL_FILE << endl;
+  }
+  else if (mode == "full")
+  {
+    // Read images in the directory
+    vector<Mat> images;
+    readImages(paths, images);
 
-  // Calculate PCA of the data matrix
-  cout << "Calculating PCA ...";
-  PCA pca(data, Mat(), PCA::DATA_AS_ROW, NUM_EIGEN_FACES);
-  cout << " DONE"<< endl;
+    // Size of images. All images should be the same size.
+    sz = images[0].size();
+
+    // Create data matrix for PCA.
+    Mat data = createDataMatrix(images);
+
+    // Calculate PCA of the data matrix
+    cout << "Calculating PCA ...";
+    pca(data, Mat(), PCA::DATA_AS_ROW, NUM_EIGEN_FACES);
+    cout << " DONE"<< endl;
+    savePCA(PCA_MODEL_FILE, pca, mode, sz, imageSet);
+  }
+  else
+  {
+    double t = (double)getTickCount();
+    randomizedPCA(paths, sz, NUM_EIGEN_FACES, pca);
+    cout << "Randomized PCA with " << getNumThreads() << " threads took "
+         << ((double)getTickCount() - t) / getTickFrequency() << " s" << endl;
+    savePCA(PCA_MODEL_FILE, pca, mode, sz, imageSet);
+  }
 
   // Extract mean vector and reshape it to obtain average face
   averageFace = pca.mean.reshape(3,sz.height);
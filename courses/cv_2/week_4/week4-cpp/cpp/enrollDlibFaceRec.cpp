@@ -21,6 +21,8 @@
 #include <sstream>
 #include <math.h>
 #include <map>
+#include <atomic>
+#include <thread>
 
 #include <opencv2/core.hpp>
 #include <opencv2/videoio.hpp>
@@ -34,6 +36,13 @@
 #include <dlib/image_processing.h>
 #include <dlib/image_processing/frontal_face_detector.h>
 
+#include "faceGallery.hpp"
+#include "faceIndex.hpp"
+#include "descriptorStore.hpp"
+#include "enrollmentCache.hpp"
+#include "workQueue.hpp"
+#include "faceQuality.hpp"
+
 // dirent.h is pre-included with *nix like systems
 // but not for Windows. So we are trying to include
 // this header files based on Operating System
@@ -58,6 +67,21 @@ using namespace cv;
 using namespace dlib;
 using namespace std;
 
+// model the descriptors are computed with, recorded in the descriptor store
+#define FACE_MODEL_ID "dlib_face_recognition_resnet_model_v1"
+
+// quality gate, faces failing any of these thresholds are skipped
+#define MIN_INTER_EYE_DISTANCE 20  // pixels
+#define MIN_SHARPNESS 40           // variance of the Laplacian
+#define MAX_YAW 35                 // degrees
+#define MAX_PITCH 25               // degrees
+#define MIN_BRIGHTNESS 40          // mean gray level
+#define MAX_BRIGHTNESS 215         // mean gray level
+
+// type of the stored descriptors: DESCRIPTOR_FLOAT32, or DESCRIPTOR_INT8 and
+// DESCRIPTOR_FLOAT16 for a 4 and 2 times smaller store, searched exhaustively
+#define DESCRIPTOR_TYPE DESCRIPTOR_FLOAT32
+
 // ----------------------------------------------------------------------------------------
 // The next bit of code defines a ResNet network. It's basically copied
 // and pasted from the dnn_imagenet_ex.cpp example, except we replaced the loss
@@ -150,12 +174,131 @@ void printVector(std::vector<T>& vec) {
   cout << endl;
 }
 
-int main() {
-  // Initialize face detector, facial landmarks detector and face recognizer
+// faces of one image on their way through the enrollment pipeline
+struct FaceJob {
+  int image;                                        // index of the image in imagePaths
+  std::vector<matrix<rgb_pixel>> faceChips;         // aligned 150x150 faces
+  std::vector<matrix<float,0,1>> faceDescriptors;   // their 128D descriptors
+  std::vector<FaceQuality> faceQualities;           // quality of every face found, enrolled or not
+};
+
+// Decoder/detector stage of the pipeline, run by several threads.
+// Takes the next image to enroll, finds its faces and queues their chips.
+// Faces failing the quality thresholds are not enrolled.
+// Every thread uses its own face detector and copy of the landmark detector.
+void detectFaces(const std::vector<string>& imagePaths, const std::vector<int>& newImages, std::atomic<int>& nextImage,
+                 shape_predictor landmarkDetector, const FaceQualityThresholds& qualityThresholds,
+                 WorkQueue<FaceJob>& chipQueue) {
+  frontal_face_detector faceDetector = get_frontal_face_detector();
+  for (int m = nextImage++; m < (int)newImages.size(); m = nextImage++) {
+    FaceJob job;
+    job.image = newImages[m];
+
+    // read image using OpenCV
+    Mat im = cv::imread(imagePaths[job.image], cv::IMREAD_COLOR);
+    if (im.empty()) {
+      // unreadable images are enrolled without faces
+      chipQueue.push(std::move(job));
+      continue;
+    }
+
+    // convert image from BGR to RGB
+    // because Dlib used RGB format
+    Mat imRGB;
+    cv::cvtColor(im, imRGB, cv::COLOR_BGR2RGB);
+
+    // convert OpenCV image to Dlib's cv_image object, then to Dlib's matrix object
+    // Dlib's dnn module doesn't accept Dlib's cv_image template
+    dlib::matrix<dlib::rgb_pixel> imDlib(dlib::mat(dlib::cv_image<dlib::rgb_pixel>(imRGB)));
+
+    // detect faces in image
+    std::vector<dlib::rectangle> faceRects = faceDetector(imDlib);
+    // Now process each face we found
+    for (int j = 0; j < faceRects.size(); j++) {
+      // Find facial landmarks for each detected face
+      full_object_detection landmarks = landmarkDetector(imDlib, faceRects[j]);
+
+      // small, blurred, turned or badly lit faces would add unreliable descriptors
+      FaceQuality quality = assessFaceQuality(im, landmarks, qualityThresholds);
+      job.faceQualities.push_back(quality);
+      if (!quality.acceptable()) {
+        continue;
+      }
+
+      // original face rectangle is warped to 150x150 patch.
+      // Same pre-processing was also performed during training.
+      job.faceChips.push_back(matrix<rgb_pixel>());
+      extract_image_chip(imDlib, get_face_chip_details(landmarks, 150, 0.25), job.faceChips.back());
+    }
+    chipQueue.push(std::move(job));
+  }
+  chipQueue.close();
+}
+
+// Inference stage of the pipeline, run by one thread.
+// Collects the chips of queued images until there are at least batchSize
+// faces and passes them to the network at once, which computes the
+// descriptors of the whole batch in a single forward pass.
+void computeDescriptors(anet_type& net, int batchSize, WorkQueue<FaceJob>& chipQueue,
+                        WorkQueue<FaceJob>& descriptorQueue) {
+  std::vector<FaceJob> jobs;
+  std::vector<matrix<rgb_pixel>> batch;
+  std::vector<matrix<float,0,1>> descriptors;
+  int numChips = 0;
+  FaceJob job;
+  bool more = true;
+  while (more) {
+    more = chipQueue.pop(job);
+    if (more) {
+      numChips += job.faceChips.size();
+      jobs.push_back(std::move(job));
+      if (numChips < batchSize) {
+        continue;
+      }
+    }
+
+    batch.clear();
+    for (int m = 0; m < jobs.size(); m++) {
+      for (int j = 0; j < jobs[m].faceChips.size(); j++) {
+        batch.push_back(std::move(jobs[m].faceChips[j]));
+      }
+    }
+    descriptors.clear();
+    if (!batch.empty()) {
+      descriptors = net(batch, batchSize);
+    }
+
+    // hand the descriptors of every image on to the writer
+    int d = 0;
+    for (int m = 0; m < jobs.size(); m++) {
+      int numFaces = jobs[m].faceChips.size();
+      jobs[m].faceChips.clear();
+      jobs[m].faceDescriptors.assign(descriptors.begin() + d, descriptors.begin() + d + numFaces);
+      d += numFaces;
+      descriptorQueue.push(std::move(jobs[m]));
+    }
+    jobs.clear();
+    numChips = 0;
+  }
+  descriptorQueue.close();
+}
+
+int main(int argc, char** argv) {
+  // Enrollment runs as a pipeline: detector threads decode images and cut
+  // out face chips, one inference thread computes descriptors of batches
+  // of chips and this thread writes them to the gallery.
+  cout << "USAGE" << endl << "./enrollDlibFaceRec [numDetectorThreads] [batchSize]" << endl;
+  int numDetectorThreads = std::max(1, argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency() - 1);
+  int batchSize = std::max(1, argc > 2 ? atoi(argv[2]) : 32);
+  // faces below these thresholds are not enrolled
+  FaceQualityThresholds qualityThresholds(MIN_INTER_EYE_DISTANCE, MIN_SHARPNESS, MAX_YAW, MAX_PITCH,
+                                          MIN_BRIGHTNESS, MAX_BRIGHTNESS);
+
+  // Initialize facial landmarks detector and face recognizer,
+  // every detector thread creates its own face detector
   String predictorPath, faceRecognitionModelPath;
   predictorPath = "../data/models/shape_predictor_68_face_landmarks.dat";
   faceRecognitionModelPath = "../data/models/dlib_face_recognition_resnet_model_v1.dat";
-  frontal_face_detector faceDetector = get_frontal_face_detector();
   shape_predictor landmarkDetector;
   deserialize(predictorPath) >> landmarkDetector;
   anet_type net;
@@ -171,20 +314,15 @@ int main() {
   // as we are looking for sub-directories only
   listdir(faceDatasetFolder, subfolders, fileNames, symlinkNames);
 
-  // names: vector containing names of subfolders i.e. persons
-  // labels: integer labels assigned to persons
-  // labelNameMap: dict containing (integer label, person name) pairs
-  std::vector<string> names;
-  std::vector<int> labels;
-  std::map<int, string> labelNameMap;
-  // add -1 integer label for un-enrolled persons
-  names.push_back("unknown");
-  labels.push_back(-1);
+  // the cache is only valid for the model and quality thresholds it was written with
+  const string cacheKey = string(FACE_MODEL_ID) + " quality " + qualityThresholds.key();
 
+  // names: vector containing names of subfolders i.e. persons
   // imagePaths: vector containing imagePaths
-  // imageLabels: vector containing integer labels corresponding to imagePaths
+  // imagePersons: vector containing the index in names of the person in each image
+  std::vector<string> names;
   std::vector<string> imagePaths;
-  std::vector<int> imageLabels;
+  std::vector<int> imagePersons;
 
   // variable to hold any subfolders within person subFolders
   std::vector<string> folderNames;
@@ -194,13 +332,8 @@ int main() {
     // remove / or \\ from end of subFolder
     std::size_t found = personFolderName.find_last_of("/\\");
     string name = personFolderName.substr(found+1);
-    // assign integer label to person subFolder
-    int label = i;
-    // add person name and label to vectors
+    // add person name to vector
     names.push_back(name);
-    labels.push_back(label);
-    // add (integer label, person name) pair to map
-    labelNameMap[label] = name;
 
     // read imagePaths from each person subFolder
     // clear vectors
@@ -212,71 +345,60 @@ int main() {
     // read all files present in subFolder
     listdir(subfolders[i], folderNames, fileNames, symlinkNames);
     // filter only jpg files
-    filterFiles(subfolders[i], fileNames, imagePaths, "jpg", imageLabels, i);
+    filterFiles(subfolders[i], fileNames, imagePaths, "jpg", imagePersons, i);
     }
 
-  // process training data
-  // We will store face descriptors in vector faceDescriptors
-  // and their corresponding labels in vector faceLabels
-  std::vector<matrix<float,0,1>> faceDescriptors;
-  // std::vector<cv_image<bgr_pixel> > imagesFaceTrain;
-  std::vector<int> faceLabels;
-
-  // iterate over images
-  for (int i = 0; i < imagePaths.size(); i++) {
-    string imagePath = imagePaths[i];
-    int imageLabel = imageLabels[i];
-
-    cout << "processing: " << imagePath << endl;
-
-    // read image using OpenCV
-    Mat im = cv::imread(imagePath, cv::IMREAD_COLOR);
-
-    // convert image from BGR to RGB
-    // because Dlib used RGB format
-    Mat imRGB;
-    cv::cvtColor(im, imRGB, cv::COLOR_BGR2RGB);
-
-    // convert OpenCV image to Dlib's cv_image object, then to Dlib's matrix object
-    // Dlib's dnn module doesn't accept Dlib's cv_image template
-    dlib::matrix<dlib::rgb_pixel> imDlib(dlib::mat(dlib::cv_image<dlib::rgb_pixel>(imRGB)));
-
-    // detect faces in image
-    std::vector<dlib::rectangle> faceRects = faceDetector(imDlib);
-    cout << faceRects.size() << " Face(s) Found" << endl;
-    // Now process each face we found
-    for (int j = 0; j < faceRects.size(); j++) {
-
-      // Find facial landmarks for each detected face
-      full_object_detection landmarks = landmarkDetector(imDlib, faceRects[j]);
-
-      // object to hold preProcessed face rectangle cropped from image
-      matrix<rgb_pixel> face_chip;
-
-      // original face rectangle is warped to 150x150 patch.
-      // Same pre-processing was also performed during training.
-      extract_image_chip(imDlib, get_face_chip_details(landmarks, 150, 0.25), face_chip);
-
-      // Compute face descriptor using neural network defined in Dlib.
-      // It is a 128D vector that describes the face in img identified by shape.
-      matrix<float,0,1> faceDescriptor = net(face_chip);
-
-      // add face descriptor and label for this face to
-      // vectors faceDescriptors and faceLabels
-      faceDescriptors.push_back(faceDescriptor);
-      // add label for this face to vector containing labels corresponding to
-      // vector containing face descriptors
-      faceLabels.push_back(imageLabel);
+  // runs the pipeline on the images that are not enrolled yet
+  ComputeFacesFunction computeFaces = [&](const std::vector<int>& newImages, const AddFacesFunction& addFaces) {
+    double t = (double)cv::getTickCount();
+    WorkQueue<FaceJob> chipQueue(4 * batchSize);
+    WorkQueue<FaceJob> descriptorQueue(4 * batchSize);
+    chipQueue.setProducers(numDetectorThreads);
+    std::atomic<int> nextImage(0);
+    std::vector<std::thread> detectorThreads;
+    for (int k = 0; k < numDetectorThreads; k++) {
+      detectorThreads.push_back(std::thread(detectFaces, std::cref(imagePaths), std::cref(newImages), std::ref(nextImage),
+                                            landmarkDetector, std::cref(qualityThresholds), std::ref(chipQueue)));
     }
-  }
-
-  cout << "number of face descriptors " << faceDescriptors.size() << endl;
-  cout << "number of face labels " << faceLabels.size() << endl;
+    std::thread inferenceThread(computeDescriptors, std::ref(net), batchSize, std::ref(chipQueue), std::ref(descriptorQueue));
+
+    // writer stage: add face descriptors of every image to the gallery
+    FaceQualityReport totalQualityReport;
+    FaceJob job;
+    while (descriptorQueue.pop(job)) {
+      Mat faceDescriptors;
+      for (int j = 0; j < job.faceDescriptors.size(); j++) {
+        faceDescriptors.push_back(Mat(1, (int)job.faceDescriptors[j].size(), CV_32F, &job.faceDescriptors[j](0)));
+      }
+      addFaces(job.image, faceDescriptors);
+      FaceQualityReport qualityReport;
+      for (int j = 0; j < job.faceQualities.size(); j++) {
+        qualityReport.add(job.faceQualities[j]);
+        totalQualityReport.add(job.faceQualities[j]);
+      }
+      cout << "processed: " << imagePaths[job.image] << ", " << qualityReport.summary() << endl;
+    }
+    for (int k = 0; k < numDetectorThreads; k++) {
+      detectorThreads[k].join();
+    }
+    inferenceThread.join();
+    t = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
+    cout << "quality gate: " << totalQualityReport.summary() << endl;
+    cout << newImages.size() << " image(s) enrolled in " << t << " s with " << numDetectorThreads
+         << " detector thread(s) and batches of " << batchSize << " faces" << endl;
+  };
+
+  // enroll into descriptors.bin, reusing the faces of images enrolled by a
+  // previous run, and write the enrollment cache and the index next to it
+  std::vector<int> labels;
+  enrollImages("descriptors", FACE_MODEL_ID, DESCRIPTOR_TYPE, cacheKey, names, imagePaths, imagePersons, labels,
+               computeFaces);
 
-  // write label name map to disk
+  // write label name map to disk, with -1 integer label for un-enrolled persons
   const string labelNameFile = "label_name.txt";
   ofstream of;
   of.open (labelNameFile);
+  of << "unknown;-1\n";
   for (int m = 0; m < names.size(); m++) {
     of << names[m];
     of << ";";
@@ -284,31 +406,5 @@ int main() {
     of << "\n";
   }
   of.close();
-
-  // write face labels and descriptor to disk
-  // each row of file descriptors.csv has:
-  // 1st element as face label and
-  // rest 128 as descriptor values
-  const string descriptorsPath = "descriptors.csv";
-  ofstream ofs;
-  ofs.open(descriptorsPath);
-  // write descriptors
-  for (int m = 0; m < faceDescriptors.size(); m++) {
-    matrix<float,0,1> faceDescriptor = faceDescriptors[m];
-    std::vector<float> faceDescriptorVec(faceDescriptor.begin(), faceDescriptor.end());
-    // cout << "Label " << faceLabels[m] << endl;
-    ofs << faceLabels[m];
-    ofs << ";";
-    for (int n = 0; n < faceDescriptorVec.size(); n++) {
-      ofs << std::fixed << std::setprecision(8) << faceDescriptorVec[n];
-      // cout << n << " " << faceDescriptorVec[n] << endl;
-      if ( n == (faceDescriptorVec.size() - 1)) {
-        ofs << "\n";  // add ; if not the last element of descriptor
-      } else {
-        ofs << ";";  // add newline character if last element of descriptor
-      }
-    }
-  }
-  ofs.close();
   return 1;
 }
@@ -36,6 +36,11 @@
 #include <dlib/image_processing/frontal_face_detector.h>
 
 #include "faceBlendCommon.hpp"
+#include "faceGallery.hpp"
+#include "faceIndex.hpp"
+#include "descriptorStore.hpp"
+#include "enrollmentCache.hpp"
+#include "faceQuality.hpp"
 
 
 // dirent.h is pre-included with *nix like systems
@@ -62,6 +67,21 @@ using namespace cv;
 using namespace dlib;
 using namespace std;
 
+// model the descriptors are computed with, recorded in the descriptor store
+#define FACE_MODEL_ID "openface.nn4.small2.v1"
+
+// quality gate, faces failing any of these thresholds are skipped
+#define MIN_INTER_EYE_DISTANCE 20  // pixels
+#define MIN_SHARPNESS 40           // variance of the Laplacian
+#define MAX_YAW 35                 // degrees
+#define MAX_PITCH 25               // degrees
+#define MIN_BRIGHTNESS 40          // mean gray level
+#define MAX_BRIGHTNESS 215         // mean gray level
+
+// type of the stored descriptors: DESCRIPTOR_FLOAT32, or DESCRIPTOR_INT8 and
+// DESCRIPTOR_FLOAT16 for a 4 and 2 times smaller store, searched exhaustively
+#define DESCRIPTOR_TYPE DESCRIPTOR_FLOAT32
+
 
 // Reads files, folders and symbolic links in a directory
 void listdir(string dirName, std::vector<string>& folderNames, std::vector<string>& fileNames, std::vector<string>& symlinkNames) {
@@ -138,20 +158,18 @@ int main() {
   // as we are looking for sub-directories only
   listdir(faceDatasetFolder, subfolders, fileNames, symlinkNames);
 
-  // names: vector containing names of subfolders i.e. persons
-  // labels: integer labels assigned to persons
-  // labelNameMap: dict containing (integer label, person name) pairs
-  std::vector<string> names;
-  std::vector<int> labels;
-  std::map<int, string> labelNameMap;
-  // add -1 integer label for un-enrolled persons
-  names.push_back("unknown");
-  labels.push_back(-1);
+  // faces below these thresholds are not enrolled
+  FaceQualityThresholds qualityThresholds(MIN_INTER_EYE_DISTANCE, MIN_SHARPNESS, MAX_YAW, MAX_PITCH,
+                                          MIN_BRIGHTNESS, MAX_BRIGHTNESS);
+  // the cache is only valid for the model and quality thresholds it was written with
+  const string cacheKey = string(FACE_MODEL_ID) + " quality " + qualityThresholds.key();
 
+  // names: vector containing names of subfolders i.e. persons
   // imagePaths: vector containing imagePaths
-  // imageLabels: vector containing integer labels corresponding to imagePaths
+  // imagePersons: vector containing the index in names of the person in each image
+  std::vector<string> names;
   std::vector<string> imagePaths;
-  std::vector<int> imageLabels;
+  std::vector<int> imagePersons;
 
   // variable to hold any subfolders within person subFolders
   std::vector<string> folderNames;
@@ -161,13 +179,8 @@ int main() {
     // remove / or \\ from end of subFolder
     std::size_t found = personFolderName.find_last_of("/\\");
     string name = personFolderName.substr(found+1);
-    // assign integer label to person subFolder
-    int label = i;
-    // add person name and label to vectors
+    // add person name to vector
     names.push_back(name);
-    labels.push_back(label);
-    // add (integer label, person name) pair to map
-    labelNameMap[label] = name;
 
     // read imagePaths from each person subFolder
     // clear vectors
@@ -179,55 +192,66 @@ int main() {
     // read all files present in subFolder
     listdir(subfolders[i], folderNames, fileNames, symlinkNames);
     // filter only jpg files
-    filterFiles(subfolders[i], fileNames, imagePaths, "jpg", imageLabels, i);
+    filterFiles(subfolders[i], fileNames, imagePaths, "jpg", imagePersons, i);
     }
 
-  // process training data
-  // We will store face descriptors in vector faceDescriptors
-  // and their corresponding labels in vector faceLabels
-  std::vector<Mat> faceDescriptors;
-  // std::vector<cv_image<bgr_pixel> > imagesFaceTrain;
-  std::vector<int> faceLabels;
-  Mat faceDescriptor;
-  // iterate over images
-  for (int i = 0; i < imagePaths.size(); i++) {
-    string imagePath = imagePaths[i];
-    int imageLabel = imageLabels[i];
-
-    cout << "processing: " << imagePath << endl;
-
-    // read image using OpenCV
-    Mat im = cv::imread(imagePath);
-
-    cv_image<bgr_pixel> imDlib(im);
-    std::vector<dlib::rectangle> faceRects = faceDetector(imDlib);
-    cout << faceRects.size() << " Face(s) Found" << endl;
-    // Now process each face we found
-    for (int j = 0; j < faceRects.size(); j++) {
-      Mat alignedFace;
-      alignFace(im, alignedFace, faceRects[j], landmarkDetector, cv::Size(96, 96));
-
-      cv::Mat blob = dnn::blobFromImage(alignedFace, 1.0/255, cv::Size(96, 96), Scalar(0,0,0), false, false);
-      recModel.setInput(blob);
-      faceDescriptor = recModel.forward();
-
-      // add face descriptor and label for this face to
-      // vectors faceDescriptors and faceLabels
-      faceDescriptors.push_back(faceDescriptor.clone());
-
-      // add label for this face to vector containing labels corresponding to
-      // vector containing face descriptors
-      faceLabels.push_back(imageLabel);
-
+  // computes the descriptors of the images that are not enrolled yet
+  ComputeFacesFunction computeFaces = [&](const std::vector<int>& newImages, const AddFacesFunction& addFaces) {
+    FaceQualityReport totalQualityReport;
+
+    Mat faceDescriptor;
+    // iterate over new images
+    for (int m = 0; m < newImages.size(); m++) {
+      string imagePath = imagePaths[newImages[m]];
+
+      cout << "processing: " << imagePath << endl;
+
+      // read image using OpenCV
+      Mat im = cv::imread(imagePath);
+
+      cv_image<bgr_pixel> imDlib(im);
+      std::vector<dlib::rectangle> faceRects = faceDetector(imDlib);
+      cout << faceRects.size() << " Face(s) Found" << endl;
+      FaceQualityReport qualityReport;
+      Mat faceDescriptors;
+      // Now process each face we found
+      for (int j = 0; j < faceRects.size(); j++) {
+        // small, blurred, turned or badly lit faces would add unreliable descriptors
+        full_object_detection landmarks = landmarkDetector(imDlib, faceRects[j]);
+        FaceQuality quality = assessFaceQuality(im, landmarks, qualityThresholds);
+        qualityReport.add(quality);
+        totalQualityReport.add(quality);
+        if (!quality.acceptable()) {
+          continue;
+        }
+
+        Mat alignedFace;
+        alignFace(im, alignedFace, faceRects[j], landmarkDetector, cv::Size(96, 96));
+
+        cv::Mat blob = dnn::blobFromImage(alignedFace, 1.0/255, cv::Size(96, 96), Scalar(0,0,0), false, false);
+        recModel.setInput(blob);
+        faceDescriptor = recModel.forward();
+
+        // add face descriptor of this face
+        faceDescriptors.push_back(faceDescriptor.reshape(1, 1));
+      }
+      cout << qualityReport.summary() << endl;
+      addFaces(newImages[m], faceDescriptors);
     }
-  }
-  cout << "number of face descriptors " << faceDescriptors.size() << endl;
-  cout << "number of face labels " << faceLabels.size() << endl;
+    cout << "quality gate: " << totalQualityReport.summary() << endl;
+  };
+
+  // enroll into descriptors_openface.bin, reusing the faces of images enrolled
+  // by a previous run, and write the enrollment cache and the index next to it
+  std::vector<int> labels;
+  enrollImages("descriptors_openface", FACE_MODEL_ID, DESCRIPTOR_TYPE, cacheKey, names, imagePaths, imagePersons, labels,
+               computeFaces);
 
-  // write label name map to disk
+  // write label name map to disk, with -1 integer label for un-enrolled persons
   const string labelNameFile = "label_name_openface.txt";
   ofstream of;
   of.open (labelNameFile);
+  of << "unknown;-1\n";
   for (int m = 0; m < names.size(); m++) {
     of << names[m];
     of << ";";
@@ -235,29 +259,5 @@ int main() {
     of << "\n";
   }
   of.close();
-
-  // write face labels and descriptor to disk
-  // each row of file descriptors_openface.csv has:
-  // 1st element as face label and
-  // rest 128 as descriptor values
-  const string descriptorsPath = "descriptors_openface.csv";
-  ofstream ofs;
-  ofs.open(descriptorsPath);
-  // write descriptors
-  for (int m = 0; m < faceDescriptors.size(); m++) {
-    Mat faceDescriptorVec = faceDescriptors[m];
-    ofs << faceLabels[m];
-    ofs << ";";
-    for (int n = 0; n < faceDescriptorVec.cols; n++) {
-      ofs << std::fixed << std::setprecision(8) << faceDescriptorVec.at<float>(n);
-      // cout << n << " " << faceDescriptorVec.at<float>(n) << endl;
-      if ( n == (faceDescriptorVec.cols - 1)) {
-        ofs << "\n";  // add ; if not the last element of descriptor
-      } else {
-        ofs << ";";  // add newline character if last element of descriptor
-      }
-    }
-  }
-  ofs.close();
   return 1;
 }
@@ -0,0 +1,366 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_enrollmentCache_HPP_
+#define BIGVISION_enrollmentCache_HPP_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "faceGallery.hpp"
+#include "faceIndex.hpp"
+#include "descriptorStore.hpp"
+
+// Content hash of a file (64 bit FNV-1a)
+inline uint64_t hashFile(const std::string& path) {
+  std::ifstream ifs(path.c_str(), std::ios::binary);
+  uint64_t hash = 14695981039346656037ULL;
+  char buffer[1 << 16];
+  while (ifs) {
+    ifs.read(buffer, sizeof(buffer));
+    std::streamsize numBytes = ifs.gcount();
+    for (std::streamsize i = 0; i < numBytes; i++) {
+      hash ^= (unsigned char)buffer[i];
+      hash *= 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+// what the cache knows about one enrolled image
+struct EnrollmentCacheEntry {
+  uint64_t hash;   // hash of the image file content
+  int64_t size;    // file size and modification time, used to skip
+  int64_t mtime;   // hashing files that have not been touched
+  int firstRow;    // first row of the image's faces in the descriptor store
+  int numFaces;    // number of faces enrolled from the image
+};
+
+// Enrollment cache, written next to the descriptor store.
+// Maps every enrolled image to the rows its faces occupy in the store, so
+// that the enroll programs only run detection, landmarks and the network on
+// images that were added or changed since the last run.
+// Images are identified by the hash of their content. Size and modification
+// time are only used to avoid reading unchanged files again, so a renamed,
+// moved or copied image is still found in the cache.
+//
+// File format: a "key;storeCount" line followed by one
+// "hash;size;mtime;firstRow;numFaces;path" line per image.
+class EnrollmentCache {
+public:
+  EnrollmentCache() : numStoreRows(0) {
+  }
+
+  // Read a cache written with the given key, which identifies the model and
+  // settings the faces were enrolled with.
+  // Returns false, leaving the cache empty, if there is no such cache.
+  bool load(const std::string& filename, const std::string& key) {
+    clear();
+    std::ifstream ifs(filename.c_str());
+    std::string line, cachedKey;
+    if (!getline(ifs, line)) {
+      return false;
+    }
+    std::stringstream headerss(line);
+    getline(headerss, cachedKey, ';');
+    headerss >> numStoreRows;
+    if (cachedKey != key) {
+      clear();
+      return false;
+    }
+
+    while (getline(ifs, line)) {
+      std::stringstream liness(line);
+      EnrollmentCacheEntry entry;
+      char separator;
+      liness >> entry.hash >> separator >> entry.size >> separator >> entry.mtime >> separator
+             >> entry.firstRow >> separator >> entry.numFaces >> separator;
+      std::string path;
+      getline(liness, path);
+      if (!liness.fail() && !path.empty()) {
+        add(path, entry);
+      }
+    }
+    return true;
+  }
+
+  void save(const std::string& filename, const std::string& key) const {
+    std::ofstream ofs(filename.c_str());
+    if (!ofs) {
+      CV_Error(cv::Error::StsError, "Could not write enrollment cache " + filename);
+    }
+    ofs << key << ";" << numStoreRows << "\n";
+    for (std::map<std::string, EnrollmentCacheEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+      const EnrollmentCacheEntry& entry = it->second;
+      ofs << entry.hash << ";" << entry.size << ";" << entry.mtime << ";"
+          << entry.firstRow << ";" << entry.numFaces << ";" << it->first << "\n";
+    }
+  }
+
+  void clear() {
+    entries.clear();
+    entriesByHash.clear();
+    numStoreRows = 0;
+  }
+
+  int size() const {
+    return (int)entries.size();
+  }
+
+  bool contains(const std::string& path) const {
+    return entries.find(path) != entries.end();
+  }
+
+  // number of rows of the descriptor store the cache was written for
+  int storeCount() const {
+    return numStoreRows;
+  }
+
+  void setStoreCount(int count) {
+    numStoreRows = count;
+  }
+
+  // Look up an image.
+  // Returns true if its content was enrolled before, with entry giving the
+  // rows of its faces. Otherwise entry holds the hash, size and modification
+  // time of the image and the caller fills in the rows once it is enrolled.
+  bool find(const std::string& path, EnrollmentCacheEntry& entry) const {
+    memset(&entry, 0, sizeof(entry));
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      return false;
+    }
+    std::map<std::string, EnrollmentCacheEntry>::const_iterator it = entries.find(path);
+    if (it != entries.end() && it->second.size == (int64_t)st.st_size && it->second.mtime == (int64_t)st.st_mtime) {
+      entry = it->second;
+      return true;
+    }
+
+    entry.hash = hashFile(path);
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    std::map<uint64_t, EnrollmentCacheEntry>::const_iterator byHash = entriesByHash.find(entry.hash);
+    if (byHash == entriesByHash.end()) {
+      return false;
+    }
+    entry.firstRow = byHash->second.firstRow;
+    entry.numFaces = byHash->second.numFaces;
+    return true;
+  }
+
+  void add(const std::string& path, const EnrollmentCacheEntry& entry) {
+    entries[path] = entry;
+    entriesByHash[entry.hash] = entry;
+  }
+
+private:
+  std::map<std::string, EnrollmentCacheEntry> entries;
+  std::map<uint64_t, EnrollmentCacheEntry> entriesByHash;
+  int numStoreRows;
+};
+
+// Called by computeFaces for every image it enrolled, with the descriptors of
+// the image's faces, one CV_32F row per face (none if no face was enrolled).
+typedef std::function<void(int image, const cv::Mat& descriptors)> AddFacesFunction;
+
+// Computes the descriptors of the faces of the given images, indexes into
+// imagePaths, and passes them to addFaces, image by image in any order.
+typedef std::function<void(const std::vector<int>& images, const AddFacesFunction& addFaces)> ComputeFacesFunction;
+
+// Enroll the images of a face dataset, running the model only on the images
+// added or changed since the last run. Writes, next to each other,
+//   basePath.bin    descriptor store of the given DescriptorType, read by the
+//                   test programs
+//   basePath.cache  enrollment cache
+//   basePath.hnsw   nearest neighbour index over a float32 store. int8 and
+//                   float16 stores are searched exhaustively, without one.
+// Faces of images enrolled before are taken from the previous store when it
+// holds descriptors of model modelId and type dtype, and the cache was written
+// with cacheKey, which identifies the settings besides model and descriptor
+// type that decide which faces are enrolled, such as quality thresholds.
+// A store of another type is not reused, its int8 or float16 descriptors
+// would only decode to approximations of the float ones.
+// names: persons, imagePersons[i]: index in names of the person in imagePaths[i]
+// labels: set to the integer label of every person. Persons enrolled before
+// keep their label, new persons get the next free one.
+// The store gets the names preceded by "unknown" with label -1.
+inline void enrollImages(const std::string& basePath, const std::string& modelId, int dtype, const std::string& cacheKey,
+                         const std::vector<std::string>& names, const std::vector<std::string>& imagePaths,
+                         const std::vector<int>& imagePersons, std::vector<int>& labels,
+                         const ComputeFacesFunction& computeFaces) {
+  CV_Assert(imagePaths.size() == imagePersons.size());
+  const std::string descriptorsPath = basePath + ".bin";
+  const std::string cachePath = basePath + ".cache";
+  const std::string faceIndexPath = basePath + ".hnsw";
+
+  // The previous store and the cache have to be of the same run, and the
+  // store of this model and type, otherwise everything is enrolled again.
+  DescriptorStore previousStore;
+  EnrollmentCache cache;
+  bool usePrevious = false;
+  std::map<std::string, int> previousLabels;
+  if (cache.load(cachePath, cacheKey) && std::ifstream(descriptorsPath.c_str()).good()) {
+    try {
+      previousStore.open(descriptorsPath, modelId);
+      usePrevious = previousStore.count() == cache.storeCount() && previousStore.dtype() == dtype;
+    } catch (const cv::Exception& e) {
+      // a corrupt store, or one of another model, is enrolled again
+      std::cout << "Ignoring previous descriptor store: " << e.what() << std::endl;
+      usePrevious = false;
+    }
+    if (usePrevious) {
+      std::vector<std::string> previousNames;
+      std::vector<int> previousLabelValues;
+      std::map<int, std::string> previousLabelNameMap;
+      previousStore.readNames(previousNames, previousLabelValues, previousLabelNameMap);
+      for (size_t m = 0; m < previousNames.size(); m++) {
+        if (previousLabelValues[m] >= 0) {
+          previousLabels[previousNames[m]] = previousLabelValues[m];
+        }
+      }
+    } else {
+      previousStore.close();
+    }
+  }
+  if (!usePrevious) {
+    cache.clear();
+  }
+
+  int nextLabel = 0;
+  for (std::map<std::string, int>::iterator it = previousLabels.begin(); it != previousLabels.end(); ++it) {
+    nextLabel = std::max(nextLabel, it->second + 1);
+  }
+  labels.resize(names.size());
+  for (size_t p = 0; p < names.size(); p++) {
+    std::map<std::string, int>::iterator previous = previousLabels.find(names[p]);
+    labels[p] = previous != previousLabels.end() ? previous->second : nextLabel++;
+  }
+
+  // Look the images up in the cache. Unchanged images are recognized by
+  // size and modification time, anything else by the hash of its content.
+  std::vector<EnrollmentCacheEntry> imageEntries(imagePaths.size());
+  // (first row in the previous store, image) of images enrolled before
+  std::vector<std::pair<int, int> > cachedImages;
+  // images that are new or have changed
+  std::vector<int> newImages;
+  int numCachedPaths = 0;
+  for (int i = 0; i < (int)imagePaths.size(); i++) {
+    if (usePrevious && cache.find(imagePaths[i], imageEntries[i])) {
+      cachedImages.push_back(std::make_pair(imageEntries[i].firstRow, i));
+      numCachedPaths += cache.contains(imagePaths[i]) ? 1 : 0;
+    } else {
+      newImages.push_back(i);
+    }
+  }
+  std::cout << cachedImages.size() << " image(s) already enrolled, " << newImages.size() << " to enroll, "
+            << cache.size() - numCachedPaths << " removed or changed" << std::endl;
+
+  // Copy the faces of images enrolled before from the previous store, in
+  // the order they were stored, then enroll the new images after them.
+  // Faces of deleted images are left out.
+  const FaceGallery previousGallery = usePrevious ? previousStore.gallery() : FaceGallery();
+  FaceGallery gallery;
+  gallery.reserve(previousGallery.size() + (int)newImages.size());
+  EnrollmentCache updatedCache;
+  std::sort(cachedImages.begin(), cachedImages.end());
+  // if the previous rows are all kept in place, the previous
+  // index is still valid and only the new faces are inserted
+  bool previousRowsKept = usePrevious;
+  int nextPreviousRow = 0;
+  for (size_t m = 0; m < cachedImages.size(); m++) {
+    int i = cachedImages[m].second;
+    EnrollmentCacheEntry entry = imageEntries[i];
+    if (entry.numFaces > 0) {
+      previousRowsKept = previousRowsKept && entry.firstRow == nextPreviousRow;
+      nextPreviousRow = entry.firstRow + entry.numFaces;
+    }
+    int previousFirstRow = entry.firstRow;
+    entry.firstRow = gallery.size();
+    for (int j = 0; j < entry.numFaces; j++) {
+      // labels come from the folder, the image may have been moved
+      gallery.add(previousGallery.getDescriptors().ptr<float>(previousFirstRow + j), labels[imagePersons[i]]);
+    }
+    updatedCache.add(imagePaths[i], entry);
+  }
+  previousRowsKept = previousRowsKept && nextPreviousRow == previousGallery.size();
+
+  computeFaces(newImages, [&](int image, const cv::Mat& descriptors) {
+    CV_Assert(descriptors.empty() || (descriptors.type() == CV_32F && descriptors.cols == gallery.dimension()));
+    EnrollmentCacheEntry& entry = imageEntries[image];
+    entry.firstRow = gallery.size();
+    for (int j = 0; j < descriptors.rows; j++) {
+      gallery.add(descriptors.ptr<float>(j), labels[imagePersons[image]]);
+    }
+    entry.numFaces = gallery.size() - entry.firstRow;
+    updatedCache.add(imagePaths[image], entry);
+  });
+  std::cout << "number of face descriptors " << gallery.size() << std::endl;
+
+  // extend the previous index with the new faces if possible, else build it.
+  // The index is over float32 descriptors, a decoded int8 or float16 store
+  // does not match the checksum it was built on.
+  HnswFaceIndex faceIndex;
+  bool writeIndex = dtype == DESCRIPTOR_FLOAT32;
+  if (writeIndex) {
+    if (previousRowsKept && previousStore.dtype() == DESCRIPTOR_FLOAT32 &&
+        faceIndex.load(faceIndexPath, previousGallery, previousStore.checksum())) {
+      faceIndex.extend(gallery);
+      std::cout << "index extended with " << gallery.size() - previousGallery.size() << " face(s)" << std::endl;
+    } else {
+      faceIndex.build(gallery);
+    }
+  }
+
+  // every face is in the gallery now, so the previous store can be overwritten
+  previousStore.close();
+
+  // write face labels, descriptors and the label name map to a binary
+  // descriptor store, which the test programs memory map at startup
+  std::vector<std::string> storeNames(1, "unknown");
+  std::vector<int> storeLabels(1, -1);
+  storeNames.insert(storeNames.end(), names.begin(), names.end());
+  storeLabels.insert(storeLabels.end(), labels.begin(), labels.end());
+  writeDescriptorStore(descriptorsPath, modelId, gallery, storeNames, storeLabels, dtype);
+  updatedCache.setStoreCount(gallery.size());
+  updatedCache.save(cachePath, cacheKey);
+
+  // the nearest neighbour index is built here, offline,
+  // so that the test programs only have to load it
+  if (writeIndex) {
+    faceIndex.save(faceIndexPath);
+    std::cout << "index written to " << faceIndexPath << std::endl;
+  } else {
+    // an index left by a float32 run does not belong to this store
+    remove(faceIndexPath.c_str());
+  }
+}
+
+#endif // BIGVISION_enrollmentCache_HPP_
@@ -0,0 +1,192 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_faceGallery_HPP_
+#define BIGVISION_faceGallery_HPP_
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+// number of gallery rows compared against the queries in one gemm call
+#define GALLERY_BLOCK_SIZE 4096
+
+// one match of a query face descriptor in the gallery
+struct FaceMatch {
+  int index;       // row of the matched descriptor in the gallery
+  int label;       // integer label of the matched descriptor
+  float distance;  // Euclidean distance between query and matched descriptor
+};
+
+// Gallery of enrolled face descriptors.
+// All descriptors live in one row-major CV_32F matrix (one descriptor per row),
+// so the data is contiguous and aligned by OpenCV's allocator. Squared norms
+// are computed once at enrollment, which turns the Euclidean distance into
+// ||q||^2 + ||g||^2 - 2 q.g and lets a whole block of gallery rows be compared
+// against many queries with a single (SIMD optimized) cv::gemm call.
+class FaceGallery {
+public:
+  FaceGallery(int dimension = 128)
+      : dim(dimension), descriptors(0, dimension, CV_32F), norms(0, 1, CV_32F), labels(0, 1, CV_32S) {
+  }
+
+  // Gallery over descriptors, squared norms and labels stored elsewhere,
+  // e.g. in a memory mapped descriptor store. Nothing is copied, so that
+  // memory has to outlive the gallery. Adding to such a gallery copies it.
+  FaceGallery(int count, int dimension, const float* descriptorData, const float* normData, const int* labelData)
+      : dim(dimension),
+        descriptors(count, dimension, CV_32F, const_cast<float*>(descriptorData)),
+        norms(count, 1, CV_32F, const_cast<float*>(normData)),
+        labels(count, 1, CV_32S, const_cast<int*>(labelData)) {
+  }
+
+  int dimension() const {
+    return dim;
+  }
+
+  int size() const {
+    return descriptors.rows;
+  }
+
+  bool empty() const {
+    return descriptors.rows == 0;
+  }
+
+  void reserve(int numDescriptors) {
+    descriptors.reserve(numDescriptors);
+    norms.reserve(numDescriptors);
+    labels.reserve(numDescriptors);
+  }
+
+  // add a descriptor of dimension() floats with its label
+  void add(const float* descriptor, int label) {
+    cv::Mat row(1, dim, CV_32F, const_cast<float*>(descriptor));
+    descriptors.push_back(row);
+    norms.push_back((float)row.dot(row));
+    labels.push_back(label);
+  }
+
+  // add a descriptor stored as a 1xD or Dx1 CV_32F matrix
+  void add(const cv::Mat& descriptor, int label) {
+    CV_Assert(descriptor.type() == CV_32F && (int)descriptor.total() == dim);
+    cv::Mat continuous = descriptor.isContinuous() ? descriptor : descriptor.clone();
+    add(continuous.ptr<float>(), label);
+  }
+
+  // size() x dimension() CV_32F
+  const cv::Mat& getDescriptors() const {
+    return descriptors;
+  }
+
+  // size() x 1 CV_32F squared norms of the descriptors
+  const cv::Mat& getNorms() const {
+    return norms;
+  }
+
+  // size() x 1 CV_32S labels of the descriptors
+  const cv::Mat& getLabels() const {
+    return labels;
+  }
+
+  int getLabel(int index) const {
+    return labels.at<int>(index);
+  }
+
+  // 64-bit FNV-1a hash of the descriptor values, which identifies the
+  // descriptors a search structure was built on
+  uint64_t checksum() const {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < descriptors.rows; i++) {
+      const unsigned char* bytes = descriptors.ptr<unsigned char>(i);
+      for (size_t j = 0; j < dim * sizeof(float); j++) {
+        hash = (hash ^ bytes[j]) * 1099511628211ULL;
+      }
+    }
+    return hash;
+  }
+
+  // Find the k nearest gallery descriptors of every query.
+  // queries: one descriptor per row (N x dimension(), CV_32F)
+  // matches: for each query, up to k matches sorted by increasing distance
+  void search(const cv::Mat& queries, int k, std::vector<std::vector<FaceMatch> >& matches) const {
+    CV_Assert(queries.type() == CV_32F && queries.cols == dim);
+    int numQueries = queries.rows;
+    matches.assign(numQueries, std::vector<FaceMatch>());
+    if (numQueries == 0 || empty() || k <= 0) {
+      return;
+    }
+
+    std::vector<float> queryNorms(numQueries);
+    for (int q = 0; q < numQueries; q++) {
+      queryNorms[q] = (float)queries.row(q).dot(queries.row(q));
+    }
+
+    // one max-heap of (squared distance, index) per query holding its k best matches
+    typedef std::pair<float, int> Candidate;
+    std::vector<std::priority_queue<Candidate> > best(numQueries);
+
+    const float* normData = norms.ptr<float>();
+    cv::Mat dots;
+    for (int start = 0; start < descriptors.rows; start += GALLERY_BLOCK_SIZE) {
+      int end = std::min(start + GALLERY_BLOCK_SIZE, descriptors.rows);
+      // dots = -2 * queries * block^T
+      cv::gemm(queries, descriptors.rowRange(start, end), -2.0, cv::Mat(), 0.0, dots, cv::GEMM_2_T);
+
+      for (int q = 0; q < numQueries; q++) {
+        const float* dotRow = dots.ptr<float>(q);
+        std::priority_queue<Candidate>& heap = best[q];
+        for (int j = 0; j < end - start; j++) {
+          float distance2 = queryNorms[q] + normData[start + j] + dotRow[j];
+          if ((int)heap.size() < k) {
+            heap.push(Candidate(distance2, start + j));
+          } else if (distance2 < heap.top().first) {
+            heap.pop();
+            heap.push(Candidate(distance2, start + j));
+          }
+        }
+      }
+    }
+
+    for (int q = 0; q < numQueries; q++) {
+      std::vector<FaceMatch>& result = matches[q];
+      result.resize(best[q].size());
+      // heap pops the largest distance first, so fill from the back
+      for (int r = (int)result.size() - 1; r >= 0; r--) {
+        const Candidate& candidate = best[q].top();
+        result[r].index = candidate.second;
+        result[r].label = getLabel(candidate.second);
+        // rounding can make the expanded form slightly negative
+        result[r].distance = sqrt(std::max(candidate.first, 0.0f));
+        best[q].pop();
+      }
+    }
+  }
+
+private:
+  int dim;
+  cv::Mat descriptors;
+  cv::Mat norms;
+  cv::Mat labels;
+};
+
+#endif // BIGVISION_faceGallery_HPP_
@@ -0,0 +1,454 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_faceIndex_HPP_
+#define BIGVISION_faceIndex_HPP_
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/hal/hal.hpp>
+
+#include "faceGallery.hpp"
+
+// Nearest neighbour index over the descriptors of a FaceGallery.
+// The gallery keeps the descriptors, an index only adds a search structure
+// on top of them, so the gallery has to outlive the index built on it.
+class FaceIndex {
+public:
+  virtual ~FaceIndex() {
+  }
+
+  virtual std::string name() const = 0;
+
+  // (re)build the index over all descriptors of the gallery
+  virtual void build(const FaceGallery& gallery) = 0;
+
+  // same contract as FaceGallery::search
+  virtual void search(const cv::Mat& queries, int k, std::vector<std::vector<FaceMatch> >& matches) const = 0;
+};
+
+// Brute force search over the whole gallery. Gives the exact neighbours
+// and is the reference the approximate indexes are measured against.
+class ExactFaceIndex : public FaceIndex {
+public:
+  ExactFaceIndex() : gallery(NULL) {
+  }
+
+  std::string name() const {
+    return "exact";
+  }
+
+  void build(const FaceGallery& gallery) {
+    this->gallery = &gallery;
+  }
+
+  void search(const cv::Mat& queries, int k, std::vector<std::vector<FaceMatch> >& matches) const {
+    CV_Assert(gallery != NULL);
+    gallery->search(queries, k, matches);
+  }
+
+private:
+  const FaceGallery* gallery;
+};
+
+// Hierarchical Navigable Small World graph (Malkov and Yashunin, 2016).
+// Every descriptor is a node linked to its M closest neighbours on layer 0
+// and, with exponentially decreasing probability, on higher layers as well.
+// A query descends greedily from the sparse top layer and then explores
+// layer 0 keeping the efSearch closest nodes found so far, which visits a
+// few thousand nodes instead of the whole gallery.
+// Higher efSearch gives better recall at the cost of speed.
+// search() reuses an internal visited list, so it is not thread safe.
+class HnswFaceIndex : public FaceIndex {
+public:
+  HnswFaceIndex(int M = 16, int efConstruction = 200, int efSearch = 64)
+      : M(M), efConstruction(efConstruction), efSearch(efSearch),
+        gallery(NULL), entryPoint(-1), maxLevel(-1), visitMark(0) {
+  }
+
+  std::string name() const {
+    return "hnsw";
+  }
+
+  void setEfSearch(int ef) {
+    efSearch = ef;
+  }
+
+  int getEfSearch() const {
+    return efSearch;
+  }
+
+  void build(const FaceGallery& gallery) {
+    links.clear();
+    entryPoint = -1;
+    maxLevel = -1;
+    extend(gallery);
+  }
+
+  // Insert the descriptors added at the end of the gallery since the graph
+  // was built or loaded. The first rows of the gallery have to be the
+  // descriptors the graph was built on.
+  void extend(const FaceGallery& gallery) {
+    CV_Assert(gallery.size() >= (int)links.size());
+    this->gallery = &gallery;
+    int firstNode = (int)links.size();
+    int numNodes = gallery.size();
+    links.resize(numNodes);
+    visited.assign(numNodes, 0);
+    visitMark = 0;
+
+    // level of a node is drawn from an exponential distribution
+    double levelMultiplier = 1.0 / log((double)M);
+    cv::RNG rng(0x48534e57 + firstNode);
+    for (int i = firstNode; i < numNodes; i++) {
+      double u = std::max(rng.uniform(0.0, 1.0), 1e-12);
+      insert(i, (int)(-log(u) * levelMultiplier));
+    }
+  }
+
+  void search(const cv::Mat& queries, int k, std::vector<std::vector<FaceMatch> >& matches) const {
+    CV_Assert(gallery != NULL);
+    CV_Assert(queries.type() == CV_32F && queries.cols == gallery->dimension());
+    matches.assign(queries.rows, std::vector<FaceMatch>());
+    if (entryPoint < 0 || k <= 0) {
+      return;
+    }
+
+    std::vector<Candidate> candidates;
+    for (int q = 0; q < queries.rows; q++) {
+      const float* query = queries.ptr<float>(q);
+      int current = entryPoint;
+      float currentDistance = distance(query, current);
+      greedySearch(query, 0, current, currentDistance);
+      searchLayer(query, current, currentDistance, std::max(efSearch, k), 0, candidates);
+
+      int numMatches = std::min(k, (int)candidates.size());
+      matches[q].resize(numMatches);
+      for (int i = 0; i < numMatches; i++) {
+        matches[q][i].index = candidates[i].second;
+        matches[q][i].label = gallery->getLabel(candidates[i].second);
+        matches[q][i].distance = sqrt(candidates[i].first);
+      }
+    }
+  }
+
+  // Write the graph to disk, with a checksum of the gallery it was built on.
+  // Descriptors are not written, they are stored with the gallery.
+  void save(const std::string& filename) const {
+    CV_Assert(gallery != NULL);
+    std::ofstream ofs(filename.c_str(), std::ios::binary);
+    if (!ofs) {
+      CV_Error(cv::Error::StsError, "Could not write index file " + filename);
+    }
+    int numNodes = (int)links.size();
+    int header[6] = {HNSW_FILE_MAGIC, HNSW_FILE_VERSION, gallery->dimension(), numNodes, M, efConstruction};
+    uint64_t galleryChecksum = gallery->checksum();
+    ofs.write((const char*)header, sizeof(header));
+    ofs.write((const char*)&galleryChecksum, sizeof(galleryChecksum));
+    ofs.write((const char*)&entryPoint, sizeof(entryPoint));
+    ofs.write((const char*)&maxLevel, sizeof(maxLevel));
+    for (int i = 0; i < numNodes; i++) {
+      int numLevels = (int)links[i].size();
+      ofs.write((const char*)&numLevels, sizeof(numLevels));
+      for (int level = 0; level < numLevels; level++) {
+        int numNeighbors = (int)links[i][level].size();
+        ofs.write((const char*)&numNeighbors, sizeof(numNeighbors));
+        ofs.write((const char*)links[i][level].data(), numNeighbors * sizeof(int));
+      }
+    }
+  }
+
+  // Read a graph written by save() for the same gallery. galleryChecksum is
+  // gallery.checksum(), or the checksum recorded in the descriptor store the
+  // gallery was mapped from, which saves hashing the whole gallery.
+  // Returns false if the file is missing, truncated or corrupt, or was built
+  // on other descriptors.
+  bool load(const std::string& filename, const FaceGallery& gallery, uint64_t galleryChecksum) {
+    std::ifstream ifs(filename.c_str(), std::ios::binary);
+    if (!ifs) {
+      return false;
+    }
+    int header[6];
+    uint64_t savedChecksum = 0;
+    ifs.read((char*)header, sizeof(header));
+    ifs.read((char*)&savedChecksum, sizeof(savedChecksum));
+    if (!ifs || header[0] != HNSW_FILE_MAGIC || header[1] != HNSW_FILE_VERSION ||
+        header[2] != gallery.dimension() || header[3] != gallery.size() || savedChecksum != galleryChecksum ||
+        header[4] <= 0 || header[4] > HNSW_MAX_M || header[5] <= 0) {
+      return false;
+    }
+    this->gallery = &gallery;
+    M = header[4];
+    efConstruction = header[5];
+    if (!readGraph(ifs, header[3])) {
+      links.clear();
+      entryPoint = -1;
+      maxLevel = -1;
+      this->gallery = NULL;
+      return false;
+    }
+    visited.assign(header[3], 0);
+    visitMark = 0;
+    return true;
+  }
+
+private:
+  enum { HNSW_FILE_MAGIC = 0x57534e48, HNSW_FILE_VERSION = 2 };
+  // bounds a valid file stays within, the levels drawn in extend() stay far below
+  enum { HNSW_MAX_M = 1024, HNSW_MAX_LEVEL = 64 };
+
+  // (squared distance, node)
+  typedef std::pair<float, int> Candidate;
+
+  int M;
+  int efConstruction;
+  int efSearch;
+  const FaceGallery* gallery;
+  // links[node][level] = neighbours of node on that level
+  std::vector<std::vector<std::vector<int> > > links;
+  int entryPoint;
+  int maxLevel;
+  // visited[node] == visitMark if node was reached by the current search
+  mutable std::vector<unsigned int> visited;
+  mutable unsigned int visitMark;
+
+  // Read entry point, levels and links of numNodes nodes, checking every
+  // count and node id so that a corrupt file cannot index out of range
+  bool readGraph(std::ifstream& ifs, int numNodes) {
+    ifs.read((char*)&entryPoint, sizeof(entryPoint));
+    ifs.read((char*)&maxLevel, sizeof(maxLevel));
+    if (!ifs || maxLevel < -1 || maxLevel > HNSW_MAX_LEVEL) {
+      return false;
+    }
+    if (numNodes == 0 ? (entryPoint != -1 || maxLevel != -1) : (entryPoint < 0 || entryPoint >= numNodes)) {
+      return false;
+    }
+    links.assign(numNodes, std::vector<std::vector<int> >());
+    for (int i = 0; i < numNodes; i++) {
+      int numLevels = 0;
+      ifs.read((char*)&numLevels, sizeof(numLevels));
+      if (!ifs || numLevels < 1 || numLevels > maxLevel + 1) {
+        return false;
+      }
+      links[i].resize(numLevels);
+      for (int level = 0; level < numLevels; level++) {
+        int numNeighbors = 0;
+        ifs.read((char*)&numNeighbors, sizeof(numNeighbors));
+        if (!ifs || numNeighbors < 0 || numNeighbors > (level == 0 ? 2 * M : M)) {
+          return false;
+        }
+        links[i][level].resize(numNeighbors);
+        ifs.read((char*)links[i][level].data(), numNeighbors * sizeof(int));
+        if (!ifs) {
+          return false;
+        }
+      }
+    }
+    if (numNodes > 0 && (int)links[entryPoint].size() != maxLevel + 1) {
+      return false;
+    }
+    // searches follow links on their level, so a neighbour has to be on it too
+    for (int i = 0; i < numNodes; i++) {
+      for (size_t level = 0; level < links[i].size(); level++) {
+        const std::vector<int>& neighbors = links[i][level];
+        for (size_t j = 0; j < neighbors.size(); j++) {
+          if (neighbors[j] < 0 || neighbors[j] >= numNodes || links[neighbors[j]].size() <= level) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  float distance(const float* query, int node) const {
+    return cv::hal::normL2Sqr_(query, gallery->getDescriptors().ptr<float>(node), gallery->dimension());
+  }
+
+  float distance(int nodeA, int nodeB) const {
+    return distance(gallery->getDescriptors().ptr<float>(nodeA), nodeB);
+  }
+
+  void nextVisitMark() const {
+    visitMark++;
+    if (visitMark == 0) {
+      std::fill(visited.begin(), visited.end(), 0);
+      visitMark = 1;
+    }
+  }
+
+  // walk to the closest node on every level above targetLevel
+  void greedySearch(const float* query, int targetLevel, int& current, float& currentDistance) const {
+    for (int level = maxLevel; level > targetLevel; level--) {
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        const std::vector<int>& neighbors = links[current][level];
+        for (size_t i = 0; i < neighbors.size(); i++) {
+          float d = distance(query, neighbors[i]);
+          if (d < currentDistance) {
+            currentDistance = d;
+            current = neighbors[i];
+            changed = true;
+          }
+        }
+      }
+    }
+  }
+
+  // ef closest nodes to query on a level, sorted by increasing distance
+  void searchLayer(const float* query, int entry, float entryDistance, int ef, int level,
+                   std::vector<Candidate>& result) const {
+    nextVisitMark();
+    // closest unexpanded node first
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > candidates;
+    // farthest of the ef nodes found so far first
+    std::priority_queue<Candidate> nearest;
+
+    candidates.push(Candidate(entryDistance, entry));
+    nearest.push(Candidate(entryDistance, entry));
+    visited[entry] = visitMark;
+
+    while (!candidates.empty()) {
+      Candidate current = candidates.top();
+      if (current.first > nearest.top().first) {
+        break;
+      }
+      candidates.pop();
+
+      const std::vector<int>& neighbors = links[current.second][level];
+      for (size_t i = 0; i < neighbors.size(); i++) {
+        int neighbor = neighbors[i];
+        if (visited[neighbor] == visitMark) {
+          continue;
+        }
+        visited[neighbor] = visitMark;
+        float d = distance(query, neighbor);
+        if ((int)nearest.size() < ef || d < nearest.top().first) {
+          candidates.push(Candidate(d, neighbor));
+          nearest.push(Candidate(d, neighbor));
+          if ((int)nearest.size() > ef) {
+            nearest.pop();
+          }
+        }
+      }
+    }
+
+    result.resize(nearest.size());
+    for (int i = (int)result.size() - 1; i >= 0; i--) {
+      result[i] = nearest.top();
+      nearest.pop();
+    }
+  }
+
+  // Keep a candidate only if it is closer to the base node than to every
+  // neighbour already kept. This spreads links in all directions instead of
+  // clustering them, which keeps the graph navigable.
+  // candidates must be sorted by increasing distance to the base node.
+  void selectNeighbors(const std::vector<Candidate>& candidates, int maxNeighbors, std::vector<int>& selected) const {
+    selected.clear();
+    for (size_t i = 0; i < candidates.size() && (int)selected.size() < maxNeighbors; i++) {
+      bool keep = true;
+      for (size_t j = 0; j < selected.size(); j++) {
+        if (distance(candidates[i].second, selected[j]) < candidates[i].first) {
+          keep = false;
+          break;
+        }
+      }
+      if (keep) {
+        selected.push_back(candidates[i].second);
+      }
+    }
+  }
+
+  void insert(int node, int level) {
+    links[node].assign(level + 1, std::vector<int>());
+    if (entryPoint < 0) {
+      entryPoint = node;
+      maxLevel = level;
+      return;
+    }
+
+    const float* query = gallery->getDescriptors().ptr<float>(node);
+    int current = entryPoint;
+    float currentDistance = distance(query, current);
+    greedySearch(query, level, current, currentDistance);
+
+    std::vector<Candidate> candidates, neighborCandidates;
+    std::vector<int> selected;
+    for (int l = std::min(level, maxLevel); l >= 0; l--) {
+      searchLayer(query, current, currentDistance, efConstruction, l, candidates);
+      selectNeighbors(candidates, M, selected);
+      links[node][l] = selected;
+
+      // layer 0 holds every node and gets twice as many links
+      int maxNeighbors = (l == 0) ? 2 * M : M;
+      for (size_t i = 0; i < selected.size(); i++) {
+        std::vector<int>& neighborLinks = links[selected[i]][l];
+        neighborLinks.push_back(node);
+        if ((int)neighborLinks.size() > maxNeighbors) {
+          // shrink the neighbour's links with the same heuristic
+          neighborCandidates.resize(neighborLinks.size());
+          for (size_t j = 0; j < neighborLinks.size(); j++) {
+            neighborCandidates[j] = Candidate(distance(selected[i], neighborLinks[j]), neighborLinks[j]);
+          }
+          std::sort(neighborCandidates.begin(), neighborCandidates.end());
+          std::vector<int> pruned;
+          selectNeighbors(neighborCandidates, maxNeighbors, pruned);
+          neighborLinks.swap(pruned);
+        }
+      }
+
+      current = candidates[0].second;
+      currentDistance = candidates[0].first;
+    }
+
+    if (level > maxLevel) {
+      maxLevel = level;
+      entryPoint = node;
+    }
+  }
+};
+
+// Load the HNSW index saved next to the descriptors if there is one
+// and it matches the gallery, otherwise fall back to exact search.
+// galleryChecksum as in HnswFaceIndex::load.
+inline cv::Ptr<FaceIndex> loadFaceIndex(const std::string& filename, const FaceGallery& gallery,
+                                        uint64_t galleryChecksum) {
+  cv::Ptr<HnswFaceIndex> hnsw = cv::makePtr<HnswFaceIndex>();
+  if (hnsw->load(filename, gallery, galleryChecksum)) {
+    std::cout << "using hnsw index " << filename << std::endl;
+    return hnsw;
+  }
+  cv::Ptr<FaceIndex> exact = cv::makePtr<ExactFaceIndex>();
+  exact->build(gallery);
+  std::cout << "no valid index in " << filename << ", using exact search" << std::endl;
+  return exact;
+}
+
+#endif // BIGVISION_faceIndex_HPP_
@@ -0,0 +1,269 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_faceQuality_HPP_
+#define BIGVISION_faceQuality_HPP_
+
+#include <math.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <dlib/image_processing/full_object_detection.h>
+
+// Cheap checks run on a detected face before its descriptor is computed.
+// Faces that are too small, blurred, turned away, or badly exposed give
+// descriptors that match nobody (or the wrong person), so they are skipped
+// at enrollment and deferred to a better frame when testing on video.
+//
+// Everything is computed from the landmarks and a small crop of the face:
+//   inter-eye distance  distance in pixels between the eye centers
+//   sharpness           variance of the Laplacian of the face, resized to a
+//                       fixed size so that it does not depend on face size
+//   yaw, pitch          rough head pose in degrees, from the position of the
+//                       nose relative to the eyes
+//   brightness          mean gray level of the face
+
+// size of the square the face is resized to before measuring sharpness
+#define FACE_QUALITY_CROP_SIZE 64
+// depth of the nose tip in front of the eyes, in inter-eye distances
+#define FACE_QUALITY_NOSE_DEPTH 0.5
+
+// reasons for skipping a face, combined as flags
+enum FaceQualityIssue {
+  FACE_TOO_SMALL = 1,
+  FACE_BLURRY = 2,
+  FACE_TURNED = 4,
+  FACE_TOO_DARK = 8,
+  FACE_TOO_BRIGHT = 16
+};
+#define FACE_QUALITY_NUM_ISSUES 5
+
+struct FaceQualityThresholds {
+  FaceQualityThresholds()
+      : minInterEyeDistance(20), minSharpness(40), maxYaw(35), maxPitch(25), minBrightness(40), maxBrightness(215) {
+  }
+  FaceQualityThresholds(float minInterEyeDistance, float minSharpness, float maxYaw, float maxPitch,
+                        float minBrightness, float maxBrightness)
+      : minInterEyeDistance(minInterEyeDistance), minSharpness(minSharpness), maxYaw(maxYaw), maxPitch(maxPitch),
+        minBrightness(minBrightness), maxBrightness(maxBrightness) {
+  }
+  // all thresholds in one string, e.g. "20/40/35/25/40/215", which tells
+  // apart results obtained with different thresholds
+  std::string key() const {
+    std::stringstream stream;
+    stream << minInterEyeDistance << "/" << minSharpness << "/" << maxYaw << "/" << maxPitch << "/"
+           << minBrightness << "/" << maxBrightness;
+    return stream.str();
+  }
+  float minInterEyeDistance;  // pixels
+  float minSharpness;         // Laplacian variance
+  float maxYaw;               // degrees
+  float maxPitch;             // degrees
+  float minBrightness;        // gray level
+  float maxBrightness;        // gray level
+};
+
+struct FaceQuality {
+  float interEyeDistance;
+  float sharpness;
+  float yaw;
+  float pitch;
+  float brightness;
+  // FaceQualityIssue flags of the thresholds the face failed, 0 if none
+  int issues;
+  // between 0 and 1, higher for larger, sharper and more frontal faces.
+  // Used to pick the better of two faces of the same person.
+  float score;
+
+  bool acceptable() const {
+    return issues == 0;
+  }
+};
+
+static cv::Point2f meanPoint(const dlib::full_object_detection& landmarks, int first, int last) {
+  cv::Point2f sum(0, 0);
+  for (int i = first; i <= last; i++) {
+    sum += cv::Point2f(landmarks.part(i).x(), landmarks.part(i).y());
+  }
+  return sum * (1.0f / (last - first + 1));
+}
+
+static float clampedAsinDegrees(float x) {
+  return asin(std::max(-1.0f, std::min(1.0f, x))) * 180.0 / CV_PI;
+}
+
+// Measure the quality of a face from its landmarks, found by either the 68 or
+// the 5 point dlib shape predictor, and the 8 bit image it was detected in.
+FaceQuality assessFaceQuality(const cv::Mat& im, const dlib::full_object_detection& landmarks,
+                              const FaceQualityThresholds& thresholds = FaceQualityThresholds()) {
+  CV_Assert(landmarks.num_parts() == 68 || landmarks.num_parts() == 5);
+  cv::Point2f leftEye, rightEye, nose;
+  // vertical distance of the nose landmark below the eyes on a frontal face,
+  // in inter-eye distances
+  float frontalNoseDrop;
+  if (landmarks.num_parts() == 68) {
+    leftEye = meanPoint(landmarks, 36, 41);
+    rightEye = meanPoint(landmarks, 42, 47);
+    nose = meanPoint(landmarks, 30, 30);
+    frontalNoseDrop = 0.6;
+  } else {
+    leftEye = meanPoint(landmarks, 2, 3);
+    rightEye = meanPoint(landmarks, 0, 1);
+    nose = meanPoint(landmarks, 4, 4);
+    frontalNoseDrop = 0.7;
+  }
+  if (leftEye.x > rightEye.x) {
+    std::swap(leftEye, rightEye);
+  }
+
+  FaceQuality quality;
+  cv::Point2f eyeAxis = rightEye - leftEye;
+  quality.interEyeDistance = sqrt(eyeAxis.dot(eyeAxis));
+  float eyeDistance = std::max(quality.interEyeDistance, 1.0f);
+
+  // nose position in a frame along the eyes and perpendicular to them
+  cv::Point2f along = eyeAxis * (1.0f / eyeDistance);
+  cv::Point2f across(-along.y, along.x);
+  cv::Point2f noseOffset = nose - (leftEye + rightEye) * 0.5f;
+  quality.yaw = clampedAsinDegrees(noseOffset.dot(along) / eyeDistance / FACE_QUALITY_NOSE_DEPTH);
+  quality.pitch = clampedAsinDegrees((noseOffset.dot(across) / eyeDistance - frontalNoseDrop) / FACE_QUALITY_NOSE_DEPTH);
+
+  // square of twice the inter-eye distance around eyes and nose covers the face
+  cv::Point2f center = (leftEye + rightEye + nose) * (1.0f / 3);
+  int side = std::max((int)(2 * eyeDistance), 2);
+  cv::Rect faceRect = cv::Rect((int)center.x - side / 2, (int)center.y - side / 2, side, side) &
+                      cv::Rect(0, 0, im.cols, im.rows);
+  quality.sharpness = 0;
+  quality.brightness = 0;
+  if (faceRect.area() > 0) {
+    cv::Mat face, gray, laplacian;
+    cv::resize(im(faceRect), face, cv::Size(FACE_QUALITY_CROP_SIZE, FACE_QUALITY_CROP_SIZE), 0, 0, cv::INTER_AREA);
+    if (face.channels() == 3) {
+      cv::cvtColor(face, gray, cv::COLOR_BGR2GRAY);
+    } else {
+      gray = face;
+    }
+    cv::Laplacian(gray, laplacian, CV_32F);
+    cv::Scalar mean, stddev;
+    cv::meanStdDev(laplacian, mean, stddev);
+    quality.sharpness = stddev[0] * stddev[0];
+    quality.brightness = cv::mean(gray)[0];
+  }
+
+  quality.issues = 0;
+  if (quality.interEyeDistance < thresholds.minInterEyeDistance) {
+    quality.issues |= FACE_TOO_SMALL;
+  }
+  if (quality.sharpness < thresholds.minSharpness) {
+    quality.issues |= FACE_BLURRY;
+  }
+  if (fabs(quality.yaw) > thresholds.maxYaw || fabs(quality.pitch) > thresholds.maxPitch) {
+    quality.issues |= FACE_TURNED;
+  }
+  if (quality.brightness < thresholds.minBrightness) {
+    quality.issues |= FACE_TOO_DARK;
+  }
+  if (quality.brightness > thresholds.maxBrightness) {
+    quality.issues |= FACE_TOO_BRIGHT;
+  }
+
+  quality.score = std::min(1.0f, quality.interEyeDistance / (2 * thresholds.minInterEyeDistance)) *
+                  std::min(1.0f, quality.sharpness / (2 * thresholds.minSharpness)) *
+                  cos(quality.yaw * CV_PI / 180) * cos(quality.pitch * CV_PI / 180);
+  return quality;
+}
+
+static const char* faceQualityIssueName(int issueIndex) {
+  static const char* issueNames[FACE_QUALITY_NUM_ISSUES] = {"too small", "blurry", "turned", "too dark", "too bright"};
+  return issueNames[issueIndex];
+}
+
+// comma separated reasons of the issue flags, e.g. "too small, blurry"
+std::string faceQualityIssues(int issues) {
+  std::string reasons;
+  for (int i = 0; i < FACE_QUALITY_NUM_ISSUES; i++) {
+    if (issues & (1 << i)) {
+      reasons += (reasons.empty() ? "" : ", ") + std::string(faceQualityIssueName(i));
+    }
+  }
+  return reasons;
+}
+
+// Counts the faces skipped by the quality gate and why, for a frame or a run.
+class FaceQualityReport {
+public:
+  FaceQualityReport() {
+    reset();
+  }
+
+  void reset() {
+    numFaces = 0;
+    numSkipped = 0;
+    std::fill(issueCounts, issueCounts + FACE_QUALITY_NUM_ISSUES, 0);
+  }
+
+  void add(const FaceQuality& quality) {
+    numFaces++;
+    if (quality.acceptable()) {
+      return;
+    }
+    numSkipped++;
+    for (int i = 0; i < FACE_QUALITY_NUM_ISSUES; i++) {
+      if (quality.issues & (1 << i)) {
+        issueCounts[i]++;
+      }
+    }
+  }
+
+  long faces() const {
+    return numFaces;
+  }
+
+  long skipped() const {
+    return numSkipped;
+  }
+
+  // e.g. "3 face(s), 1 skipped (blurry 1)"
+  std::string summary() const {
+    std::stringstream stream;
+    stream << numFaces << " face(s), " << numSkipped << " skipped";
+    if (numSkipped > 0) {
+      stream << " (";
+      bool first = true;
+      for (int i = 0; i < FACE_QUALITY_NUM_ISSUES; i++) {
+        if (issueCounts[i] > 0) {
+          stream << (first ? "" : ", ") << faceQualityIssueName(i) << " " << issueCounts[i];
+          first = false;
+        }
+      }
+      stream << ")";
+    }
+    return stream.str();
+  }
+
+private:
+  long numFaces;
+  long numSkipped;
+  long issueCounts[FACE_QUALITY_NUM_ISSUES];
+};
+
+#endif // BIGVISION_faceQuality_HPP_
@@ -0,0 +1,175 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_faceTracker_HPP_
+#define BIGVISION_faceTracker_HPP_
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+// votes for one label collected by a track
+struct IdentityVote {
+  int count;
+  float distanceSum;
+};
+
+// a face followed from frame to frame
+struct FaceTrack {
+  int id;
+  cv::Rect box;             // face rectangle in the frame the track was last seen
+  int lastSeen;             // frame the track was last seen in
+  int lastVerified;         // frame the identity of the track was last computed in
+  double verifiedQuality;   // quality of the face at that time
+  int label;                // voted label of the track, -1 for unknown
+  float distance;           // mean distance of the recognitions voting for label
+  std::map<int, IdentityVote> votes;
+};
+
+// Attaches recognition to face tracks instead of single detections.
+// Faces are associated with the tracks of the previous frames by overlap.
+// A track is recognized when it starts and then only every
+// reverifyInterval frames, or earlier if the face got clearly better
+// (e.g. larger) than when it was last recognized. Its label is the
+// vote over all its recognitions, so a single bad frame does not flip it.
+// In between, the face reuses the identity of its track, which skips the
+// network and the gallery search for most faces. Landmarks are still found
+// for every face, the quality gate needs them.
+class FaceTracker {
+public:
+  FaceTracker(int reverifyInterval = 15, double minOverlap = 0.3, int maxMissedFrames = 5,
+              double qualityGain = 1.25)
+      : reverifyInterval(reverifyInterval), minOverlap(minOverlap), maxMissedFrames(maxMissedFrames),
+        qualityGain(qualityGain), nextId(0), numFaces(0), numRecognitions(0) {
+  }
+
+  // Associate the faces found in frame with the tracks, starting a new track
+  // for every face that does not overlap one. faceTracks[i] is set to the id
+  // of the track of faces[i]. Tracks not seen for maxMissedFrames are dropped.
+  void update(const std::vector<cv::Rect>& faces, int frame, std::vector<int>& faceTracks) {
+    // candidate (overlap, face, track) pairs, best overlap first
+    std::vector<std::pair<double, std::pair<int, int> > > pairs;
+    for (int i = 0; i < (int)faces.size(); i++) {
+      for (std::map<int, FaceTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+        double overlap = intersectionOverUnion(faces[i], it->second.box);
+        if (overlap >= minOverlap) {
+          pairs.push_back(std::make_pair(overlap, std::make_pair(i, it->first)));
+        }
+      }
+    }
+    std::sort(pairs.rbegin(), pairs.rend());
+
+    faceTracks.assign(faces.size(), -1);
+    std::map<int, bool> trackTaken;
+    for (size_t p = 0; p < pairs.size(); p++) {
+      int face = pairs[p].second.first;
+      int id = pairs[p].second.second;
+      if (faceTracks[face] < 0 && !trackTaken[id]) {
+        faceTracks[face] = id;
+        trackTaken[id] = true;
+      }
+    }
+
+    for (int i = 0; i < (int)faces.size(); i++) {
+      if (faceTracks[i] < 0) {
+        FaceTrack track;
+        track.id = nextId++;
+        track.lastVerified = -1;
+        track.verifiedQuality = 0;
+        track.label = -1;
+        track.distance = 0;
+        tracks[track.id] = track;
+        faceTracks[i] = track.id;
+      }
+      FaceTrack& track = tracks[faceTracks[i]];
+      track.box = faces[i];
+      track.lastSeen = frame;
+    }
+    numFaces += faces.size();
+
+    for (std::map<int, FaceTrack>::iterator it = tracks.begin(); it != tracks.end();) {
+      if (frame - it->second.lastSeen > maxMissedFrames) {
+        tracks.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // whether the face of track id has to be recognized in this frame
+  bool needsRecognition(int id, double quality, int frame) const {
+    const FaceTrack& t = track(id);
+    return t.lastVerified < 0 || frame - t.lastVerified >= reverifyInterval ||
+           quality > qualityGain * t.verifiedQuality;
+  }
+
+  // Add the result of recognizing the face of track id to the votes of the track.
+  void addRecognition(int id, int label, float distance, double quality, int frame) {
+    FaceTrack& t = tracks[id];
+    t.lastVerified = frame;
+    t.verifiedQuality = quality;
+    IdentityVote& vote = t.votes[label];
+    vote.count++;
+    vote.distanceSum += distance;
+
+    // label with the most votes wins, ties go to the closer one
+    int bestCount = 0;
+    for (std::map<int, IdentityVote>::const_iterator it = t.votes.begin(); it != t.votes.end(); ++it) {
+      float meanDistance = it->second.distanceSum / it->second.count;
+      if (it->second.count > bestCount || (it->second.count == bestCount && meanDistance < t.distance)) {
+        bestCount = it->second.count;
+        t.label = it->first;
+        t.distance = meanDistance;
+      }
+    }
+    numRecognitions++;
+  }
+
+  const FaceTrack& track(int id) const {
+    return tracks.find(id)->second;
+  }
+
+  // faces seen so far and how many of them were recognized
+  long faces() const {
+    return numFaces;
+  }
+
+  long recognitions() const {
+    return numRecognitions;
+  }
+
+private:
+  int reverifyInterval;
+  double minOverlap;
+  int maxMissedFrames;
+  double qualityGain;
+  int nextId;
+  long numFaces;
+  long numRecognitions;
+  std::map<int, FaceTrack> tracks;
+
+  static double intersectionOverUnion(const cv::Rect& a, const cv::Rect& b) {
+    double intersection = (a & b).area();
+    double area = a.area() + b.area() - intersection;
+    return area > 0 ? intersection / area : 0;
+  }
+};
+
+#endif // BIGVISION_faceTracker_HPP_
@@ -0,0 +1,456 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_quantizedFaceIndex_HPP_
+#define BIGVISION_quantizedFaceIndex_HPP_
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__F16C__)
+  #include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+#endif
+
+#include <opencv2/core.hpp>
+
+#include "faceGallery.hpp"
+#include "faceIndex.hpp"
+
+// Exact search over a compressed copy of the gallery.
+//
+// QUANTIZE_INT8_PER_VECTOR     every descriptor is scaled to int8 by its own
+//                              largest value: 1 byte per value plus 1 scale
+// QUANTIZE_INT8_PER_DIMENSION  every dimension is scaled by its largest value
+//                              over the gallery, which follows the spread of
+//                              each dimension more closely
+// QUANTIZE_FLOAT16             values are stored as IEEE half floats
+//
+// int8 descriptors are compared with an integer dot product, the gallery
+// squared norms are kept in float, so the distance is
+// ||q||^2 + ||g||^2 - 2 q.g with only q.g approximated. float16 descriptors
+// are widened to float and compared directly.
+//
+// The kernels use AVX2 (int8) and F16C + FMA (float16) on x86 and NEON on
+// ARM when the compiler targets them, e.g. with -march=native, and plain
+// loops otherwise.
+enum QuantizationType {
+  QUANTIZE_INT8_PER_VECTOR = 0,
+  QUANTIZE_INT8_PER_DIMENSION = 1,
+  QUANTIZE_FLOAT16 = 2
+};
+
+// float to IEEE half float, rounding to nearest even
+inline uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000;
+  int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+  if (((bits >> 23) & 0xff) == 0xff) {
+    // inf and nan
+    return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  }
+  if (exponent >= 31) {
+    return (uint16_t)(sign | 0x7c00);
+  }
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return (uint16_t)sign;
+    }
+    // subnormal half
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t remainder = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1))) {
+      half++;
+    }
+    return (uint16_t)(sign | half);
+  }
+  uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+  uint32_t remainder = mantissa & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+    // may carry into the exponent, which is still correctly rounded
+    half++;
+  }
+  return (uint16_t)half;
+}
+
+inline float halfToFloat(uint16_t half) {
+  uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else {
+      // subnormal half, normalize it
+      exponent = 127 - 15 + 1;
+      while ((mantissa & 0x400) == 0) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  } else if (exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// dot product of two int8 vectors
+inline int dotInt8(const int8_t* a, const int8_t* b, int n) {
+  int i = 0;
+  int result = 0;
+#if defined(__AVX2__)
+  __m256i sum = _mm256_setzero_si256();
+  for (; i + 16 <= n; i += 16) {
+    // widen 16 values to int16, multiply and add pairs into int32
+    __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+    __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(va, vb));
+  }
+  __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  sum4 = _mm_hadd_epi32(sum4, sum4);
+  sum4 = _mm_hadd_epi32(sum4, sum4);
+  result = _mm_cvtsi128_si32(sum4);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  int32x4_t sum = vdupq_n_s32(0);
+  for (; i + 16 <= n; i += 16) {
+    int8x16_t va = vld1q_s8(a + i);
+    int8x16_t vb = vld1q_s8(b + i);
+    // int8 products fit in int16, pairs of them are accumulated in int32
+    sum = vpadalq_s16(sum, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+    sum = vpadalq_s16(sum, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+  }
+  result = vgetq_lane_s32(sum, 0) + vgetq_lane_s32(sum, 1) + vgetq_lane_s32(sum, 2) + vgetq_lane_s32(sum, 3);
+#endif
+  for (; i < n; i++) {
+    result += a[i] * b[i];
+  }
+  return result;
+}
+
+// squared distance between a float vector and a float16 vector
+inline float distanceFloat16(const float* a, const uint16_t* b, int n) {
+  int i = 0;
+  float result = 0;
+#if defined(__F16C__) && defined(__FMA__)
+  __m256 sum = _mm256_setzero_ps();
+  for (; i + 8 <= n; i += 8) {
+    __m256 vb = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i)));
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), vb);
+    sum = _mm256_fmadd_ps(diff, diff, sum);
+  }
+  __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+  sum4 = _mm_hadd_ps(sum4, sum4);
+  sum4 = _mm_hadd_ps(sum4, sum4);
+  result = _mm_cvtss_f32(sum4);
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__ARM_FP16_FORMAT_IEEE)
+  float32x4_t sum = vdupq_n_f32(0);
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t vb = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(b + i)));
+    float32x4_t diff = vsubq_f32(vld1q_f32(a + i), vb);
+    sum = vmlaq_f32(sum, diff, diff);
+  }
+  result = vgetq_lane_f32(sum, 0) + vgetq_lane_f32(sum, 1) + vgetq_lane_f32(sum, 2) + vgetq_lane_f32(sum, 3);
+#endif
+  for (; i < n; i++) {
+    float diff = a[i] - halfToFloat(b[i]);
+    result += diff * diff;
+  }
+  return result;
+}
+
+class QuantizedFaceIndex : public FaceIndex {
+public:
+  QuantizedFaceIndex(int type = QUANTIZE_INT8_PER_DIMENSION) : type(type), dim(0), count(0) {
+    pointToOwnData();
+  }
+
+  // Index over codes, scales, squared norms and labels stored elsewhere, e.g.
+  // in a memory mapped descriptor store. Nothing is copied, so that memory
+  // has to outlive the index, and build() replaces it with an own copy.
+  // codeData: count x dimension int8 codes, or float16 values for QUANTIZE_FLOAT16
+  // dimensionScaleData, vectorScaleData: dimension and count int8 scales,
+  // unused for QUANTIZE_FLOAT16
+  QuantizedFaceIndex(int type, int count, int dimension, const void* codeData, const float* dimensionScaleData,
+                     const float* vectorScaleData, const float* normData, const int* labelData)
+      : type(type), dim(dimension), count(count),
+        codePtr(type == QUANTIZE_FLOAT16 ? NULL : (const int8_t*)codeData),
+        halfCodePtr(type == QUANTIZE_FLOAT16 ? (const uint16_t*)codeData : NULL),
+        vectorScalePtr(vectorScaleData), dimensionScalePtr(dimensionScaleData), normPtr(normData), labelPtr(labelData) {
+  }
+
+  std::string name() const {
+    switch (type) {
+      case QUANTIZE_INT8_PER_VECTOR:
+        return "int8/vector";
+      case QUANTIZE_INT8_PER_DIMENSION:
+        return "int8/dim";
+      default:
+        return "float16";
+    }
+  }
+
+  void build(const FaceGallery& gallery) {
+    dim = gallery.dimension();
+    count = gallery.size();
+    const cv::Mat& descriptors = gallery.getDescriptors();
+    labels.resize(count);
+    norms.resize(count);
+    for (int i = 0; i < count; i++) {
+      labels[i] = gallery.getLabel(i);
+      norms[i] = gallery.getNorms().ptr<float>()[i];
+    }
+    codes.clear();
+    halfCodes.clear();
+    vectorScales.clear();
+    dimensionScales.clear();
+
+    if (type == QUANTIZE_FLOAT16) {
+      halfCodes.resize((size_t)count * dim);
+      for (int i = 0; i < count; i++) {
+        const float* descriptor = descriptors.ptr<float>(i);
+        for (int d = 0; d < dim; d++) {
+          halfCodes[(size_t)i * dim + d] = floatToHalf(descriptor[d]);
+        }
+      }
+      pointToOwnData();
+      return;
+    }
+
+    // per dimension scales, all 1 when every descriptor has its own scale
+    dimensionScales.assign(dim, 1.0f);
+    if (type == QUANTIZE_INT8_PER_DIMENSION) {
+      std::vector<float> maxAbs(dim, 0.0f);
+      for (int i = 0; i < count; i++) {
+        const float* descriptor = descriptors.ptr<float>(i);
+        for (int d = 0; d < dim; d++) {
+          maxAbs[d] = std::max(maxAbs[d], (float)fabs(descriptor[d]));
+        }
+      }
+      for (int d = 0; d < dim; d++) {
+        dimensionScales[d] = maxAbs[d] > 0 ? maxAbs[d] / 127.0f : 1.0f;
+      }
+    }
+
+    codes.resize((size_t)count * dim);
+    vectorScales.resize(count);
+    std::vector<float> scaled(dim);
+    for (int i = 0; i < count; i++) {
+      const float* descriptor = descriptors.ptr<float>(i);
+      for (int d = 0; d < dim; d++) {
+        scaled[d] = descriptor[d] / dimensionScales[d];
+      }
+      if (type == QUANTIZE_INT8_PER_VECTOR) {
+        vectorScales[i] = quantize(&scaled[0], &codes[(size_t)i * dim]);
+      } else {
+        // values are already within [-127, 127]
+        vectorScales[i] = 1.0f;
+        for (int d = 0; d < dim; d++) {
+          codes[(size_t)i * dim + d] = (int8_t)cvRound(std::max(-127.0f, std::min(127.0f, scaled[d])));
+        }
+      }
+    }
+    pointToOwnData();
+  }
+
+  void search(const cv::Mat& queries, int k, std::vector<std::vector<FaceMatch> >& matches) const {
+    CV_Assert(queries.type() == CV_32F && queries.cols == dim);
+    int numQueries = queries.rows;
+    matches.assign(numQueries, std::vector<FaceMatch>());
+    if (numQueries == 0 || count == 0 || k <= 0) {
+      return;
+    }
+
+    // quantize the queries in the units of the gallery codes:
+    // q.g = sum_d q_d s_d g8_d * s_g ~ s_q s_g sum_d q8_d g8_d
+    std::vector<int8_t> queryCodes;
+    std::vector<float> queryScales(numQueries), queryNorms(numQueries);
+    if (type != QUANTIZE_FLOAT16) {
+      queryCodes.resize((size_t)numQueries * dim);
+      std::vector<float> scaled(dim);
+      for (int q = 0; q < numQueries; q++) {
+        const float* query = queries.ptr<float>(q);
+        for (int d = 0; d < dim; d++) {
+          scaled[d] = query[d] * dimensionScalePtr[d];
+        }
+        queryScales[q] = quantize(&scaled[0], &queryCodes[(size_t)q * dim]);
+        queryNorms[q] = (float)queries.row(q).dot(queries.row(q));
+      }
+    }
+
+    typedef std::pair<float, int> Candidate;
+    std::vector<std::priority_queue<Candidate> > best(numQueries);
+    for (int start = 0; start < count; start += GALLERY_BLOCK_SIZE) {
+      int end = std::min(start + GALLERY_BLOCK_SIZE, count);
+      for (int q = 0; q < numQueries; q++) {
+        std::priority_queue<Candidate>& heap = best[q];
+        for (int i = start; i < end; i++) {
+          float distance2;
+          if (type == QUANTIZE_FLOAT16) {
+            distance2 = distanceFloat16(queries.ptr<float>(q), halfCodePtr + (size_t)i * dim, dim);
+          } else {
+            float dot = queryScales[q] * vectorScalePtr[i] *
+                        dotInt8(&queryCodes[(size_t)q * dim], codePtr + (size_t)i * dim, dim);
+            distance2 = queryNorms[q] + normPtr[i] - 2 * dot;
+          }
+          if ((int)heap.size() < k) {
+            heap.push(Candidate(distance2, i));
+          } else if (distance2 < heap.top().first) {
+            heap.pop();
+            heap.push(Candidate(distance2, i));
+          }
+        }
+      }
+    }
+
+    for (int q = 0; q < numQueries; q++) {
+      std::vector<FaceMatch>& result = matches[q];
+      result.resize(best[q].size());
+      for (int r = (int)result.size() - 1; r >= 0; r--) {
+        const Candidate& candidate = best[q].top();
+        result[r].index = candidate.second;
+        result[r].label = labelPtr[candidate.second];
+        result[r].distance = sqrt(std::max(candidate.first, 0.0f));
+        best[q].pop();
+      }
+    }
+  }
+
+  int getType() const {
+    return type;
+  }
+
+  int dimension() const {
+    return dim;
+  }
+
+  int size() const {
+    return count;
+  }
+
+  // size() x dimension() int8 codes, NULL for QUANTIZE_FLOAT16
+  const int8_t* getCodes() const {
+    return codePtr;
+  }
+
+  // size() x dimension() float16 values, NULL for int8 types
+  const uint16_t* getHalfCodes() const {
+    return halfCodePtr;
+  }
+
+  // dimension() per dimension and size() per descriptor scales of the int8 codes
+  const float* getDimensionScales() const {
+    return dimensionScalePtr;
+  }
+
+  const float* getVectorScales() const {
+    return vectorScalePtr;
+  }
+
+  const float* getNorms() const {
+    return normPtr;
+  }
+
+  const int* getLabels() const {
+    return labelPtr;
+  }
+
+  // approximate float values of descriptor i, dimension() of them
+  void decode(int i, float* descriptor) const {
+    CV_Assert(i >= 0 && i < count);
+    for (int d = 0; d < dim; d++) {
+      if (type == QUANTIZE_FLOAT16) {
+        descriptor[d] = halfToFloat(halfCodePtr[(size_t)i * dim + d]);
+      } else {
+        descriptor[d] = codePtr[(size_t)i * dim + d] * vectorScalePtr[i] * dimensionScalePtr[d];
+      }
+    }
+  }
+
+  // memory used per descriptor: codes, scale, squared norm and label
+  size_t bytesPerDescriptor() const {
+    if (type == QUANTIZE_FLOAT16) {
+      return dim * sizeof(uint16_t) + sizeof(int);
+    }
+    return dim * sizeof(int8_t) + 2 * sizeof(float) + sizeof(int);
+  }
+
+private:
+  int type;
+  int dim;
+  int count;
+  std::vector<int8_t> codes;        // count x dim int8 codes
+  std::vector<uint16_t> halfCodes;  // count x dim float16 values
+  std::vector<float> vectorScales;
+  std::vector<float> dimensionScales;
+  std::vector<float> norms;         // squared norms of the float descriptors
+  std::vector<int> labels;
+  // data searched, either the vectors above or memory the index was created over
+  const int8_t* codePtr;
+  const uint16_t* halfCodePtr;
+  const float* vectorScalePtr;
+  const float* dimensionScalePtr;
+  const float* normPtr;
+  const int* labelPtr;
+
+  // the pointers may refer to the own vectors, so the index cannot be copied
+  QuantizedFaceIndex(const QuantizedFaceIndex&);
+  QuantizedFaceIndex& operator=(const QuantizedFaceIndex&);
+
+  void pointToOwnData() {
+    codePtr = codes.empty() ? NULL : &codes[0];
+    halfCodePtr = halfCodes.empty() ? NULL : &halfCodes[0];
+    vectorScalePtr = vectorScales.empty() ? NULL : &vectorScales[0];
+    dimensionScalePtr = dimensionScales.empty() ? NULL : &dimensionScales[0];
+    normPtr = norms.empty() ? NULL : &norms[0];
+    labelPtr = labels.empty() ? NULL : &labels[0];
+  }
+
+  // symmetric int8 quantization of dim values, returns the scale
+  float quantize(const float* values, int8_t* quantized) const {
+    float maxAbs = 0;
+    for (int d = 0; d < dim; d++) {
+      maxAbs = std::max(maxAbs, (float)fabs(values[d]));
+    }
+    float scale = maxAbs > 0 ? maxAbs / 127.0f : 1.0f;
+    for (int d = 0; d < dim; d++) {
+      quantized[d] = (int8_t)cvRound(values[d] / scale);
+    }
+    return scale;
+  }
+};
+
+#endif // BIGVISION_quantizedFaceIndex_HPP_
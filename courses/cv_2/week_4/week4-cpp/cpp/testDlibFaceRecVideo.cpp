@@ -36,6 +36,12 @@
  #include <dlib/image_processing.h>
  #include <dlib/image_processing/frontal_face_detector.h>
 
+#include "faceGallery.hpp"
+#include "faceIndex.hpp"
+#include "descriptorStore.hpp"
+#include "faceTracker.hpp"
+#include "faceQuality.hpp"
+
 // dirent.h is pre-included with *nix like systems
 // but not for Windows. So we are trying to include
 // this header files based on Operating System
@@ -60,7 +66,20 @@ using namespace cv;
 using namespace dlib;
 using namespace std;
 
+// model the descriptors are computed with, has to match the descriptor store
+#define FACE_MODEL_ID "dlib_face_recognition_resnet_model_v1"
+
+// quality gate, faces failing any of these thresholds are skipped
+#define MIN_INTER_EYE_DISTANCE 20  // pixels
+#define MIN_SHARPNESS 40           // variance of the Laplacian
+#define MAX_YAW 35                 // degrees
+#define MAX_PITCH 25               // degrees
+#define MIN_BRIGHTNESS 40          // mean gray level
+#define MAX_BRIGHTNESS 215         // mean gray level
+
 #define SKIP_FRAMES 1
+// frames after which the identity of a face track is computed again
+#define REVERIFY_FRAMES 15
 #define THRESHOLD 0.5
 
 // ----------------------------------------------------------------------------------------
@@ -108,108 +127,54 @@ void printVector(std::vector<T>& vec) {
   cout << endl;
 }
 
-// read names and labels mapping from file
-static void readLabelNameMap(const string& filename, std::vector<string>& names, std::vector<int>& labels,
-                             std::map<int, string>& labelNameMap, char separator = ';') {
-  std::ifstream file(filename.c_str(), ifstream::in);
-  if (!file) {
-    string error_message = "No valid input file was given, please check the given filename.";
-    CV_Error(CV_StsBadArg, error_message);
-  }
-  string line;
-  string name, labelStr;
-  // read lines from file one by one
-  while (getline(file, line)) {
-    stringstream liness(line);
-    // read first word which is person name
-    getline(liness, name, separator);
-    // read second word which is integer label
-    getline(liness, labelStr);
-    if(!name.empty() && !labelStr.empty()) {
-      names.push_back(name);
-      // convert label from string format to integer
-      int label = atoi(labelStr.c_str());
-      labels.push_back(label);
-      // add (integer label, person name) pair to map
-      labelNameMap[label] = name;
-    }
-  }
-}
-
-// read descriptors saved on disk
-static void readDescriptors(const string& filename, std::vector<int>& faceLabels, std::vector<matrix<float,0,1>>& faceDescriptors, char separator = ';') {
-  std::ifstream file(filename.c_str(), ifstream::in);
-  if (!file) {
-    string error_message = "No valid input file was given, please check the given filename.";
-    CV_Error(CV_StsBadArg, error_message);
+// find nearest enrolled face descriptor in the index
+// for every query face descriptor
+void nearestNeighbor(std::vector<dlib::matrix<float, 0, 1>>& faceDescriptorQueries,
+                    FaceIndex& index, std::vector<int>& labels, std::vector<float>& minDistances) {
+  labels.clear();
+  minDistances.clear();
+  if (faceDescriptorQueries.empty()) {
+    return;
   }
-  // each line has:
-  // 1st element = face label
-  // rest 128 elements = descriptor elements
-  string line;
-  string faceLabel;
-  // valueStr = one element of descriptor in string format
-  // value = one element of descriptor in float
-  string valueStr;
-  float value;
-  std::vector<float> faceDescriptorVec;
-  // read lines from file one by one
-  while (getline(file, line)) {
-    stringstream liness(line);
-    // read face label
-    // read first word on a line till separator
-    getline(liness, faceLabel, separator);
-    if(!faceLabel.empty()) {
-      faceLabels.push_back(std::atoi(faceLabel.c_str()));
-    }
-
-    faceDescriptorVec.clear();
-    // read rest of the words one by one using separator
-    while (getline(liness, valueStr, separator)) {
-      if (!valueStr.empty()) {
-        // convert descriptor element from string to float
-        faceDescriptorVec.push_back(atof(valueStr.c_str()));
-      }
-    }
 
-    // convert face descriptor from vector of float to Dlib's matrix format
-    dlib::matrix<float, 0, 1> faceDescriptor = dlib::mat(faceDescriptorVec);
-    faceDescriptors.push_back(faceDescriptor);
+  // copy query descriptors to the rows of one matrix
+  // so that they are all matched against the index at once
+  Mat queries((int)faceDescriptorQueries.size(), (int)faceDescriptorQueries[0].size(), CV_32F);
+  for (int i = 0; i < faceDescriptorQueries.size(); i++) {
+    std::copy(faceDescriptorQueries[i].begin(), faceDescriptorQueries[i].end(), queries.ptr<float>(i));
   }
-}
 
-// find nearest face descriptor from vector of enrolled faceDescriptor
-// to a query face descriptor
-void nearestNeighbor(dlib::matrix<float, 0, 1>& faceDescriptorQuery,
-                    std::vector<dlib::matrix<float, 0, 1>>& faceDescriptors,
-                    std::vector<int>& faceLabels, int& label, float& minDistance) {
-  int minDistIndex = 0;
-  minDistance = 1.0;
-  label = -1;
-  // Calculate Euclidean distances between face descriptor calculated on face dectected
+  // Calculate Euclidean distances between face descriptors calculated on faces dectected
   // in current frame with all the face descriptors we calculated while enrolling faces
-  // Calculate minimum distance and index of this face
-  for (int i = 0; i < faceDescriptors.size(); i++) {
-    double distance = length(faceDescriptors[i] - faceDescriptorQuery);
-    if (distance < minDistance) {
-      minDistance = distance;
-      minDistIndex = i;
+  // and keep the closest enrolled face for each query
+  std::vector<std::vector<FaceMatch>> matches;
+  index.search(queries, 1, matches);
+
+  labels.resize(matches.size());
+  minDistances.resize(matches.size());
+  for (int i = 0; i < matches.size(); i++) {
+    if (matches[i].empty()) {
+      labels[i] = -1;
+      minDistances[i] = 1.0;
+      continue;
+    }
+    // capped at 1.0 like the linear scan this replaced, which started from 1.0
+    minDistances[i] = std::min(matches[i][0].distance, 1.0f);
+    // Dlib specifies that in general, if two face descriptor vectors have a Euclidean
+    // distance between them less than 0.6 then they are from the same
+    // person, otherwise they are from different people.
+
+    // This threshold will vary depending upon number of images enrolled
+    // and various variations (illuminaton, camera quality) between
+    // enrolled images and query image
+    // We are using a threshold of 0.5
+    // if minimum distance is greater than a threshold
+    // assign integer label -1 i.e. unknown face
+    if (minDistances[i] > THRESHOLD) {
+      labels[i] = -1;
+    } else {
+      labels[i] = matches[i][0].label;
     }
-  }
-  // Dlib specifies that in general, if two face descriptor vectors have a Euclidean
-  // distance between them less than 0.6 then they are from the same
-  // person, otherwise they are from different people.
-
-  // This threshold will vary depending upon number of images enrolled
-  // and various variations (illuminaton, camera quality) between
-  // enrolled images and query image
-  // We are using a threshold of 0.5
-  // if minimum distance is greater than a threshold
-  // assign integer label -1 i.e. unknown face
-  if (minDistance > THRESHOLD){
-    label = -1;
-  } else {
-    label = faceLabels[minDistIndex];
   }
 }
 
@@ -224,18 +189,31 @@ int main() {
   anet_type net;
   deserialize(faceRecognitionModelPath) >> net;
 
-  // read names, labels and labels-name-mapping from file
+  // open the descriptor store written at enrollment. It is memory mapped,
+  // so enrolled descriptors are used in place without parsing or copying
+  const string faceDescriptorFile = "descriptors.bin";
+  DescriptorStore descriptorStore;
+  descriptorStore.open(faceDescriptorFile, FACE_MODEL_ID);
+
+  // read names, labels and labels-name-mapping from the store
   std::map<int, string> labelNameMap;
   std::vector<string> names;
   std::vector<int> labels;
-  const string labelNameFile = "label_name.txt";
-  readLabelNameMap(labelNameFile, names, labels, labelNameMap);
-
-  // read descriptors of enrolled faces from file
-  const string faceDescriptorFile = "descriptors.csv";
-  std::vector<int> faceLabels;
-  std::vector<matrix<float,0,1>> faceDescriptors;
-  readDescriptors(faceDescriptorFile, faceLabels, faceDescriptors);
+  descriptorStore.readNames(names, labels, labelNameMap);
+
+  // descriptors of enrolled faces
+  FaceGallery gallery;
+  cv::Ptr<FaceIndex> faceIndex;
+  if (descriptorStore.dtype() == DESCRIPTOR_FLOAT32) {
+    gallery = descriptorStore.gallery();
+    // use the approximate index built by enrollDlibFaceRec
+    // if there is one, otherwise search all descriptors
+    const string faceIndexFile = "descriptors.hnsw";
+    faceIndex = loadFaceIndex(faceIndexFile, gallery, descriptorStore.checksum());
+  } else {
+    // int8 and float16 descriptors are searched in place
+    faceIndex = descriptorStore.quantizedIndex();
+  }
 
   // Create a VideoCapture object
   VideoCapture cap;
@@ -247,6 +225,13 @@ int main() {
     return 1;
   }
 
+  // face tracks carrying the identity of the faces between recognitions
+  FaceTracker faceTracker(REVERIFY_FRAMES);
+  // faces below these thresholds are not recognized until they get better
+  FaceQualityThresholds qualityThresholds(MIN_INTER_EYE_DISTANCE, MIN_SHARPNESS, MAX_YAW, MAX_PITCH,
+                                          MIN_BRIGHTNESS, MAX_BRIGHTNESS);
+  FaceQualityReport totalQualityReport;
+
   int count = 0;
   double t = cv::getTickCount();
 
@@ -276,29 +261,73 @@ int main() {
 
       // detect faces in image
       std::vector<dlib::rectangle> faceRects = faceDetector(imDlib);
-      // Now process each face we found
-      for (int i = 0; i < faceRects.size(); i++) {
 
+      // follow faces from frame to frame, a person's track keeps its identity
+      std::vector<cv::Rect> faceBoxes(faceRects.size());
+      for (int i = 0; i < faceRects.size(); i++) {
+        faceBoxes[i] = cv::Rect(faceRects[i].left(), faceRects[i].top(), faceRects[i].width(), faceRects[i].height());
+      }
+      std::vector<int> faceTracks;
+      faceTracker.update(faceBoxes, count, faceTracks);
+
+      // Only faces of new tracks and of tracks due for re-verification are
+      // recognized, and only if they pass the quality gate. Others are
+      // deferred to a later frame. A track is re-verified early when the
+      // quality of its face becomes clearly better.
+      FaceQualityReport qualityReport;
+      std::vector<FaceQuality> faceQualities(faceRects.size());
+      std::vector<int> facesToRecognize;
+      // object to hold preProcessed face rectangles cropped from image
+      std::vector<matrix<rgb_pixel>> faceChips;
+      for (int i = 0; i < faceRects.size(); i++) {
         // Find facial landmarks for each detected face
         full_object_detection landmarks = landmarkDetector(imDlib, faceRects[i]);
 
-        // object to hold preProcessed face rectangle cropped from image
-        matrix<rgb_pixel> face_chip;
+        faceQualities[i] = assessFaceQuality(im, landmarks, qualityThresholds);
+        qualityReport.add(faceQualities[i]);
+        totalQualityReport.add(faceQualities[i]);
+        if (!faceQualities[i].acceptable() ||
+            !faceTracker.needsRecognition(faceTracks[i], faceQualities[i].score, count)) {
+          continue;
+        }
 
         // original face rectangle is warped to 150x150 patch.
         // Same pre-processing was also performed during training.
-        extract_image_chip(imDlib, get_face_chip_details(landmarks,150,0.25), face_chip);
+        faceChips.push_back(matrix<rgb_pixel>());
+        extract_image_chip(imDlib, get_face_chip_details(landmarks,150,0.25), faceChips.back());
+        facesToRecognize.push_back(i);
+      }
 
-        // Compute face descriptor using neural network defined in Dlib.
-        // It is a 128D vector that describes the face in img identified by shape.
-        matrix<float,0,1> faceDescriptorQuery = net(face_chip);
+      if (!faceChips.empty()) {
+        // Compute face descriptors using neural network defined in Dlib.
+        // Each is a 128D vector that describes the face in img identified by shape.
+        // All faces are passed at once so that the network processes them as a batch.
+        std::vector<matrix<float,0,1>> faceDescriptorQueries = net(faceChips);
+
+        // Find closest face enrolled to each face and vote with it for the identity of its track
+        std::vector<int> queryLabels;
+        std::vector<float> queryDistances;
+        nearestNeighbor(faceDescriptorQueries, *faceIndex, queryLabels, queryDistances);
+        for (int m = 0; m < facesToRecognize.size(); m++) {
+          int i = facesToRecognize[m];
+          faceTracker.addRecognition(faceTracks[i], queryLabels[m], queryDistances[m], faceQualities[i].score, count);
+        }
+      }
+      if (qualityReport.skipped() > 0) {
+        cout << "frame " << count << ": " << qualityReport.summary() << endl;
+      }
 
-        // Find closest face enrolled to face found in frame
-        int label;
-        float minDistance;
-        nearestNeighbor(faceDescriptorQuery, faceDescriptors, faceLabels, label, minDistance);
+      // Now process each face we found
+      for (int i = 0; i < faceRects.size(); i++) {
+        // identity voted by the face's track
+        const FaceTrack& track = faceTracker.track(faceTracks[i]);
+        int label = track.label;
+        float minDistance = track.distance;
         // Name of recognized person from map
         string name = labelNameMap[label];
+        if (track.lastVerified < 0) {
+          name = "skipped: " + faceQualityIssues(faceQualities[i].issues);
+        }
 
         cout << "Time taken = " << ((double)cv::getTickCount() - t)/cv::getTickFrequency() << endl;
 
@@ -332,5 +361,7 @@ int main() {
   // Counter used for skipping frames
   count += 1;
   }
+  cout << faceTracker.recognitions() << " of " << faceTracker.faces() << " faces went through the network" << endl;
+  cout << "quality gate: " << totalQualityReport.summary() << endl;
   cv::destroyAllWindows();
 }
@@ -37,6 +37,11 @@
  #include <dlib/image_processing.h>
  #include <dlib/image_processing/frontal_face_detector.h>
  #include "faceBlendCommon.hpp"
+#include "faceGallery.hpp"
+#include "faceIndex.hpp"
+#include "descriptorStore.hpp"
+#include "faceTracker.hpp"
+#include "faceQuality.hpp"
 
 // dirent.h is pre-included with *nix like systems
 // but not for Windows. So we are trying to include
@@ -62,7 +67,20 @@ using namespace cv;
 using namespace dlib;
 using namespace std;
 
+// model the descriptors are computed with, has to match the descriptor store
+#define FACE_MODEL_ID "openface.nn4.small2.v1"
+
+// quality gate, faces failing any of these thresholds are skipped
+#define MIN_INTER_EYE_DISTANCE 20  // pixels
+#define MIN_SHARPNESS 40           // variance of the Laplacian
+#define MAX_YAW 35                 // degrees
+#define MAX_PITCH 25               // degrees
+#define MIN_BRIGHTNESS 40          // mean gray level
+#define MAX_BRIGHTNESS 215         // mean gray level
+
 #define SKIP_FRAMES 1
+// frames after which the identity of a face track is computed again
+#define REVERIFY_FRAMES 15
 #define recThreshold 0.8
 
 
@@ -75,100 +93,28 @@ void printVector(std::vector<T>& vec) {
   cout << endl;
 }
 
-// read names and labels mapping from file
-static void readLabelNameMap(const string& filename, std::vector<string>& names, std::vector<int>& labels,
-                             std::map<int, string>& labelNameMap, char separator = ';') {
-  std::ifstream file(filename.c_str(), ifstream::in);
-  if (!file) {
-    string error_message = "No valid input file was given, please check the given filename.";
-    CV_Error(CV_StsBadArg, error_message);
-  }
-  string line;
-  string name, labelStr;
-  // read lines from file one by one
-  while (getline(file, line)) {
-    stringstream liness(line);
-    // read first word which is person name
-    getline(liness, name, separator);
-    // read second word which is integer label
-    getline(liness, labelStr);
-    if(!name.empty() && !labelStr.empty()) {
-      names.push_back(name);
-      // convert label from string format to integer
-      int label = atoi(labelStr.c_str());
-      labels.push_back(label);
-      // add (integer label, person name) pair to map
-      labelNameMap[label] = name;
-    }
-  }
-}
-
-// read descriptors saved on disk
-static void readDescriptors(const string& filename, std::vector<int>& faceLabels, std::vector<Mat>& faceDescriptors, char separator = ';') {
-  std::ifstream file(filename.c_str(), ifstream::in);
-  if (!file) {
-    string error_message = "No valid input file was given, please check the given filename.";
-    CV_Error(CV_StsBadArg, error_message);
-  }
-  // each line has:
-  // 1st element = face label
-  // rest 128 elements = descriptor elements
-  string line;
-  string faceLabel;
-  // valueStr = one element of descriptor in string format
-  // value = one element of descriptor in float
-  string valueStr;
-  float value;
-  std::vector<float> faceDescriptorVec;
-  // read lines from file one by one
-  while (getline(file, line)) {
-    stringstream liness(line);
-    // read face label
-    // read first word on a line till separator
-    getline(liness, faceLabel, separator);
-    if(!faceLabel.empty()) {
-      faceLabels.push_back(std::atoi(faceLabel.c_str()));
-    }
-
-    faceDescriptorVec.clear();
-    // read rest of the words one by one using separator
-    while (getline(liness, valueStr, separator)) {
-      if (!valueStr.empty()) {
-        // convert descriptor element from string to float
-        faceDescriptorVec.push_back(atof(valueStr.c_str()));
-      }
-    }
-
-    // convert face descriptor from vector of float to Dlib's matrix format
-    Mat faceDescriptor(faceDescriptorVec);
-    faceDescriptors.push_back(faceDescriptor.clone());
-  }
-}
-
-// find nearest face descriptor from vector of enrolled faceDescriptor
+// find nearest face descriptor in the index
 // to a query face descriptor
-void nearestNeighbor(Mat& faceDescriptorQuery,
-                    std::vector<Mat>& faceDescriptors,
-                    std::vector<int>& faceLabels, int& label, float& minDistance) {
-  int minDistIndex = 0;
+void nearestNeighbor(Mat& faceDescriptorQuery, FaceIndex& index, int& label, float& minDistance) {
   minDistance = 1.0;
   label = -1;
   // Calculate Euclidean distances between face descriptor calculated on face dectected
-  // in current frame with all the face descriptors we calculated while enrolling faces
-  // Calculate minimum distance and index of this face
-  for (int i = 0; i < faceDescriptors.size(); i++) {
-    double distance = cv::norm(faceDescriptors[i].t() - faceDescriptorQuery);
-    if (distance < minDistance) {
-      minDistance = distance;
-      minDistIndex = i;
-    }
+  // in current frame with the face descriptors we calculated while enrolling faces
+  // and keep the closest one
+  std::vector<std::vector<FaceMatch>> matches;
+  index.search(faceDescriptorQuery.reshape(1, 1), 1, matches);
+  if (matches[0].empty()) {
+    return;
   }
+  // capped at 1.0 like the linear scan this replaced, which started from 1.0
+  minDistance = std::min(matches[0][0].distance, 1.0f);
+
   // if minimum distance is greater than a threshold
   // assign integer label -1 i.e. unknown face
   if (minDistance > recThreshold){
     label = -1;
   } else {
-    label = faceLabels[minDistIndex];
+    label = matches[0][0].label;
   }
 }
 
@@ -182,19 +128,31 @@ int main(int argc, const char** argv) {
   dlib::deserialize("../data/models/shape_predictor_5_face_landmarks.dat") >> landmarkDetector;
 
 
-  // read names, labels and labels-name-mapping from file
+  // open the descriptor store written at enrollment. It is memory mapped,
+  // so enrolled descriptors are used in place without parsing or copying
+  const string faceDescriptorFile = "descriptors_openface.bin";
+  DescriptorStore descriptorStore;
+  descriptorStore.open(faceDescriptorFile, FACE_MODEL_ID);
+
+  // read names, labels and labels-name-mapping from the store
   std::map<int, string> labelNameMap;
   std::vector<string> names;
   std::vector<int> labels;
-  const string labelNameFile = "label_name_openface.txt";
-  readLabelNameMap(labelNameFile, names, labels, labelNameMap);
-
-  // read descriptors of enrolled faces from file
-  const string faceDescriptorFile = "descriptors_openface.csv";
-  std::vector<int> faceLabels;
-  std::vector<Mat> faceDescriptors;
-  readDescriptors(faceDescriptorFile, faceLabels, faceDescriptors);
-  printVector(faceDescriptors);
+  descriptorStore.readNames(names, labels, labelNameMap);
+
+  // descriptors of enrolled faces
+  FaceGallery gallery;
+  cv::Ptr<FaceIndex> faceIndex;
+  if (descriptorStore.dtype() == DESCRIPTOR_FLOAT32) {
+    gallery = descriptorStore.gallery();
+    // use the approximate index built by enrollOpenFace
+    // if there is one, otherwise search all descriptors
+    const string faceIndexFile = "descriptors_openface.hnsw";
+    faceIndex = loadFaceIndex(faceIndexFile, gallery, descriptorStore.checksum());
+  } else {
+    // int8 and float16 descriptors are searched in place
+    faceIndex = descriptorStore.quantizedIndex();
+  }
   // Create a VideoCapture object
 
   VideoCapture cap;
@@ -206,6 +164,13 @@ int main(int argc, const char** argv) {
     return 1;
   }
 
+  // face tracks carrying the identity of the faces between recognitions
+  FaceTracker faceTracker(REVERIFY_FRAMES);
+  // faces below these thresholds are not recognized until they get better
+  FaceQualityThresholds qualityThresholds(MIN_INTER_EYE_DISTANCE, MIN_SHARPNESS, MAX_YAW, MAX_PITCH,
+                                          MIN_BRIGHTNESS, MAX_BRIGHTNESS);
+  FaceQualityReport totalQualityReport;
+
   int count = 0;
   double t = cv::getTickCount();
 
@@ -228,25 +193,68 @@ int main(int argc, const char** argv) {
 
       // detect faces in image
       std::vector<dlib::rectangle> faceRects = faceDetector(imDlib);
+
+      // follow faces from frame to frame, a person's track keeps its identity
+      std::vector<cv::Rect> faceBoxes(faceRects.size());
+      for (int i = 0; i < faceRects.size(); i++) {
+        faceBoxes[i] = cv::Rect(faceRects[i].left(), faceRects[i].top(), faceRects[i].width(), faceRects[i].height());
+      }
+      std::vector<int> faceTracks;
+      faceTracker.update(faceBoxes, count, faceTracks);
+
+      FaceQualityReport qualityReport;
+      // text drawn next to each face
+      std::vector<string> texts;
       // Now process each face we found
       for (int i = 0; i < faceRects.size(); i++) {
         cout << faceRects.size() << " Face(s) Found" << endl;
 
-        Mat alignedFace;
-        alignFace(im, alignedFace, faceRects[i], landmarkDetector, cv::Size(96, 96));
-        cv::Mat blob = dnn::blobFromImage(alignedFace, 1.0/255, cv::Size(96, 96), Scalar(0,0,0), false, false);
-        recModel.setInput(blob);
-        Mat faceDescriptorQuery = recModel.forward();
-
-        // Find closest face enrolled to face found in frame
-        int label;
-        float minDistance;
-        nearestNeighbor(faceDescriptorQuery, faceDescriptors, faceLabels, label, minDistance);
+        full_object_detection landmarks = landmarkDetector(imDlib, faceRects[i]);
+        FaceQuality quality = assessFaceQuality(im, landmarks, qualityThresholds);
+        qualityReport.add(quality);
+        totalQualityReport.add(quality);
+
+        // Only faces of new tracks and of tracks due for re-verification are
+        // recognized, and only if they pass the quality gate. Others are
+        // deferred to a later frame. A track is re-verified early when the
+        // quality of its face becomes clearly better.
+        if (quality.acceptable() && faceTracker.needsRecognition(faceTracks[i], quality.score, count)) {
+          Mat alignedFace;
+          alignFace(im, alignedFace, faceRects[i], landmarkDetector, cv::Size(96, 96));
+          cv::Mat blob = dnn::blobFromImage(alignedFace, 1.0/255, cv::Size(96, 96), Scalar(0,0,0), false, false);
+          recModel.setInput(blob);
+          Mat faceDescriptorQuery = recModel.forward();
+
+          // Find closest face enrolled to face found in frame
+          // and vote with it for the identity of its track
+          int queryLabel;
+          float queryDistance;
+          nearestNeighbor(faceDescriptorQuery, *faceIndex, queryLabel, queryDistance);
+          faceTracker.addRecognition(faceTracks[i], queryLabel, queryDistance, quality.score, count);
+        }
+
+        // identity voted by the face's track
+        const FaceTrack& track = faceTracker.track(faceTracks[i]);
+        int label = track.label;
+        float minDistance = track.distance;
         // Name of recognized person from map
         string name = labelNameMap[label];
+        if (track.lastVerified < 0) {
+          name = "skipped: " + faceQualityIssues(quality.issues);
+        }
 
         cout << "Time taken = " << ((double)cv::getTickCount() - t)/cv::getTickFrequency() << endl;
 
+        // Write text specifying identified person and minimum distance
+        stringstream stream;
+        stream << name << " ";
+        stream << fixed << setprecision(4) << minDistance;
+        texts.push_back(stream.str());
+      }
+
+      // annotate only after every face is measured, so quality and
+      // alignment of later faces do not see the drawings of earlier ones
+      for (int i = 0; i < faceRects.size(); i++) {
         // Draw a rectangle for detected face
         Point2d p1 = Point2d(faceRects[i].left(), faceRects[i].top());
         Point2d p2 = Point2d(faceRects[i].right(), faceRects[i].bottom());
@@ -258,12 +266,11 @@ int main(int argc, const char** argv) {
         int radius = static_cast<int> ((faceRects[i].bottom() - faceRects[i].top())/2.0);
         cv::circle(im, center, radius, Scalar(0, 255, 0), 1, LINE_8);
 
-        // Write text on image specifying identified person and minimum distance
-        stringstream stream;
-        stream << name << " ";
-        stream << fixed << setprecision(4) << minDistance;
-        string text = stream.str();
-        cv::putText(im, text, p1, FONT_HERSHEY_SIMPLEX, 0.8, Scalar(255, 0, 0), 2);
+        cv::putText(im, texts[i], p1, FONT_HERSHEY_SIMPLEX, 0.8, Scalar(255, 0, 0), 2);
+      }
+
+      if (qualityReport.skipped() > 0) {
+        cout << "frame " << count << ": " << qualityReport.summary() << endl;
       }
 
       // Show result
@@ -277,5 +284,7 @@ int main(int argc, const char** argv) {
   // Counter used for skipping frames
   count += 1;
   }
+  cout << faceTracker.recognitions() << " of " << faceTracker.faces() << " faces went through the network" << endl;
+  cout << "quality gate: " << totalQualityReport.summary() << endl;
   cv::destroyAllWindows();
 }
@@ -0,0 +1,81 @@
+/*
+ Copyright 2017 BIG VISION LLC ALL RIGHTS RESERVED
+
+ This program is distributed WITHOUT ANY WARRANTY to the
+ students of the online course titled
+
+ "Computer Visionfor Faces" by Satya Mallick
+
+ for personal non-commercial use.
+
+ Sharing this code is strictly prohibited without written
+ permission from Big Vision LLC.
+
+ For licensing and other inquiries, please email
+ spmallick@bigvisionllc.com
+
+ */
+
+#ifndef BIGVISION_workQueue_HPP_
+#define BIGVISION_workQueue_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Bounded queue passing work between the threads of a pipeline.
+// push() blocks while the queue is full, so a fast producer cannot run
+// ahead of its consumer and fill the memory. Producers call close() when
+// they are done; pop() then drains the remaining items and returns false.
+template <typename T>
+class WorkQueue {
+public:
+  WorkQueue(size_t capacity) : capacity(capacity), numProducers(1), closed(false) {
+  }
+
+  // number of producers that have to call close() before the queue closes
+  void setProducers(int producers) {
+    std::lock_guard<std::mutex> lock(mutex);
+    numProducers = producers;
+  }
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+
+  // Returns false once the queue is closed and empty.
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--numProducers <= 0) {
+      closed = true;
+      notEmpty.notify_all();
+    }
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::deque<T> items;
+  size_t capacity;
+  int numProducers;
+  bool closed;
+};
+
+#endif // BIGVISION_workQueue_HPP_
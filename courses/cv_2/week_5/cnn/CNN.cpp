@@ -1,13 +1,21 @@
 #include <stdint.h>
 #include <torch/torch.h>
+#include <torch/script.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <string>
+#include <thread>
 #include <vector>
 #include <opencv2/core/core.hpp>
 #include <opencv2/opencv.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include "read-mnist.h"
+#include "quantize.h"
+#include "profiler.h"
 
 struct Options {
   int batchSize = 256; //Batch size
@@ -21,46 +29,75 @@ struct Options {
   const char* testImagesPath = "t10k-images-idx3-ubyte";
   const char* testLabelsPath = "t10k-labels-idx1-ubyte";
   torch::DeviceType device = torch::kCPU;
+  //Data pipeline: batches are gathered and augmented by worker threads, up
+  //to prefetchBatches ahead of the training step
+  size_t workers = 2;
+  size_t prefetchBatches = 4;
+  AugmentOptions augment; //random affine and flip, training data only
+  //Per-phase timings, one JSON line per epoch, and a Chrome trace if
+  //tracePath is not empty
+  std::string metricsPath = "metrics.jsonl";
+  std::string tracePath = "";
+  TrainingProfiler profiler;
+  //Evaluate and checkpoint a snapshot of the weights on a background thread
+  //while the next epoch trains, with evalThreads intra-op threads taken
+  //from the training budget
+  bool overlapEvaluation = true;
+  int evalThreads = 2;
+  //Keep the conv weights and the images in channels last (NHWC) order, which
+  //the CPU convolution kernels run faster than NCHW. Checked against NCHW
+  //before training, and dropped if the results differ.
+  bool channelsLast = true;
+  //Batch sizes of the layout benchmark run after training on CPU, empty to skip
+  std::vector<int64_t> benchmarkBatchSizes = {1, 32, 256};
 };
 
 static Options options;
 
-//Read images from ubyte format and convert to tensors
+//Map images in ubyte format as uint8 tensors, normalized by gather_mnist_batch
 torch::Tensor process_images(const std::string& root, bool train) {
   const auto path = root + (train ? options.trainImagesPath: options.testImagesPath); //images_path
-  auto images = read_mnist_images(path);
+  auto images = read_mnist_images_mapped(path);
 
   return images;
 }
 
-//Read labels from ubyte format and convert to tensors
+//Map labels in ubyte format as uint8 tensors
 torch::Tensor process_labels(const std::string& root, bool train) {
   const auto path = root + (train ? options.trainLabelsPath: options.testLabelsPath); //labels_path
-  auto labels = read_mnist_labels(path);
+  auto labels = read_mnist_labels_mapped(path);
 
   return labels;
 }
 
 
-//Use CustomDataset class to load any type of dataset other than inbuilt datasets
-class CustomDataset : public torch::data::datasets::Dataset<CustomDataset> {
+//Use CustomDataset class to load any type of dataset other than inbuilt datasets.
+//It is a BatchDataset: the data loader asks for a whole batch of indices at
+//once, so the batch is gathered in one go instead of sample by sample.
+class CustomDataset : public torch::data::datasets::BatchDataset<CustomDataset, torch::data::Example<>> {
   private:
-      // data should be 2 tensors
+      // data should be 2 uint8 tensors over the mapped files
       torch::Tensor images, labels;
       size_t img_size;
+      AugmentOptions augment;
   public:
-      CustomDataset(const std::string& root, bool train) {
+      CustomDataset(const std::string& root, bool train, AugmentOptions augment = AugmentOptions())
+          : augment(augment) {
           images = process_images(root, train);
           labels = process_labels(root, train);
+          TORCH_CHECK(labels.size(0) == images.size(0), "Image and label files of ", root, " hold ",
+                      images.size(0), " images and ", labels.size(0), " labels");
           img_size = images.size(0);
       }
 
-      //Returns the data sample at the given `index
-      torch::data::Example<> get(size_t index) override {
-          // This should return {torch::Tensor, torch::Tensor}
-          torch::Tensor img = images[index];
-          torch::Tensor label = labels[index];
-          return {img.clone(), label.clone()};
+      //Returns the float images and the labels at the given indices
+      //Runs on the data loader workers, so augmentation is done off the training thread
+      torch::data::Example<> get_batch(c10::ArrayRef<size_t> indices) override {
+          auto batch = gather_mnist_batch(images, labels, indices);
+          if (augment.enabled) {
+              batch.data = augment_batch(batch.data, augment);
+          }
+          return batch;
       };
 
     torch::optional<size_t> size() const override {
@@ -137,32 +174,145 @@ struct Net: torch::nn::Module {
     torch::nn::Linear fc1{nullptr}, fc2{nullptr}, fc3{nullptr};
 };
 
+//Net for CPU inference with int8 fc1-fc3 (see quantize.h). The convolutions
+//are shared with the trained Net and stay in float, dropout is left out as
+//in eval mode.
+struct QuantizedNet : torch::nn::Module {
+    explicit QuantizedNet(Net& net) {
+        conv1_1 = register_module("conv1_1", net.conv1_1);
+        conv1_2 = register_module("conv1_2", net.conv1_2);
+        conv2_1 = register_module("conv2_1", net.conv2_1);
+        conv2_2 = register_module("conv2_2", net.conv2_2);
+        conv3_1 = register_module("conv3_1", net.conv3_1);
+        conv3_2 = register_module("conv3_2", net.conv3_2);
+        fc1 = register_module("fc1", DynamicQuantizedLinear(net.fc1));
+        fc2 = register_module("fc2", DynamicQuantizedLinear(net.fc2));
+        fc3 = register_module("fc3", DynamicQuantizedLinear(net.fc3));
+    }
+
+    torch::Tensor forward(torch::Tensor x) {
+        x = torch::relu(conv1_1->forward(x));
+        x = torch::relu(conv1_2->forward(x));
+        x = torch::max_pool2d(x, 2);
+
+        x = torch::relu(conv2_1->forward(x));
+        x = torch::relu(conv2_2->forward(x));
+        x = torch::max_pool2d(x, 2);
+
+        x = torch::relu(conv3_1->forward(x));
+        x = torch::relu(conv3_2->forward(x));
+        x = torch::max_pool2d(x, 2);
+
+        x = x.view({-1, 64});
+
+        x = torch::relu(fc1->forward(x));
+        x = torch::relu(fc2->forward(x));
+        x = fc3->forward(x);
+
+        return torch::log_softmax(x, 1);
+    }
+
+    torch::nn::Conv2d conv1_1{nullptr}, conv1_2{nullptr};
+    torch::nn::Conv2d conv2_1{nullptr}, conv2_2{nullptr};
+    torch::nn::Conv2d conv3_1{nullptr}, conv3_2{nullptr};
+    DynamicQuantizedLinear fc1{nullptr}, fc2{nullptr}, fc3{nullptr};
+};
+
+//Net::forward in TorchScript, for the exported module. The parameters of
+//Net are attributes named after them with '_' for '.', dropout is left out
+//as in eval mode and the batch size is taken from the input.
+static const char* scriptedForward = R"JIT(
+def forward(self, x):
+    x = torch.relu(torch.conv2d(x, self.conv1_1_weight, self.conv1_1_bias, [1, 1], [1, 1]))
+    x = torch.relu(torch.conv2d(x, self.conv1_2_weight, self.conv1_2_bias))
+    x = torch.max_pool2d(x, [2, 2])
+    x = torch.relu(torch.conv2d(x, self.conv2_1_weight, self.conv2_1_bias, [1, 1], [1, 1]))
+    x = torch.relu(torch.conv2d(x, self.conv2_2_weight, self.conv2_2_bias))
+    x = torch.max_pool2d(x, [2, 2])
+    x = torch.relu(torch.conv2d(x, self.conv3_1_weight, self.conv3_1_bias, [1, 1], [1, 1]))
+    x = torch.relu(torch.conv2d(x, self.conv3_2_weight, self.conv3_2_bias))
+    x = torch.max_pool2d(x, [2, 2])
+    x = x.flatten(1)
+    x = torch.relu(torch.linear(x, self.fc1_weight, self.fc1_bias))
+    x = torch.relu(torch.linear(x, self.fc2_weight, self.fc2_bias))
+    x = torch.linear(x, self.fc3_weight, self.fc3_bias)
+    return torch.log_softmax(x, 1)
+)JIT";
+
+//Export the trained network as a frozen TorchScript module optimized for
+//CPU inference, which inferCNN loads with torch::jit::load. The export is
+//checked against the network on a batch of random images.
+void export_torchscript(std::shared_ptr<Net> network, const std::string& path) {
+  torch::NoGradGuard no_grad;
+  network->eval();
+  torch::jit::Module module("Net");
+  for (const auto& parameter : network->named_parameters()) {
+    std::string name = parameter.key();
+    std::replace(name.begin(), name.end(), '.', '_');
+    module.register_parameter(name, parameter.value().detach().to(torch::kCPU).clone(), false);
+  }
+  module.define(scriptedForward);
+  module.eval();
+  torch::jit::Module frozen = torch::jit::freeze(module);
+  frozen = torch::jit::optimize_for_inference(frozen);
+  frozen.save(path);
+
+  auto images = torch::rand({8, 1, 28, 28});
+  auto expected = network->forward(images.to(options.device)).to(torch::kCPU);
+  auto exported = torch::jit::load(path).forward({images}).toTensor();
+  std::cout << "TorchScript module saved to " << path << ", max difference to Net: "
+            << (exported - expected).abs().max().item<float>() << std::endl;
+}
+
+//Memory format of the images and of the conv weights
+torch::MemoryFormat memory_format() {
+  return options.channelsLast ? torch::MemoryFormat::ChannelsLast : torch::MemoryFormat::Contiguous;
+}
+
+//Put the 4-d parameters (conv weights) of network in format. The parameters
+//stay the same tensors, so optimizers holding them are not affected.
+void set_memory_format(torch::nn::Module& network, torch::MemoryFormat format) {
+  torch::NoGradGuard no_grad;
+  for (auto& parameter : network.parameters()) {
+    if (parameter.dim() == 4) {
+      parameter.set_data(parameter.contiguous(format));
+    }
+  }
+}
+
 template <typename DataLoader>
 void train(std::shared_ptr<Net> network, DataLoader& loader, torch::optim::Optimizer& optimizer, size_t epoch, size_t data_size) {
   size_t index = 0;
   //Set network in the training mode
   network->train();
   float Loss = 0, Acc = 0;
+  EpochProfile profile(options.profiler, "train", epoch, options.device);
 
   for (auto& batch : loader) {
-    auto data = batch.data.to(options.device);
+    profile.mark(Phase::Data);
+    auto data = batch.data.to(options.device).contiguous(memory_format());
     auto targets = batch.target.to(options.device).view({-1});
+    profile.mark(Phase::Copy);
     // Execute the model on the input data
     auto output = network->forward(data);
 
     //Using mean square error loss function to compute loss
     auto loss = torch::nll_loss(output, targets);
     auto acc = output.argmax(1).eq(targets).sum();
+    profile.mark(Phase::Forward);
 
     // Reset gradients
     optimizer.zero_grad();
     // Compute gradients
     loss.backward();
+    profile.mark(Phase::Backward);
     //Update the parameters
     optimizer.step();
 
     Loss += loss.template item<float>();
     Acc += acc.template item<float>();
+    profile.mark(Phase::Step);
+    profile.add_samples(targets.size(0));
   }
 
   if (index++ % options.logInterval == 0) {
@@ -173,6 +323,7 @@ void train(std::shared_ptr<Net> network, DataLoader& loader, torch::optim::Optim
               << "\tLoss: " << Loss / end << "\tAcc: " << Acc / end
               << std::endl;
   }
+  profile.finish({{"loss", Loss / data_size}, {"accuracy", Acc / data_size}});
 };
 
 
@@ -182,10 +333,13 @@ void test(std::shared_ptr<Net> network, DataLoader& loader, size_t epoch, size_t
   size_t index = 0;
   float Loss = 0, Acc = 0;
   int display_count = 0;
+  EpochProfile profile(options.profiler, "test", epoch, options.device);
 
   for (const auto& batch : loader) {
-    auto data = batch.data.to(options.device);
+    profile.mark(Phase::Data);
+    auto data = batch.data.to(options.device).contiguous(memory_format());
     auto targets = batch.target.to(options.device).view({-1});
+    profile.mark(Phase::Copy);
 
     auto output = network->forward(data);
 
@@ -215,6 +369,8 @@ void test(std::shared_ptr<Net> network, DataLoader& loader, size_t epoch, size_t
 
     Loss += loss.template item<float>();
     Acc += acc.template item<float>();
+    profile.mark(Phase::Forward);
+    profile.add_samples(targets.size(0));
   }
 
   //This block can be used inside for loop to see the training within each epoch
@@ -223,9 +379,107 @@ void test(std::shared_ptr<Net> network, DataLoader& loader, size_t epoch, size_t
     std::cout << "Val Epoch: " << epoch
               << "\tVal Loss: " << Loss/data_size << "\tVal ACC:"<< Acc/data_size << std::endl;
   }
+  profile.finish({{"loss", Loss / data_size}, {"accuracy", Acc / data_size}});
 }
 
 
+//Copy the weights of network into snapshot, a Net of the same shape on the
+//same device, so it can be evaluated while network keeps training
+void copy_weights(const std::shared_ptr<Net>& network, std::shared_ptr<Net>& snapshot) {
+  torch::NoGradGuard no_grad;
+  auto parameters = network->named_parameters();
+  for (auto& parameter : snapshot->named_parameters()) {
+    parameter.value().copy_(parameters[parameter.key()]);
+  }
+  auto buffers = network->named_buffers();
+  for (auto& buffer : snapshot->named_buffers()) {
+    buffer.value().copy_(buffers[buffer.key()]);
+  }
+}
+
+//Net with the weights of network, its conv weights in format
+std::shared_ptr<Net> copy_in_format(const std::shared_ptr<Net>& network, torch::MemoryFormat format) {
+  auto copy = std::make_shared<Net>();
+  copy->to(options.device);
+  set_memory_format(*copy, format);
+  copy_weights(network, copy);
+  return copy;
+}
+
+//Compare outputs and weight gradients of network in format to NCHW on a
+//batch of random images, true if they agree to float rounding
+bool check_memory_format(const std::shared_ptr<Net>& network, torch::MemoryFormat format) {
+  auto reference = copy_in_format(network, torch::MemoryFormat::Contiguous);
+  auto converted = copy_in_format(network, format);
+  reference->eval();
+  converted->eval();
+  auto images = torch::rand({16, 1, 28, 28}, torch::TensorOptions().device(options.device));
+  auto expected = reference->forward(images);
+  auto output = converted->forward(images.contiguous(format));
+  expected.sum().backward();
+  output.sum().backward();
+
+  float output_difference = (output - expected).abs().max().item<float>();
+  float gradient_difference = 0;
+  auto reference_parameters = reference->named_parameters();
+  for (const auto& parameter : converted->named_parameters()) {
+    auto difference = (parameter.value().grad() - reference_parameters[parameter.key()].grad()).abs().max();
+    gradient_difference = std::max(gradient_difference, difference.item<float>());
+  }
+  std::cout << "Channels last against NCHW, max difference of outputs: " << output_difference
+            << ", of gradients: " << gradient_difference << std::endl;
+  return output_difference < 1e-4 && gradient_difference < 1e-3;
+}
+
+//Images/sec of the forward pass and of forward plus backward for NCHW and
+//channels last, and of the frozen TorchScript module at path, whose
+//convolutions optimize_for_inference moved to the oneDNN blocked layout
+void benchmark_memory_formats(const std::shared_ptr<Net>& network, const std::string& scripted_path,
+                              const std::vector<int64_t>& batch_sizes) {
+  const int warmup = 2, repeats = 10;
+  auto time = [&](const std::function<void()>& run) {
+    for (int i = 0; i < warmup; i++) {
+      run();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; i++) {
+      run();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats;
+  };
+
+  std::cout << "Layout\tBatch\tForward img/s\tForward+backward img/s" << std::endl;
+  const std::vector<std::pair<std::string, torch::MemoryFormat>> formats = {
+    {"nchw", torch::MemoryFormat::Contiguous}, {"channels_last", torch::MemoryFormat::ChannelsLast}};
+  for (const auto& format : formats) {
+    auto copy = copy_in_format(network, format.second);
+    copy->train();
+    for (int64_t batch_size : batch_sizes) {
+      auto images = torch::rand({batch_size, 1, 28, 28}).contiguous(format.second);
+      double forward = time([&]() {
+        torch::NoGradGuard no_grad;
+        copy->forward(images);
+      });
+      double forward_backward = time([&]() {
+        copy->zero_grad();
+        copy->forward(images).sum().backward();
+      });
+      std::cout << format.first << "\t" << batch_size << "\t" << batch_size / forward << "\t"
+                << batch_size / forward_backward << std::endl;
+    }
+  }
+
+  if (at::hasMKLDNN()) {
+    torch::jit::Module module = torch::jit::load(scripted_path);
+    torch::NoGradGuard no_grad;
+    for (int64_t batch_size : batch_sizes) {
+      auto images = torch::rand({batch_size, 1, 28, 28});
+      double forward = time([&]() { module.forward({images}); });
+      std::cout << "mkldnn (TorchScript)\t" << batch_size << "\t" << batch_size / forward << "\t-" << std::endl;
+    }
+  }
+}
+
 int main() {
   //Use CUDA for computation if available
   if (torch::cuda::is_available())
@@ -235,41 +489,97 @@ int main() {
   //Path to Fashion Mnist
   std::string root_string = "./fashion-mnist/";
   bool isTrain = true; //Flag to create train or test data
+  options.augment.enabled = true;
 
-  //Uses Custom Dataset Class to load train data. Apply stack collation which takes
-  //batch of tensors and stacks them into single tensor along the first dimension
-  auto train_dataset = CustomDataset(root_string, isTrain).map(torch::data::transforms::Stack<>());
+  //Uses Custom Dataset Class to load train data. Its batches are single
+  //float tensors of the images stacked along the first dimension
+  auto train_dataset = CustomDataset(root_string, isTrain, options.augment);
+  auto train_size = train_dataset.size().value();
   //Data Loader provides options to speed up the data loading like batch size, number of workers
+  //and how many batches they may prepare ahead
+  auto loader_options = torch::data::DataLoaderOptions(options.batchSize)
+    .workers(options.workers).max_jobs(options.prefetchBatches);
   auto train_loader = torch::data::make_data_loader<torch::data::samplers::RandomSampler>(
-    std::move(train_dataset), options.batchSize);
-  auto train_size = train_dataset.size().value();
+    std::move(train_dataset), loader_options);
 
   //Process and load test dat similar to above
-  auto test_dataset = CustomDataset(root_string, false).map(torch::data::transforms::Stack<>());
-  auto test_loader = torch::data::make_data_loader<torch::data::samplers::RandomSampler>(
-    std::move(test_dataset), options.batchSize);
+  auto test_dataset = CustomDataset(root_string, false);
   auto test_size = test_dataset.size().value();
+  auto test_loader = torch::data::make_data_loader<torch::data::samplers::RandomSampler>(
+    std::move(test_dataset), loader_options);
 
   //Create Feed forward network
   auto net = std::make_shared<Net>();
   //Moving model parameters to correct device
   net->to(options.device);
+  if (options.channelsLast && !check_memory_format(net, torch::MemoryFormat::ChannelsLast)) {
+    std::cout << "Channels last differs from NCHW, training in NCHW" << std::endl;
+    options.channelsLast = false;
+  }
+  set_memory_format(*net, memory_format());
   // torch::load(net, "net.pt"); /*To use trained model*/
 
   options.loss_acc_train.open("loss_acc_train.txt");
   options.loss_acc_test.open("loss_acc_test.txt");
+  options.profiler.open(options.metricsPath, options.tracePath, options.workers);
 
   //Using Adam optimizer with beta1 as 0.5
   torch::optim::Adam optimizer(net->parameters(), torch::optim::AdamOptions(5e-4).beta1(0.5));
 
+  //With overlapped evaluation, the test set of epoch i runs on a snapshot
+  //while epoch i + 1 trains. One evaluation is in flight at a time: the next
+  //snapshot waits for it, which also keeps the test loader to one user.
+  std::shared_ptr<Net> snapshot;
+  std::future<void> evaluation;
+  int trainThreads = torch::get_num_threads();
+  if (options.overlapEvaluation) {
+    snapshot = copy_in_format(net, memory_format());
+    trainThreads = std::max(1, trainThreads - options.evalThreads);
+  }
+
   for (size_t i = 0; i < options.epochs; i++) {
     /*Run the training for all epochs*/
+    torch::set_num_threads(trainThreads);
     train(net, *train_loader, optimizer, i + 1, train_size);
     std::cout << std::endl;
-    /*Run on the validation set for all epochs*/
-    test(net, *test_loader, i+1, test_size);
-    /*Save the network*/
-    torch::save(net, "net.pt");
+    if (options.overlapEvaluation) {
+      if (evaluation.valid()) {
+        evaluation.get();
+      }
+      copy_weights(net, snapshot);
+      /*Run on the validation set and save the snapshot, metrics keep the epoch it was taken at*/
+      evaluation = std::async(std::launch::async, [&, i]() {
+        torch::set_num_threads(options.evalThreads);
+        test(snapshot, *test_loader, i + 1, test_size);
+        torch::save(snapshot, "net.pt");
+      });
+    } else {
+      /*Run on the validation set for all epochs*/
+      test(net, *test_loader, i+1, test_size);
+      /*Save the network*/
+      torch::save(net, "net.pt");
+    }
+  }
+  if (evaluation.valid()) {
+    evaluation.get();
+  }
+
+  //Frozen TorchScript module for deployment, see inferCNN
+  export_torchscript(net, "net_scripted.pt");
+
+  //Throughput of the memory layouts on CPU
+  if (options.device == torch::kCPU && !options.benchmarkBatchSizes.empty()) {
+    benchmark_memory_formats(net, "net_scripted.pt", options.benchmarkBatchSizes);
+  }
+
+  //Dynamic int8 quantization of the Linear layers for CPU-only deployment
+  if (torch::fbgemm_is_cpu_supported()) {
+    net->to(torch::kCPU);
+    auto quantized = std::make_shared<QuantizedNet>(*net);
+    torch::save(quantized, "net_quantized.pt");
+    report_quantization(net, "net.pt", quantized, "net_quantized.pt", *test_loader);
+  } else {
+    std::cout << "int8 quantization needs a CPU supported by fbgemm (AVX2), skipped" << std::endl;
   }
 
   return 0;
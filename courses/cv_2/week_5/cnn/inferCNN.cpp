@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <torch/script.h>
+#include <torch/torch.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "read-mnist.h"
+
+/*Standalone CPU inference with the TorchScript module exported by CNN.
+The module is loaded once and run on batches of images, read from
+  an idx file:  ./inferCNN net_scripted.pt fashion-mnist/t10k-images-idx3-ubyte
+  image files:  ./inferCNN net_scripted.pt a.png b.png ...
+  stdin:        ls *.png | ./inferCNN net_scripted.pt -
+Images files are read as grayscale and resized to 28x28. The number of images
+per batch and of intra-op threads are set with --batch and --threads.
+Reports per-batch latency and images per second.*/
+
+struct InferenceOptions {
+  int batchSize = 256;
+  int threads = 1;
+  int warmupBatches = 2; //not timed, lets the JIT executor settle
+};
+
+//Image file as a {1, 28, 28} float tensor in [0, 1]
+torch::Tensor read_image(const std::string& path) {
+  cv::Mat image = cv::imread(path, cv::IMREAD_GRAYSCALE);
+  if (image.empty()) {
+    throw std::runtime_error("Unable to read " + path);
+  }
+  cv::resize(image, image, cv::Size(28, 28), 0, 0, cv::INTER_AREA);
+  image.convertTo(image, CV_32F, 1.0 / 255);
+  return torch::from_blob(image.data, {1, 28, 28}, torch::kFloat32).clone();
+}
+
+double percentile(std::vector<double> values, double p) {
+  std::sort(values.begin(), values.end());
+  return values[std::min(static_cast<size_t>(p * values.size()), values.size() - 1)];
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: ./inferCNN net_scripted.pt <images-idx3-ubyte | image files... | -> "
+              << "[--batch N] [--threads N]" << std::endl;
+    return 1;
+  }
+  InferenceOptions options;
+  std::vector<std::string> inputs;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--batch" && i + 1 < argc) {
+      options.batchSize = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--threads" && i + 1 < argc) {
+      options.threads = std::max(1, atoi(argv[++i]));
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+  torch::set_num_threads(options.threads);
+
+  torch::jit::Module module = torch::jit::load(argv[1]);
+  module.eval();
+  torch::NoGradGuard no_grad;
+
+  //Images either stay in the mapped idx file or are read into one tensor
+  torch::Tensor mapped_images, no_labels;
+  std::vector<std::string> paths;
+  if (inputs.size() == 1 && inputs[0].find("idx3-ubyte") != std::string::npos) {
+    mapped_images = read_mnist_images_mapped(inputs[0]);
+    no_labels = torch::zeros(mapped_images.size(0), torch::kByte);
+  } else if (inputs.size() == 1 && inputs[0] == "-") {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+      if (!line.empty()) {
+        paths.push_back(line);
+      }
+    }
+  } else {
+    paths = inputs;
+  }
+  const int64_t num_images = mapped_images.defined() ? mapped_images.size(0) : static_cast<int64_t>(paths.size());
+  if (num_images == 0) {
+    std::cout << "No images given" << std::endl;
+    return 1;
+  }
+  std::cout << num_images << " images, batches of " << options.batchSize << ", "
+            << options.threads << " threads" << std::endl;
+
+  std::vector<double> latencies;
+  double total_seconds = 0;
+  int64_t timed_images = 0;
+  int batch_index = 0;
+  for (int64_t start = 0; start < num_images; start += options.batchSize, batch_index++) {
+    const int64_t end = std::min(start + options.batchSize, num_images);
+    torch::Tensor batch;
+    if (mapped_images.defined()) {
+      std::vector<size_t> indices;
+      for (int64_t i = start; i < end; i++) {
+        indices.push_back(i);
+      }
+      batch = gather_mnist_batch(mapped_images, no_labels, indices).data;
+    } else {
+      std::vector<torch::Tensor> images;
+      for (int64_t i = start; i < end; i++) {
+        images.push_back(read_image(paths[i]));
+      }
+      batch = torch::stack(images);
+    }
+
+    //only the forward pass is timed, not reading the images
+    auto t = std::chrono::steady_clock::now();
+    torch::Tensor output = module.forward({batch}).toTensor();
+    torch::Tensor predictions = output.argmax(1);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+
+    if (!paths.empty()) {
+      for (int64_t i = start; i < end; i++) {
+        std::cout << paths[i] << " " << predictions[i - start].item<int64_t>() << std::endl;
+      }
+    }
+    //the first batches are a warm up, unless there is nothing else
+    if (batch_index >= options.warmupBatches || (end == num_images && latencies.empty())) {
+      latencies.push_back(seconds * 1000);
+      total_seconds += seconds;
+      timed_images += end - start;
+    }
+  }
+
+  std::cout << "Batch latency: p50 " << percentile(latencies, 0.5) << " ms, p95 " << percentile(latencies, 0.95)
+            << " ms, p99 " << percentile(latencies, 0.99) << " ms over " << latencies.size() << " batches" << std::endl;
+  std::cout << "Throughput: " << timed_images / total_seconds << " images/sec" << std::endl;
+  return 0;
+}
@@ -0,0 +1,188 @@
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <torch/torch.h>
+#include <torch/cuda.h>
+
+#ifdef _WIN32
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+  #include <psapi.h>
+  #pragma comment(lib, "psapi.lib")
+#else
+  #include <sys/resource.h>
+#endif
+
+/*Per-phase profiling of the training and test loops
+The wall time of every batch is split into the phases below, by calling
+mark() at the end of each phase: the time since the previous mark goes to
+that phase. Every epoch gives one JSON line in the metrics file with the
+time per phase, samples/sec, peak RSS and the thread counts, and optionally
+one Chrome trace event per phase and batch (open the file in
+chrome://tracing or https://ui.perfetto.dev).
+CUDA kernels run asynchronously, so on the GPU the device is synchronized
+at every mark for the times to belong to the right phase.*/
+enum class Phase { Data, Copy, Forward, Backward, Step };
+
+static const char* phase_names[] = {"data", "copy", "forward", "backward", "step"};
+static const int num_phases = 5;
+
+//Peak resident set size of the process in KB
+long peak_rss_kb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return static_cast<long>(counters.PeakWorkingSetSize / 1024);
+    }
+    return -1;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; //bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+//Metrics and trace files, shared by all loops. Writes are serialized so
+//loops on different threads can report to the same profiler.
+class TrainingProfiler {
+public:
+    TrainingProfiler() : origin(std::chrono::steady_clock::now()) {}
+
+    ~TrainingProfiler() {
+        if (trace.is_open()) {
+            trace << "\n]" << std::endl;
+        }
+    }
+
+    //An empty trace_path disables the Chrome trace
+    void open(const std::string& metrics_path, const std::string& trace_path = "", size_t loader_workers = 0) {
+        metrics.open(metrics_path);
+        if (!trace_path.empty()) {
+            trace.open(trace_path);
+            //whole microseconds, the default precision turns long runs into exponents
+            trace << std::fixed << std::setprecision(0) << "[";
+        }
+        workers = loader_workers;
+    }
+
+    bool tracing() const {
+        return trace.is_open();
+    }
+
+    //Microseconds since the profiler was created, the time base of the trace
+    double now_us() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    void trace_event(const char* name, const std::string& stage, double start_us, double duration_us) {
+        std::lock_guard<std::mutex> lock(mutex);
+        trace << (first_event ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"cat\":\"" << stage
+              << "\",\"ph\":\"X\",\"ts\":" << start_us << ",\"dur\":" << duration_us
+              << ",\"pid\":1,\"tid\":" << thread_index() << "}";
+        first_event = false;
+    }
+
+    //One JSON line per epoch, followed by a short summary on the console
+    void write_epoch(const std::string& stage, size_t epoch, int64_t samples, double seconds,
+                     const double* phase_seconds, const std::vector<std::pair<std::string, double>>& values) {
+        std::ostringstream line;
+        line << "{\"stage\":\"" << stage << "\",\"epoch\":" << epoch << ",\"samples\":" << samples
+             << ",\"seconds\":" << seconds << ",\"samples_per_sec\":" << samples / seconds;
+        for (int i = 0; i < num_phases; i++) {
+            line << ",\"" << phase_names[i] << "_s\":" << phase_seconds[i];
+        }
+        for (const auto& value : values) {
+            line << ",\"" << value.first << "\":" << value.second;
+        }
+        line << ",\"peak_rss_kb\":" << peak_rss_kb() << ",\"intra_op_threads\":" << torch::get_num_threads()
+             << ",\"inter_op_threads\":" << torch::get_num_interop_threads() << ",\"loader_workers\":" << workers
+             << "}";
+
+        std::ostringstream summary;
+        summary << stage << " epoch " << epoch << ": " << seconds << " s, " << samples / seconds << " samples/s,";
+        for (int i = 0; i < num_phases; i++) {
+            if (phase_seconds[i] > 0) {
+                summary << " " << phase_names[i] << " " << 100 * phase_seconds[i] / seconds << "%";
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        metrics << line.str() << std::endl;
+        std::cout << summary.str() << std::endl;
+    }
+
+private:
+    //Small stable ids for the threads in the trace
+    int thread_index() {
+        auto id = std::this_thread::get_id();
+        auto found = threads.find(id);
+        if (found != threads.end()) {
+            return found->second;
+        }
+        int index = static_cast<int>(threads.size());
+        threads[id] = index;
+        return index;
+    }
+
+    std::chrono::steady_clock::time_point origin;
+    std::ofstream metrics, trace;
+    bool first_event = true;
+    size_t workers = 0;
+    std::map<std::thread::id, int> threads;
+    std::mutex mutex;
+};
+
+//Profile of one pass over a data loader, local to the loop that runs it
+class EpochProfile {
+public:
+    EpochProfile(TrainingProfiler& profiler, const std::string& stage, size_t epoch, torch::Device device)
+        : profiler(profiler), stage(stage), epoch(epoch), device(device) {
+        start_us = last_us = profiler.now_us();
+    }
+
+    //Ends phase and starts the next one
+    void mark(Phase phase) {
+        if (device.is_cuda()) {
+            torch::cuda::synchronize(device.index());
+        }
+        double now = profiler.now_us();
+        phase_seconds[static_cast<int>(phase)] += (now - last_us) / 1e6;
+        if (profiler.tracing()) {
+            profiler.trace_event(phase_names[static_cast<int>(phase)], stage, last_us, now - last_us);
+        }
+        last_us = now;
+    }
+
+    void add_samples(int64_t count) {
+        samples += count;
+    }
+
+    //Reports the epoch with extra values such as loss and accuracy
+    void finish(const std::vector<std::pair<std::string, double>>& values = {}) {
+        double seconds = (profiler.now_us() - start_us) / 1e6;
+        profiler.write_epoch(stage, epoch, samples, seconds, phase_seconds, values);
+    }
+
+private:
+    TrainingProfiler& profiler;
+    std::string stage;
+    size_t epoch;
+    torch::Device device;
+    double start_us, last_us;
+    double phase_seconds[num_phases] = {0, 0, 0, 0, 0};
+    int64_t samples = 0;
+};
@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <ATen/core/dispatch/Dispatcher.h>
+#include <torch/torch.h>
+
+/*Dynamic int8 quantization of Linear layers for CPU inference
+The weights of a trained Linear layer are quantized once to int8. The input
+is quantized on the fly for every batch, from its own range (dynamic
+quantization), and the product runs on the int8 fbgemm kernels, accumulating
+in int32. The output is float, so the layer replaces torch::nn::Linear as is.
+The quantized::linear_prepack and quantized::linear_dynamic operators are
+called through the dispatcher, as torch.nn.quantized.dynamic.Linear does,
+which needs libtorch 1.5 or newer.
+fbgemm needs a CPU with AVX2, check torch::fbgemm_is_cpu_supported() first.*/
+struct DynamicQuantizedLinearImpl : torch::nn::Module {
+    explicit DynamicQuantizedLinearImpl(const torch::nn::Linear& linear) {
+        auto weight = linear->weight.detach().to(torch::kCPU).contiguous();
+        //Symmetric per tensor int8 weights, the default of the dynamic quantization in PyTorch
+        double weight_scale = std::max(weight.abs().max().item<double>(), 1e-8) / 127;
+        auto quantized = torch::quantize_per_tensor(weight, weight_scale, 0, torch::kQInt8);
+        //Saved as plain int8 values and scale, the quantized tensor is rebuilt by pack()
+        qweight = register_buffer("qweight", quantized.int_repr());
+        scale = register_buffer("scale", torch::tensor(weight_scale, torch::kFloat64));
+        bias = register_buffer("bias", linear->bias.detach().to(torch::kCPU).clone());
+        pack();
+    }
+
+    //Weights in the layout of the fbgemm kernels. The packed weights are not
+    //saved with the module, call pack() again after torch::load.
+    void pack() {
+        static const auto prepack =
+            c10::Dispatcher::singleton().findSchemaOrThrow("quantized::linear_prepack", "");
+        auto weight = torch::_make_per_tensor_quantized_tensor(qweight, scale.item<double>(), 0);
+        std::vector<c10::IValue> stack{weight, bias};
+        prepack.callBoxed(&stack);
+        packed = stack.at(0);
+    }
+
+    torch::Tensor forward(torch::Tensor x) {
+        static const auto linear_dynamic =
+            c10::Dispatcher::singleton().findSchemaOrThrow("quantized::linear_dynamic", "");
+        //reduce_range as in PyTorch, 7 bit inputs keep the fbgemm int16 accumulation from saturating
+        std::vector<c10::IValue> stack{x.contiguous(), packed, true};
+        linear_dynamic.callBoxed(&stack);
+        return stack.at(0).toTensor();
+    }
+
+    torch::Tensor qweight, scale, bias;
+    c10::IValue packed;
+};
+TORCH_MODULE(DynamicQuantizedLinear);
+
+//Load a model with DynamicQuantizedLinear layers saved with torch::save
+template <typename Model>
+void load_quantized(Model& model, const std::string& path) {
+    torch::load(model, path);
+    for (auto& module : model->modules()) {
+        if (auto* linear = module->template as<DynamicQuantizedLinearImpl>()) {
+            linear->pack();
+        }
+    }
+}
+
+long file_size(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    return file ? static_cast<long>(file.tellg()) : -1;
+}
+
+struct InferenceStats {
+    double accuracy;
+    double ms_per_batch;
+};
+
+//Accuracy and mean latency per batch of model on the CPU, over a data loader
+template <typename Model, typename DataLoader>
+InferenceStats evaluate_cpu(Model& model, DataLoader& loader) {
+    torch::NoGradGuard no_grad;
+    model->eval();
+    double correct = 0, count = 0, seconds = 0;
+    int batches = 0;
+    for (const auto& batch : loader) {
+        auto targets = batch.target.view({-1});
+        auto start = std::chrono::steady_clock::now();
+        auto output = model->forward(batch.data);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        correct += output.argmax(1).eq(targets).sum().template item<float>();
+        count += targets.size(0);
+        batches++;
+    }
+    return {correct / count, 1000 * seconds / batches};
+}
+
+//Compare the fp32 and the quantized model on the same data and print
+//accuracy, size of the saved model and latency per batch of both
+template <typename Model, typename QuantizedModel, typename DataLoader>
+void report_quantization(Model& model, const std::string& model_path, QuantizedModel& quantized,
+                         const std::string& quantized_path, DataLoader& loader) {
+    InferenceStats fp32 = evaluate_cpu(model, loader);
+    InferenceStats int8 = evaluate_cpu(quantized, loader);
+    std::cout << "Model\tAccuracy\tSize KB\tms/batch" << std::endl;
+    std::cout << "fp32\t" << fp32.accuracy << "\t" << file_size(model_path) / 1024 << "\t" << fp32.ms_per_batch << std::endl;
+    std::cout << "int8\t" << int8.accuracy << "\t" << file_size(quantized_path) / 1024 << "\t" << int8.ms_per_batch
+              << std::endl;
+    std::cout << "Accuracy delta: " << int8.accuracy - fp32.accuracy
+              << ", speedup: " << fp32.ms_per_batch / int8.ms_per_batch << "x" << std::endl;
+}
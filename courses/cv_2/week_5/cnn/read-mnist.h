@@ -1,6 +1,25 @@
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 #include <torch/torch.h>
 
+#ifdef _WIN32
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
 uint32_t swap_endian(uint32_t val) {
     val = ((val << 8) & 0xFF00FF00) | ((val >> 8) & 0xFF00FF);
     return (val << 16) | (val >> 16);
@@ -63,4 +82,197 @@ torch::Tensor read_mnist_labels(const std::string& label_filename) {
     auto tensor = torch::empty(num_labels, torch::kByte);
     label_file.read(reinterpret_cast<char*>(tensor.data_ptr()), num_labels);
     return tensor.to(torch::kInt64);
-}
\ No newline at end of file
+}
+
+/*Memory mapped idx files
+read_mnist_images keeps the whole dataset in RAM as float, 4 times the size
+of the file. The functions below map the idx file instead and return uint8
+tensors that point into the mapping, so pixels are only paged in when a
+batch uses them. Pages are mapped copy-on-write: writing to the tensors never
+changes the file. The mapping is released with the last tensor using it.
+Convert to float with gather_mnist_batch when the batch is assembled.*/
+class MappedIdxFile {
+  public:
+    explicit MappedIdxFile(const std::string& filename) : data(nullptr), size(0) {
+#ifdef _WIN32
+        file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_handle == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Unable to open " + filename);
+        }
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file_handle, &file_size);
+        mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping_handle != NULL) {
+            data = static_cast<uint8_t*>(MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0));
+        }
+        size = static_cast<size_t>(file_size.QuadPart);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Unable to open " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapped = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<uint8_t*>(mapped);
+                size = st.st_size;
+            }
+        }
+        // the mapping stays valid after the descriptor is closed
+        ::close(fd);
+#endif
+        if (data == nullptr) {
+            throw std::runtime_error("Unable to map " + filename);
+        }
+    }
+
+    ~MappedIdxFile() {
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+        CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+#else
+        munmap(data, size);
+#endif
+    }
+
+    MappedIdxFile(const MappedIdxFile&) = delete;
+    MappedIdxFile& operator=(const MappedIdxFile&) = delete;
+
+    //Big endian 32 bit value of the header at byte offset
+    uint32_t header(size_t offset) const {
+        uint32_t value;
+        std::memcpy(&value, data + offset, 4);
+        return swap_endian(value);
+    }
+
+    uint8_t* data;
+    size_t size;
+
+  private:
+#ifdef _WIN32
+    HANDLE file_handle;
+    HANDLE mapping_handle;
+#endif
+};
+
+//kByte tensor of the given shape over the mapping, starting at byte offset.
+//The tensor keeps the mapping alive. The sizes come from the file header,
+//so every one is checked against the bytes left before it is multiplied in,
+//which keeps the element count from overflowing.
+torch::Tensor mapped_tensor(std::shared_ptr<MappedIdxFile> file, size_t offset, std::vector<int64_t> sizes) {
+    if (offset > file->size) {
+        throw std::runtime_error("Truncated idx file");
+    }
+    const uint64_t available = static_cast<uint64_t>(file->size - offset);
+    uint64_t numel = 1;
+    for (int64_t s : sizes) {
+        if (s < 0 || static_cast<uint64_t>(s) > file->size) {
+            throw std::runtime_error("Invalid dimension in idx file header");
+        }
+        if (s > 0 && numel > available / static_cast<uint64_t>(s)) {
+            throw std::runtime_error("Truncated idx file");
+        }
+        numel *= static_cast<uint64_t>(s);
+    }
+    return torch::from_blob(file->data + offset, sizes, [file](void*) {}, torch::kByte);
+}
+
+//Images as a {num_items, 1, rows, cols} uint8 tensor over the mapped file
+torch::Tensor read_mnist_images_mapped(const std::string& image_filename) {
+    auto file = std::make_shared<MappedIdxFile>(image_filename);
+    //2051 is magic number for images
+    if (file->size < 16 || file->header(0) != 2051) {
+        throw std::runtime_error("Incorrect image file magic in " + image_filename);
+    }
+    int64_t num_items = file->header(4);
+    int64_t rows = file->header(8);
+    int64_t cols = file->header(12);
+    return mapped_tensor(file, 16, {num_items, 1, rows, cols});
+}
+
+//Labels as a {num_labels} uint8 tensor over the mapped file
+torch::Tensor read_mnist_labels_mapped(const std::string& label_filename) {
+    auto file = std::make_shared<MappedIdxFile>(label_filename);
+    //2049 is magic number for labels
+    if (file->size < 8 || file->header(0) != 2049) {
+        throw std::runtime_error("Incorrect label file magic in " + label_filename);
+    }
+    int64_t num_labels = file->header(4);
+    return mapped_tensor(file, 8, {num_labels});
+}
+
+/*Batch of the images and labels at indices, for BatchDataset::get_batch.
+The selected uint8 images are gathered, converted to float and divided by
+255 in one pass, straight into the batch tensor, which is allocated once per
+batch. Labels are gathered as int64. No tensor is created per sample and
+only the batch being assembled is ever held as float.*/
+torch::data::Example<> gather_mnist_batch(const torch::Tensor& images, const torch::Tensor& labels,
+                                          c10::ArrayRef<size_t> indices) {
+    //the tensors are raw views of the mapped files, so nothing else bounds the reads below
+    TORCH_CHECK(labels.size(0) == images.size(0), "idx files hold ", images.size(0), " images but ",
+                labels.size(0), " labels");
+    for (size_t index : indices) {
+        TORCH_CHECK(index < static_cast<size_t>(images.size(0)), "sample index ", index, " out of range for ",
+                    images.size(0), " images");
+    }
+    std::vector<int64_t> sizes = images.sizes().vec();
+    sizes[0] = static_cast<int64_t>(indices.size());
+    auto batch_images = torch::empty(sizes, torch::kFloat32);
+    auto batch_labels = torch::empty(sizes[0], torch::kInt64);
+
+    const int64_t pixels = images[0].numel();
+    const float scale = 1.0f / 255;
+    const uint8_t* in = images.data_ptr<uint8_t>();
+    const uint8_t* label_in = labels.data_ptr<uint8_t>();
+    float* out = batch_images.data_ptr<float>();
+    int64_t* label_out = batch_labels.data_ptr<int64_t>();
+    at::parallel_for(0, sizes[0], 16, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            const uint8_t* image_in = in + indices[i] * pixels;
+            float* image_out = out + i * pixels;
+            for (int64_t j = 0; j < pixels; j++) {
+                image_out[j] = image_in[j] * scale;
+            }
+            label_out[i] = label_in[indices[i]];
+        }
+    });
+    return {batch_images, batch_labels};
+}
+
+/*Random augmentation of a whole batch of float images {n, channels, rows, cols}.
+Every image gets its own rotation, scale, shift and horizontal flip, but they
+are applied to the batch at once: one affine_grid and one grid_sample call
+with a {n, 2, 3} matrix of per-image transforms. Pixels moved in from outside
+the image are 0.*/
+struct AugmentOptions {
+    bool enabled = false;
+    double max_rotation = 10;   //degrees
+    double max_scale = 0.1;     //scale in [1 - max_scale, 1 + max_scale]
+    double max_shift = 0.1;     //fraction of the image size
+    bool flip = true;           //mirror half of the images horizontally
+};
+
+torch::Tensor augment_batch(const torch::Tensor& images, const AugmentOptions& augment) {
+    namespace F = torch::nn::functional;
+    const int64_t n = images.size(0);
+    auto uniform = [n]() { return torch::rand({n}).mul_(2).sub_(1); };
+
+    auto angle = uniform().mul_(augment.max_rotation * 3.14159265358979 / 180);
+    auto scale = uniform().mul_(augment.max_scale).add_(1);
+    //grid coordinates go from -1 to 1, so a shift of the whole image is 2
+    auto shift_x = uniform().mul_(2 * augment.max_shift);
+    auto shift_y = uniform().mul_(2 * augment.max_shift);
+    auto mirror = augment.flip ? torch::randint(0, 2, {n}).mul_(2).sub_(1).to(torch::kFloat32) : torch::ones({n});
+
+    auto cos = torch::cos(angle).div_(scale);
+    auto sin = torch::sin(angle).div_(scale);
+    auto theta = torch::stack({torch::stack({cos * mirror, -sin, shift_x}, 1),
+                               torch::stack({sin * mirror, cos, shift_y}, 1)}, 1);
+
+    auto grid = F::affine_grid(theta, images.sizes(), false);
+    return F::grid_sample(images, grid,
+                          F::GridSampleFuncOptions().mode(torch::kBilinear).padding_mode(torch::kZeros).align_corners(false));
+}
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <torch/torch.h>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -8,6 +9,8 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include "read-mnist.h"
+#include "quantize.h"
+#include "profiler.h"
 
 struct Options {
   int batchSize = 100; //Batch size
@@ -21,47 +24,64 @@ struct Options {
   const char* test_images_path = "t10k-images-idx3-ubyte";
   const char* test_labels_path = "t10k-labels-idx1-ubyte";
   torch::DeviceType device = torch::kCPU;
+  //Data pipeline: batches are gathered and augmented by worker threads, up
+  //to prefetchBatches ahead of the training step
+  size_t workers = 2;
+  size_t prefetchBatches = 4;
+  AugmentOptions augment; //random affine and flip, training data only
+  //Per-phase timings, one JSON line per epoch, and a Chrome trace if
+  //tracePath is not empty
+  std::string metricsPath = "metrics.jsonl";
+  std::string tracePath = "";
+  TrainingProfiler profiler;
 };
 
 static Options options;
 
-//Read images from ubyte format and convert to tensors
+//Map images in ubyte format as uint8 tensors, normalized by gather_mnist_batch
 torch::Tensor process_images(const std::string& root, bool train) {
   const auto path = root + (train ? options.train_images_path: options.test_images_path); //images_path
-  auto images = read_mnist_images(path);
+  auto images = read_mnist_images_mapped(path);
 
   return images;
 }
 
-//Read labels from ubyte format and convert to tensors
+//Map labels in ubyte format as uint8 tensors
 torch::Tensor process_labels(const std::string& root, bool train) {
   const auto path = root + (train ? options.train_labels_path: options.test_labels_path); //labels_path
-  auto labels = read_mnist_labels(path);
+  auto labels = read_mnist_labels_mapped(path);
 
   return labels;
 }
 
 
-//Use CustomDataset class to load any type of dataset other than inbuilt datasets
-class CustomDataset : public torch::data::datasets::Dataset<CustomDataset> {
+//Use CustomDataset class to load any type of dataset other than inbuilt datasets.
+//It is a BatchDataset: the data loader asks for a whole batch of indices at
+//once, so the batch is gathered in one go instead of sample by sample.
+class CustomDataset : public torch::data::datasets::BatchDataset<CustomDataset, torch::data::Example<>> {
   private:
-      // data
-      // Should be 2 tensors
+      // data should be 2 uint8 tensors over the mapped files
       torch::Tensor images, labels;
       size_t img_size;
+      AugmentOptions augment;
   public:
-      CustomDataset(const std::string& root, bool train) {
+      CustomDataset(const std::string& root, bool train, AugmentOptions augment = AugmentOptions())
+          : augment(augment) {
           images = process_images(root, train);
           labels = process_labels(root, train);
+          TORCH_CHECK(labels.size(0) == images.size(0), "Image and label files of ", root, " hold ",
+                      images.size(0), " images and ", labels.size(0), " labels");
           img_size = images.size(0);
       }
 
-      //Returns the data sample at the given `index
-      torch::data::Example<> get(size_t index) override {
-          // This should return {torch::Tensor, torch::Tensor}
-          torch::Tensor img = images[index];
-          torch::Tensor label = labels[index];
-          return {img.clone(), label.clone()};
+      //Returns the float images and the labels at the given indices
+      //Runs on the data loader workers, so augmentation is done off the training thread
+      torch::data::Example<> get_batch(c10::ArrayRef<size_t> indices) override {
+          auto batch = gather_mnist_batch(images, labels, indices);
+          if (augment.enabled) {
+              batch.data = augment_batch(batch.data, augment);
+          }
+          return batch;
       };
 
     torch::optional<size_t> size() const override {
@@ -80,7 +100,8 @@ struct Net: torch::nn::Module {
 
     // Implement Forward Pass Algorithm
     torch::Tensor forward(torch::Tensor x) {
-      x = x.view({options.batchSize, -1});
+      //Flatten every image, whatever the number of images in the batch
+      x = x.view({x.size(0), -1});
       //Input -> Linear -> Relu -> Linear -> Relu -> Linear -> Softmax Classifier-> Output
         x = torch::relu(fc1->forward(x));
         x = torch::relu(fc2->forward(x));
@@ -92,32 +113,58 @@ struct Net: torch::nn::Module {
     torch::nn::Linear fc1{nullptr}, fc2{nullptr}, fc3{nullptr};
 };
 
+//Net for CPU inference with int8 Linear layers (see quantize.h)
+struct QuantizedNet : torch::nn::Module {
+    explicit QuantizedNet(Net& net) {
+        fc1 = register_module("fc1", DynamicQuantizedLinear(net.fc1));
+        fc2 = register_module("fc2", DynamicQuantizedLinear(net.fc2));
+        fc3 = register_module("fc3", DynamicQuantizedLinear(net.fc3));
+    }
+
+    torch::Tensor forward(torch::Tensor x) {
+        x = x.view({x.size(0), -1});
+        x = torch::relu(fc1->forward(x));
+        x = torch::relu(fc2->forward(x));
+        x = fc3->forward(x);
+        return torch::log_softmax(x, 1);
+    }
+
+    DynamicQuantizedLinear fc1{nullptr}, fc2{nullptr}, fc3{nullptr};
+};
+
 template <typename DataLoader>
 void train(std::shared_ptr<Net> network, DataLoader& loader, torch::optim::Optimizer& optimizer, size_t epoch, size_t data_size) {
   size_t index = 0;
   //Set network in the training mode
   network->train();
   float Loss = 0, Acc = 0;
+  EpochProfile profile(options.profiler, "train", epoch, options.device);
 
   for (auto& batch : loader) {
+    profile.mark(Phase::Data);
     auto data = batch.data.to(options.device);
     auto targets = batch.target.to(options.device).view({-1});
+    profile.mark(Phase::Copy);
     // Execute the model on the input data
     auto output = network->forward(data);
 
     //Using mean square error loss function to compute loss
     auto loss = torch::nll_loss(output, targets);
     auto acc = output.argmax(1).eq(targets).sum();
+    profile.mark(Phase::Forward);
 
     // Reset gradients
     optimizer.zero_grad();
     // Compute gradients
     loss.backward();
+    profile.mark(Phase::Backward);
     //Update the parameters
     optimizer.step();
 
     Loss += loss.template item<float>();
     Acc += acc.template item<float>();
+    profile.mark(Phase::Step);
+    profile.add_samples(targets.size(0));
 
   }
 
@@ -129,6 +176,7 @@ void train(std::shared_ptr<Net> network, DataLoader& loader, torch::optim::Optim
                 << "\tLoss: " << Loss / data_size << "\tAcc: " << Acc / data_size
                 << std::endl;
     }
+  profile.finish({{"loss", Loss / data_size}, {"accuracy", Acc / data_size}});
 };
 
 
@@ -138,10 +186,13 @@ void test(std::shared_ptr<Net> network, DataLoader& loader, size_t epoch, size_t
   size_t index = 0;
   float Loss = 0, Acc = 0;
   int display_count = 0;
+  EpochProfile profile(options.profiler, "test", epoch, options.device);
 
   for (const auto& batch : loader) {
+    profile.mark(Phase::Data);
     auto data = batch.data.to(options.device);
     auto targets = batch.target.to(options.device).view({-1});
+    profile.mark(Phase::Copy);
 
     auto output = network->forward(data);
     //To display 3 test image and its output
@@ -171,6 +222,8 @@ void test(std::shared_ptr<Net> network, DataLoader& loader, size_t epoch, size_t
 
     Loss += loss.template item<float>();
     Acc += acc.template item<float>();
+    profile.mark(Phase::Forward);
+    profile.add_samples(targets.size(0));
   }
 
   if (index++ % options.logInterval == 0) {
@@ -178,6 +231,7 @@ void test(std::shared_ptr<Net> network, DataLoader& loader, size_t epoch, size_t
     std::cout << "Val Epoch: " << epoch
               << "\tVal Loss: " << Loss / data_size << "\tVal ACC:"<< Acc / data_size << std::endl;
   }
+  profile.finish({{"loss", Loss / data_size}, {"accuracy", Acc / data_size}});
 }
 
 
@@ -190,20 +244,24 @@ int main() {
   //Path to Fashion Mnist
   std::string root_string = "./fashion-mnist/";
   bool isTrain = true; //Flag to create train or test data
+  options.augment.enabled = true;
 
-  //Uses Custom Dataset Class to load train data. Apply stack collation which takes
-  //batch of tensors and stacks them into single tensor along the first dimension
-  auto train_dataset = CustomDataset(root_string, isTrain).map(torch::data::transforms::Stack<>());
+  //Uses Custom Dataset Class to load train data. Its batches are single
+  //float tensors of the images stacked along the first dimension
+  auto train_dataset = CustomDataset(root_string, isTrain, options.augment);
+  auto train_size = train_dataset.size().value();
   //Data Loader provides options to speed up the data loading like batch size, number of workers
+  //and how many batches they may prepare ahead
+  auto loader_options = torch::data::DataLoaderOptions(options.batchSize)
+    .workers(options.workers).max_jobs(options.prefetchBatches);
   auto train_loader = torch::data::make_data_loader<torch::data::samplers::RandomSampler>(
-    std::move(train_dataset), options.batchSize);
-  auto train_size = train_dataset.size().value();
+    std::move(train_dataset), loader_options);
 
   //Process and load test dat similar to above
-  auto test_dataset = CustomDataset(root_string, false).map(torch::data::transforms::Stack<>());
-  auto test_loader = torch::data::make_data_loader<torch::data::samplers::RandomSampler>(
-    std::move(test_dataset), options.batchSize);
+  auto test_dataset = CustomDataset(root_string, false);
   auto test_size = test_dataset.size().value();
+  auto test_loader = torch::data::make_data_loader<torch::data::samplers::RandomSampler>(
+    std::move(test_dataset), loader_options);
 
   //Create Feed forward network
   auto net = std::make_shared<Net>();
@@ -213,6 +271,7 @@ int main() {
 
   options.loss_acc_train.open("loss_acc_train.txt");
   options.loss_acc_test.open("loss_acc_test.txt");
+  options.profiler.open(options.metricsPath, options.tracePath, options.workers);
 
   //Using stochastic gradient descent optimizer with learning rate 0.01
   torch::optim::SGD optimizer(net->parameters(), 0.01); // Learning Rate 0.01
@@ -227,5 +286,15 @@ int main() {
     torch::save(net, "net.pt");
   }
 
+  //Dynamic int8 quantization of the Linear layers for CPU-only deployment
+  if (torch::fbgemm_is_cpu_supported()) {
+    net->to(torch::kCPU);
+    auto quantized = std::make_shared<QuantizedNet>(*net);
+    torch::save(quantized, "net_quantized.pt");
+    report_quantization(net, "net.pt", quantized, "net_quantized.pt", *test_loader);
+  } else {
+    std::cout << "int8 quantization needs a CPU supported by fbgemm (AVX2), skipped" << std::endl;
+  }
+
   return 0;
 }
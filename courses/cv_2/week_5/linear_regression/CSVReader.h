@@ -1,8 +1,13 @@
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <torch/torch.h>
 //#include <boost/algorithm/string.hpp>
 
 // To read more about boost string algorithm:  https://theboostcpplibraries.com/boost.stringalgorithms
@@ -73,4 +78,111 @@ void CSVReader::Tokenize(std::string str, std::string delim,
       str = "";
     }
   }  
-}
\ No newline at end of file
+}
+
+/*
+ * Numeric table read from a csv file by readNumericCSV.
+ * data holds all values as one contiguous float tensor of rows x cols, so a
+ * batch of consecutive rows is a slice of it. min and max hold the range of
+ * every column.
+ */
+struct NumericCSV
+{
+  std::vector<std::string> columnNames;
+  torch::Tensor data;
+  torch::Tensor min;
+  torch::Tensor max;
+};
+
+/*
+* Reads a csv file of numbers in one pass. The file is read into memory at
+* once, every value is parsed in place with strtof and written straight into
+* the tensor, and the range of every column is updated as it is parsed. No
+* string is created per value or per line. The first line holds the column
+* names if header is true.
+*/
+NumericCSV readNumericCSV(const std::string& fileName, char delimeter = ',', bool header = true)
+{
+  std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+  if (!file)
+    throw std::runtime_error("Unable to open " + fileName);
+  std::string buffer(static_cast<size_t>(file.tellg()), '\0');
+  file.seekg(0);
+  file.read(&buffer[0], buffer.size());
+
+  const char* p = buffer.c_str();
+  const char* end = p + buffer.size();
+  NumericCSV csv;
+
+  // Column names, without quotes
+  if (header)
+  {
+    const char* lineEnd = std::find(p, end, '\n');
+    while (p < lineEnd)
+    {
+      const char* fieldEnd = std::find(p, lineEnd, delimeter);
+      std::string name(p, fieldEnd);
+      name.erase(std::remove_if(name.begin(), name.end(), [](char c) { return c == '"' || c == '\r'; }), name.end());
+      csv.columnNames.push_back(name);
+      p = fieldEnd < lineEnd ? fieldEnd + 1 : lineEnd;
+    }
+    p = lineEnd < end ? lineEnd + 1 : end;
+  }
+
+  // Upper bound of the number of rows to size the tensor, one line per row
+  int64_t maxRows = std::count(p, end, '\n') + 1;
+  int64_t cols = csv.columnNames.size();
+  if (cols == 0)
+  {
+    const char* lineEnd = std::find(p, end, '\n');
+    cols = std::count(p, lineEnd, delimeter) + 1;
+  }
+  csv.data = torch::empty({maxRows, cols}, torch::kFloat32);
+  csv.min = torch::full({cols}, std::numeric_limits<float>::max(), torch::kFloat32);
+  csv.max = torch::full({cols}, std::numeric_limits<float>::lowest(), torch::kFloat32);
+  float* out = csv.data.data_ptr<float>();
+  float* minm = csv.min.data_ptr<float>();
+  float* maxm = csv.max.data_ptr<float>();
+
+  int64_t rows = 0;
+  while (p < end)
+  {
+    // Skip empty lines
+    if (*p == '\n' || *p == '\r')
+    {
+      p++;
+      continue;
+    }
+    float* row = out + rows * cols;
+    for (int64_t j = 0; j < cols; j++)
+    {
+      // strtof skips white space, a missing value must not take the next line
+      char* next = const_cast<char*>(p);
+      float value = 0;
+      if (p < end && *p != '\n' && *p != '\r')
+        value = std::strtof(p, &next);
+      if (next == p)
+        throw std::runtime_error(fileName + ": no number at row " + std::to_string(rows + 1) +
+                                 ", column " + std::to_string(j + 1));
+      row[j] = value;
+      if (value < minm[j])
+        minm[j] = value;
+      if (value > maxm[j])
+        maxm[j] = value;
+      p = next;
+      if (j + 1 < cols)
+      {
+        if (p >= end || *p != delimeter)
+          throw std::runtime_error(fileName + ": expected " + std::to_string(cols) + " values at row " +
+                                   std::to_string(rows + 1));
+        p++;
+      }
+    }
+    // Rest of the line
+    while (p < end && *p != '\n')
+      p++;
+    rows++;
+  }
+  csv.data = csv.data.narrow(0, 0, rows);
+  return csv;
+}
@@ -1,9 +1,15 @@
 #include <stdint.h>
 #include <torch/torch.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <vector>
 #include "CSVReader.h"
+#include "profiler.h"
 
 // Reference: https://pytorch.org/tutorials/advanced/cpp_frontend.html
 
@@ -16,118 +22,95 @@ struct Options {
   std::string datasetPath = "./BostonHousing.csv";
   // For CPU use torch::kCPU and for GPU use torch::kCUDA
   torch::DeviceType device = torch::kCPU;
+  // How the model is fitted:
+  //   "sgd"      minibatch SGD over epochs, the baseline
+  //   "lbfgs"    full batch L-BFGS with strong Wolfe line search
+  //   "qr"       closed form least squares from the QR decomposition
+  //   "cholesky" closed form least squares from the normal equations
+  //   "all"      each of them in turn, to compare time and test loss
+  std::string solver = "all";
+  size_t lbfgsMaxSteps = 50;
+  double lbfgsTolerance = 1e-7; // stop when the loss changes less than this, relatively
+  // Per-phase timings of the SGD epochs, one JSON line per epoch, and a
+  // Chrome trace if tracePath is not empty
+  std::string metricsPath = "metrics.jsonl";
+  std::string tracePath = "";
+  TrainingProfiler profiler;
 };
 
 static Options options;
 
-// Convert string values from CSV to float and perform normalization
-std::vector<std::vector<float>> normalize_feature(std::vector<std::vector<std::string> > feat, int rows, int cols) {
-  std::vector<float> input(cols, 1);
-  // Declare 2D array to store nSamples x nfeatures
-  std::vector<std::vector<float>> data(rows, input);
-
-  for (int i = 0; i < cols; i++) {   	// each column has one feature
-      /* initialize the maximum element with 0 */
-      // std::stof is used to convert string to float
-      float maxm = std::stof(feat[1][i]);
-      float minm = std::stof(feat[1][i]);
-
-      // Run the inner loop over rows (all values of the feature) for given column (feature)
-      for (int j = 1; j < rows; j++) {
-          // check if any element is greater than the maximum element
-          // of the column and replace it
-          if (std::stof(feat[j][i]) > maxm)
-              maxm = std::stof(feat[j][i]);
-
-          if (std::stof(feat[j][i]) < minm)
-              minm = std::stof(feat[j][i]);
-      }
-
-
-      // From above loop, we have min and max value of the feature
-      // Will use min and max value to normalize values of the feature
-      for (int j = 0; j < rows-1; j++) {
-        // Normalize the feature values to lie between 0 and 1
-        data[j][i] = (std::stof(feat[j+1][i]) - minm)/(maxm - minm);
-      }
-  }
-
-  return data;
+// Normalize the features to lie between 0 and 1, using the range of every
+// column found while parsing. One vectorized pass over the features.
+torch::Tensor normalize_feature(const torch::Tensor& features, const torch::Tensor& minm, const torch::Tensor& maxm) {
+  return (features - minm) / (maxm - minm);
 }
 
-// Define Data to accomodate pairs of (feat, output)
-using Data = std::vector<std::pair<std::vector<float>, float>>;
-
 // Use CustomDataset class to load any type of dataset other than inbuilt datasets
 // Reference: https://github.com/pytorch/examples/blob/master/cpp/custom-dataset/custom-dataset.cpp
-
-class CustomDataset : public torch::data::datasets::Dataset<CustomDataset> {
+//
+// Features and outputs are rows of two contiguous tensors. It is a BatchDataset:
+// the data loader asks for a whole batch at once, and a batch of consecutive
+// rows is a slice of the tensors, without any copy.
+class CustomDataset : public torch::data::datasets::BatchDataset<CustomDataset, torch::data::Example<>> {
   using Example = torch::data::Example<>;
 
-  Data data;
+  torch::Tensor features, outputs;
 
  public:
-  CustomDataset(const Data& data) : data(data) {}
-
-  // Returns the Example at the given index, here we convert our data to tensors
-  Example get(size_t index) {
-    int fSize = data[index].first.size();
-    // Convert feature vector into tensor of size fSize x 1
-    auto tdata = torch::from_blob(&data[index].first, {fSize, 1});
-    // Convert output value into tensor of size 1
-    auto toutput = torch::from_blob(&data[index].second, {1});
-    return {tdata, toutput};
+  CustomDataset(const torch::Tensor& features, const torch::Tensor& outputs)
+      : features(features), outputs(outputs) {}
+
+  // Returns the features (batch x nfeatures) and outputs (batch) at the given indices
+  Example get_batch(c10::ArrayRef<size_t> indices) override {
+    bool consecutive = true;
+    for (size_t i = 1; i < indices.size() && consecutive; i++) {
+      consecutive = indices[i] == indices[0] + i;
+    }
+    if (consecutive) {
+      return {features.narrow(0, indices[0], indices.size()), outputs.narrow(0, indices[0], indices.size())};
+    }
+    auto index = torch::tensor(std::vector<int64_t>(indices.begin(), indices.end()));
+    return {features.index_select(0, index), outputs.index_select(0, index)};
   }
 
   // To get the size of the data
-  torch::optional<size_t> size() const {
-    return data.size();
+  torch::optional<size_t> size() const override {
+    return features.size(0);
   }
 };
 
 
-std::pair<Data, Data> readInfo() {
-  Data train, test;
-
-  // Reads data from CSV file.
-  // CSVReader class is defined in CSVReader.h header file
-  CSVReader reader(options.datasetPath);
-  std::vector<std::vector<std::string> > dataList = reader.getData();
+// Train and test sets, as (features, outputs) pairs of tensors
+using Data = std::pair<torch::Tensor, torch::Tensor>;
 
+std::pair<Data, Data> readInfo() {
+  // Reads data from CSV file straight into a tensor.
+  // readNumericCSV is defined in CSVReader.h header file
+  NumericCSV csv = readNumericCSV(options.datasetPath);
 
-  int N = dataList.size();	// Total number of data points
+  int N = csv.data.size(0);	// Total number of data points
   // As last column is output, feature size will be number of column minus one.
-  int fSize = dataList[0].size() - 1;
+  int fSize = csv.data.size(1) - 1;
   std::cout << "Total number of features: " << fSize << std::endl;
   std::cout << "Total number of data points: " << N << std::endl;
   int limit = 0.8*N;	// 80 percent data for training and rest 20 percent for validation
-  std::vector<float> input(fSize, 1);
-  std::vector<std::vector<float>> data(N, input);
 
   // Normalize data
-  data = normalize_feature(dataList, N, fSize);
-
-
-  for (int i=1; i < N; i++) {
-    for (int j= 0; j < fSize; j++) {
-        input[j] = data[i-1][j];
-    }
+  auto features = normalize_feature(csv.data.narrow(1, 0, fSize), csv.min.narrow(0, 0, fSize),
+                                    csv.max.narrow(0, 0, fSize));
+  auto outputs = csv.data.select(1, fSize).contiguous();
 
-    float output = std::stof(dataList[i][fSize]);
+  // Split data data into train and test set
+  Data train = {features.narrow(0, 0, limit), outputs.narrow(0, 0, limit)};
+  Data test = {features.narrow(0, limit, N - limit), outputs.narrow(0, limit, N - limit)};
 
-    // Split data data into train and test set
-    if (i <= limit) {
-      train.push_back({input, output});
-    } else {
-      test.push_back({input, output});
-    }
-  }
+  std::cout << "Total number of training data: " << train.first.size(0) << std::endl;
+  std::cout << "Total number of test data: " << test.first.size(0) << std::endl;
 
-  std::cout << "Total number of training data: " << train.size() << std::endl;
-  std::cout << "Total number of test data: " << test.size() << std::endl;
-
-  // Shuffle training data
-  std::random_shuffle(train.begin(), train.end());
+  // Shuffle training data, once
+  auto order = torch::randperm(limit, torch::kInt64);
+  train = {train.first.index_select(0, order), train.second.index_select(0, order)};
 
   return std::make_pair(train, test);
 }
@@ -161,24 +144,31 @@ void train(std::shared_ptr<Net> network, DataLoader& loader, torch::optim::Optim
   /*Set network in the training mode*/
   network->train();
   float Loss = 0;
+  EpochProfile profile(options.profiler, "train", epoch, options.device);
 
   for (auto& batch : loader) {
+    profile.mark(Phase::Data);
     auto data = batch.data.to(options.device);
     auto targets = batch.target.to(options.device).view({-1, 1});
+    profile.mark(Phase::Copy);
     // Execute the model on the input data
     auto output = network->forward(data);
 
     //Using mean square error loss function to compute loss
     auto loss = torch::mse_loss(output, targets);
+    profile.mark(Phase::Forward);
 
     // Reset gradients
     optimizer.zero_grad();
     // Compute gradients
     loss.backward();
+    profile.mark(Phase::Backward);
     //Update the parameters
     optimizer.step();
 
     Loss += loss.template item<float>();
+    profile.mark(Phase::Step);
+    profile.add_samples(targets.size(0));
 
     if (index++ % options.logInterval == 0) {
       auto end = std::min(data_size, (index + 1) * options.trainBatchSize);
@@ -187,6 +177,7 @@ void train(std::shared_ptr<Net> network, DataLoader& loader, torch::optim::Optim
                 << "\tLoss: " << Loss / end << std::endl;
     }
   }
+  profile.finish({{"loss", Loss / data_size}});
 }
 
 template <typename DataLoader>
@@ -215,6 +206,60 @@ void test(std::shared_ptr<Net> network, DataLoader& loader, size_t data_size) {
   }
 }
 
+// Mean squared error of the network over a whole set
+float full_loss(std::shared_ptr<Net> network, const Data& data) {
+  torch::NoGradGuard no_grad;
+  network->eval();
+  auto output = network->forward(data.first.to(options.device));
+  return torch::mse_loss(output, data.second.to(options.device).view({-1, 1})).template item<float>();
+}
+
+// Closed form least squares: the weights and bias minimizing the squared error
+// over the whole training set, solved in double precision. QR works on [X 1]
+// directly and is the stable choice, the normal equations (X^T X) w = X^T y
+// with a Cholesky factorization are faster but square the condition number.
+void fit_closed_form(std::shared_ptr<Net> network, const Data& train, bool useQR) {
+  torch::NoGradGuard no_grad;
+  auto x = torch::cat({train.first, torch::ones({train.first.size(0), 1})}, 1).to(torch::kFloat64);
+  auto y = train.second.view({-1, 1}).to(torch::kFloat64);
+  torch::Tensor w;
+  if (useQR) {
+    auto qr = torch::linalg_qr(x);
+    w = torch::linalg_solve_triangular(std::get<1>(qr), std::get<0>(qr).t().mm(y), /*upper=*/true);
+  } else {
+    auto l = torch::linalg_cholesky(x.t().mm(x));
+    w = torch::cholesky_solve(x.t().mm(y), l);
+  }
+  w = w.to(torch::kFloat32).to(options.device);
+  int fSize = train.first.size(1);
+  network->neuron->weight.copy_(w.narrow(0, 0, fSize).t());
+  network->neuron->bias.copy_(w[fSize]);
+}
+
+// Full batch L-BFGS, until the loss stops changing or after lbfgsMaxSteps steps
+void fit_lbfgs(std::shared_ptr<Net> network, const Data& train) {
+  network->train();
+  auto x = train.first.to(options.device);
+  auto y = train.second.to(options.device).view({-1, 1});
+  torch::optim::LBFGS optimizer(network->parameters(),
+                                torch::optim::LBFGSOptions(1).max_iter(20).line_search_fn("strong_wolfe"));
+  auto closure = [&]() {
+    optimizer.zero_grad();
+    auto loss = torch::mse_loss(network->forward(x), y);
+    loss.backward();
+    return loss;
+  };
+  float previous = std::numeric_limits<float>::max();
+  for (size_t step = 0; step < options.lbfgsMaxSteps; step++) {
+    float loss = optimizer.step(closure).template item<float>();
+    std::cout << "L-BFGS step: " << step + 1 << "\tLoss: " << loss << std::endl;
+    if (std::abs(previous - loss) <= options.lbfgsTolerance * std::max(1.0f, loss)) {
+      break;
+    }
+    previous = loss;
+  }
+}
+
 int main() {
   /*Sets manual seed from libtorch random number generators*/
   torch::manual_seed(1);
@@ -225,53 +270,89 @@ int main() {
   std::cout << "Running on: "
             << (options.device == torch::kCUDA ? "CUDA" : "CPU") << std::endl;
 
+  options.profiler.open(options.metricsPath, options.tracePath);
+
   /*Read data and split data into train and test sets*/
   auto data = readInfo();
+  int fSize = data.first.first.size(1);
 
-  /*Uses Custom Dataset Class to load train data. Apply stack collation which takes
-  batch of tensors and stacks them into single tensor along the first dimension*/
-  auto train_set =
-      CustomDataset(data.first).map(torch::data::transforms::Stack<>());
-  auto train_size = train_set.size().value();
-
-  /*Data Loader provides options to speed up the data loading like batch size, number of workers*/
-  auto train_loader =
-      torch::data::make_data_loader(
-          std::move(train_set), options.trainBatchSize);
-
-  std::cout << train_size << std::endl;
-  /*Uses Custom Dataset Class to load test data. Apply stack collation which takes
-  batch of tensors and stacks them into single tensor along the first dimension*/
-  auto test_set =
-      CustomDataset(data.second).map(torch::data::transforms::Stack<>());
-  auto test_size = test_set.size().value();
-
-  /*Test data loader similar to train data loader*/
-  auto test_loader =
-      torch::data::make_data_loader(
-          std::move(test_set), options.testBatchSize);
-  /*Create Linear  Regression Network*/
-  auto net = std::make_shared<Net>(13, 1);
-
-  /*Moving model parameters to correct device*/
-  net->to(options.device);
-
-  /*Using stochastic gradient descent optimizer with learning rate 0.000001*/
-  torch::optim::SGD optimizer(
-       net->parameters(), torch::optim::SGDOptions(0.000001));
-
-  std::cout << "Training..." << std::endl;
-  for (size_t i = 0; i < options.epochs; ++i) {
-    /*Run the training for all iterations*/
-    train(net, *train_loader, optimizer, i + 1, train_size);
-    std::cout << std::endl;
-
-    if (i == options.epochs - 1) {
-      std::cout << "Testing..." << std::endl;
-      test(net, *test_loader, test_size);
+  std::vector<std::string> solvers;
+  if (options.solver == "all") {
+    solvers = {"sgd", "lbfgs", "qr", "cholesky"};
+  } else {
+    solvers = {options.solver};
+  }
+
+  struct SolverResult {
+    std::string solver;
+    double seconds;
+    float trainLoss;
+    float testLoss;
+  };
+  std::vector<SolverResult> results;
+
+  for (const auto& solver : solvers) {
+    /*Create Linear  Regression Network, with the same initial weights for every solver*/
+    torch::manual_seed(1);
+    auto net = std::make_shared<Net>(fSize, 1);
+
+    /*Moving model parameters to correct device*/
+    net->to(options.device);
+
+    std::cout << "Training with " << solver << "..." << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    if (solver == "sgd") {
+      /*Uses Custom Dataset Class to load train data. Its batches are slices of
+      the features and outputs tensors*/
+      auto train_set =
+          CustomDataset(data.first.first, data.first.second);
+      auto train_size = train_set.size().value();
+
+      /*Data Loader provides options to speed up the data loading like batch size, number of workers*/
+      auto train_loader =
+          torch::data::make_data_loader(
+              std::move(train_set), options.trainBatchSize);
+
+      /*Using stochastic gradient descent optimizer with learning rate 0.000001*/
+      torch::optim::SGD optimizer(
+           net->parameters(), torch::optim::SGDOptions(0.000001));
+
+      for (size_t i = 0; i < options.epochs; ++i) {
+        /*Run the training for all iterations*/
+        train(net, *train_loader, optimizer, i + 1, train_size);
+        std::cout << std::endl;
+      }
+    } else if (solver == "lbfgs") {
+      fit_lbfgs(net, data.first);
+    } else if (solver == "qr" || solver == "cholesky") {
+      fit_closed_form(net, data.first, solver == "qr");
+    } else {
+      std::cout << "Unknown solver " << solver << std::endl;
+      continue;
     }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /*Uses Custom Dataset Class to load test data*/
+    auto test_set =
+        CustomDataset(data.second.first, data.second.second);
+    auto test_size = test_set.size().value();
+
+    /*Test data loader similar to train data loader*/
+    auto test_loader =
+        torch::data::make_data_loader(
+            std::move(test_set), options.testBatchSize);
+    std::cout << "Testing..." << std::endl;
+    test(net, *test_loader, test_size);
+
+    results.push_back({solver, seconds, full_loss(net, data.first), full_loss(net, data.second)});
   }
 
+  std::cout << std::endl << std::setw(10) << "solver" << std::setw(12) << "time (s)"
+            << std::setw(12) << "train loss" << std::setw(12) << "test loss" << std::endl;
+  for (const auto& result : results) {
+    std::cout << std::setw(10) << result.solver << std::setw(12) << result.seconds
+              << std::setw(12) << result.trainLoss << std::setw(12) << result.testLoss << std::endl;
+  }
 
   return 0;
 }